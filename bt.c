@@ -341,8 +341,7 @@ int wilc_bt_power_up(struct wilc *wilc, int source)
 {
 	int count = 0;
 	int ret;
-	int reg;
-	const struct wilc_hif_func *hif_func = wilc->hif_func;
+	struct wilc_reg_op ops[2];
 
 	mutex_lock(&wilc->cs);
 
@@ -399,41 +398,15 @@ int wilc_bt_power_up(struct wilc *wilc, int source)
 			acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_BT);
 
 			/*TicketId1115*/
-			/*Disable awake coex null frames*/
-			ret = hif_func->hif_read_reg(wilc,
-						     COE_AUTO_PS_ON_NULL_PKT,
-						     &reg);
-			if (ret) {
-				pr_err("[wilc start]: fail read reg %x\n",
-				       COE_AUTO_PS_ON_NULL_PKT);
-				goto fail;
-			}
-			reg &= ~BIT(30);
-			ret = hif_func->hif_write_reg(wilc,
-						      COE_AUTO_PS_ON_NULL_PKT,
-						      reg);
+			/*Disable awake and doze coex null frames*/
+			ops[0] = WILC_REG_OP_CLEAR(COE_AUTO_PS_ON_NULL_PKT,
+						   BIT(30));
+			ops[1] = WILC_REG_OP_CLEAR(COE_AUTO_PS_OFF_NULL_PKT,
+						   BIT(30));
+			ret = wilc_wlan_reg_batch(wilc, ops, ARRAY_SIZE(ops));
 			if (ret) {
-				pr_err("[wilc start]: fail write reg %x\n",
-				       COE_AUTO_PS_ON_NULL_PKT);
-				goto fail;
-			}
-
-			/*TicketId1115*/
-			/*Disable doze coex null frames*/
-			ret = hif_func->hif_read_reg(wilc,
-						     COE_AUTO_PS_OFF_NULL_PKT,
-						     &reg);
-			if (ret) {
-				pr_err("[wilc start]: fail read reg %x\n",
-				       COE_AUTO_PS_OFF_NULL_PKT);
-				goto fail;
-			}
-			reg &= ~BIT(30);
-			ret = hif_func->hif_write_reg(wilc,
-						      COE_AUTO_PS_OFF_NULL_PKT,
-						      reg);
-			if (ret) {
-				pr_err("[wilc start]: fail write reg %x\n",
+				pr_err("[wilc start]: fail clear reg %x/%x\n",
+				       COE_AUTO_PS_ON_NULL_PKT,
 				       COE_AUTO_PS_OFF_NULL_PKT);
 				goto fail;
 			}
@@ -444,18 +417,10 @@ int wilc_bt_power_up(struct wilc *wilc, int source)
 		/* Enable BT wakeup */
 		acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_BT);
 
-		ret = hif_func->hif_read_reg(wilc, PWR_SEQ_MISC_CTRL,
-					     &reg);
-		if (ret) {
-			pr_err("[wilc start]: fail read reg %x ...\n",
-			       PWR_SEQ_MISC_CTRL);
-			goto fail;
-		}
-		reg |= BIT(29);
-		ret = hif_func->hif_write_reg(wilc, PWR_SEQ_MISC_CTRL,
-					      reg);
+		ops[0] = WILC_REG_OP_SET(PWR_SEQ_MISC_CTRL, BIT(29));
+		ret = wilc_wlan_reg_batch(wilc, ops, 1);
 		if (ret) {
-			pr_err("[wilc start]: fail write reg %x ...\n",
+			pr_err("[wilc start]: fail set reg %x ...\n",
 			       PWR_SEQ_MISC_CTRL);
 			goto fail;
 		}
@@ -495,7 +495,13 @@ static int connect(struct wiphy *wiphy, struct net_device *dev,
 	if (vif->iftype != WILC_CLIENT_MODE)
 		vif->wilc->sta_ch = ch;
 
-	wilc_wlan_set_bssid(dev, bss->bssid, WILC_STATION_MODE);
+	ret = wilc_wlan_set_bssid(dev, bss->bssid, WILC_STATION_MODE);
+	if (ret) {
+		if (vif->iftype != WILC_CLIENT_MODE)
+			vif->wilc->sta_ch = WILC_INVALID_CHANNEL;
+		kfree(join_params);
+		goto out_put_bss;
+	}
 
 	wfi_drv->conn_info.security = security;
 	wfi_drv->conn_info.auth_type = auth_type;
@@ -1681,7 +1687,9 @@ static int start_ap(struct wiphy *wiphy, struct net_device *dev,
 	if (ret != 0)
 		netdev_err(dev, "Error in setting channel\n");
 
-	wilc_wlan_set_bssid(dev, dev->dev_addr, WILC_AP_MODE);
+	ret = wilc_wlan_set_bssid(dev, dev->dev_addr, WILC_AP_MODE);
+	if (ret)
+		return ret;
 
 	return wilc_add_beacon(vif, settings->beacon_interval,
 				   settings->dtim_period, &settings->beacon);
@@ -1954,6 +1962,7 @@ static int del_virtual_intf(struct wiphy *wiphy, struct wireless_dev *wdev)
 	    wdev->iftype == NL80211_IFTYPE_P2P_GO)
 		wilc_wfi_deinit_mon_interface(wl, true);
 	vif = netdev_priv(wdev->netdev);
+	wilc_wlan_set_bssid(vif->ndev, NULL, vif->iftype);
 	cfg80211_unregister_netdevice(vif->ndev);
 	vif->monitor_flag = 0;
 
@@ -2123,16 +2132,19 @@ static const struct cfg80211_ops wilc_cfg80211_ops = {
 static void wlan_init_locks(struct wilc *wl)
 {
 	mutex_init(&wl->hif_cs);
-	mutex_init(&wl->rxq_cs);
 	mutex_init(&wl->cfg_cmd_lock);
 	mutex_init(&wl->vif_mutex);
 	mutex_init(&wl->deinit_lock);
 	mutex_init(&wl->cs);
+	mutex_init(&wl->ac_map_lock);
 
-	spin_lock_init(&wl->txq_spinlock);
+	spin_lock_init(&wl->tx_bql_lock);
+	spin_lock_init(&wl->bssid_lock);
+	hash_init(wl->bssid_hash);
 	mutex_init(&wl->txq_add_to_head_cs);
 
 	init_completion(&wl->txq_event);
+	init_waitqueue_head(&wl->fw_event_wq);
 	init_completion(&wl->cfg_event);
 	init_completion(&wl->sync_event);
 	init_completion(&wl->txq_thread_started);
@@ -2143,10 +2155,10 @@ static void wlan_init_locks(struct wilc *wl)
 void wlan_deinit_locks(struct wilc *wilc)
 {
 	mutex_destroy(&wilc->hif_cs);
-	mutex_destroy(&wilc->rxq_cs);
 	mutex_destroy(&wilc->cfg_cmd_lock);
 	mutex_destroy(&wilc->txq_add_to_head_cs);
 	mutex_destroy(&wilc->vif_mutex);
+	mutex_destroy(&wilc->ac_map_lock);
 	mutex_destroy(&wilc->cs);
 	mutex_destroy(&wilc->deinit_lock);
 	cleanup_srcu_struct(&wilc->srcu);
@@ -2169,16 +2181,27 @@ int wilc_cfg80211_init(struct wilc **wilc, struct device *dev, int io_type,
 	if (ret)
 		goto free_wl;
 
+	ret = wilc_wlan_txq_pool_init(wl);
+	if (ret)
+		goto free_wlan_cfg;
+
+	ret = wilc_wlan_ac_map_init(wl);
+	if (ret)
+		goto free_txq_pool;
+
 #ifdef WILC_DEBUGFS
-	wilc_debugfs_init();
+	wilc_debugfs_init(wl);
 #endif
 	*wilc = wl;
 	wl->io_type = io_type;
 	wl->hif_func = ops;
-	for (i = 0; i < NQUEUES; i++)
-		INIT_LIST_HEAD(&wl->txq[i].txq_head.list);
+	for (i = 0; i < NQUEUES; i++) {
+		init_llist_head(&wl->txq[i].head_add);
+		init_llist_head(&wl->txq[i].tail_add);
+		INIT_LIST_HEAD(&wl->txq[i].txq_head);
+	}
+	wilc_wlan_ac_share_init(wl);
 
-	INIT_LIST_HEAD(&wl->rxq_head.list);
 	INIT_LIST_HEAD(&wl->vif_list);
 
 	wl->hif_workqueue = create_singlethread_workqueue("wlan0_wq");
@@ -2186,24 +2209,41 @@ int wilc_cfg80211_init(struct wilc **wilc, struct device *dev, int io_type,
 		ret = -ENOMEM;
 		goto free_cfg;
 	}
+
+	ret = wilc_wlan_tx_work_init(wl);
+	if (ret)
+		goto free_hq;
+
+	ret = wilc_wlan_rx_work_init(wl);
+	if (ret)
+		goto free_tx_wq;
+
 	vif = wilc_netdev_ifc_init(wl, "wlan%d", WILC_STATION_MODE,
 				   NL80211_IFTYPE_STATION, false);
 	if (IS_ERR(vif)) {
 		ret = PTR_ERR(vif);
-		goto free_hq;
+		goto free_rx_wq;
 	}
 
 	wilc_sysfs_init(wl);
 
 	return 0;
 
+free_rx_wq:
+	wilc_wlan_rx_work_deinit(wl);
+free_tx_wq:
+	wilc_wlan_tx_work_deinit(wl);
 free_hq:
 	destroy_workqueue(wl->hif_workqueue);
 
 free_cfg:
 #ifdef WILC_DEBUGFS
-	wilc_debugfs_remove();
+	wilc_debugfs_remove(wl);
 #endif
+	wilc_wlan_ac_map_deinit(wl);
+free_txq_pool:
+	wilc_wlan_txq_pool_deinit(wl);
+free_wlan_cfg:
 	wilc_wlan_cfg_deinit(wl);
 free_wl:
 	wlan_deinit_locks(wl);
@@ -6,8 +6,11 @@
 
 #include <linux/module.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <net/ipv6.h>
 
-#include "debugfs.h"
+#include "netdev.h"
 
 atomic_t WILC_DEBUG_REGION = ATOMIC_INIT(INIT_DBG | GENERIC_DBG |
 					 CFG80211_DBG | HOSTAPD_DBG |
@@ -15,6 +18,10 @@ atomic_t WILC_DEBUG_REGION = ATOMIC_INIT(INIT_DBG | GENERIC_DBG |
 
 #if defined(WILC_DEBUGFS)
 static struct dentry *wilc_dir;
+static unsigned int wilc_dir_users;
+static DEFINE_MUTEX(wilc_dir_lock);
+/* devices with a directory under wilc_dir, under wilc_dir_lock */
+static LIST_HEAD(wilc_devs);
 
 static ssize_t wilc_debug_region_read(struct file *file, char __user *userbuf,
 				     size_t count, loff_t *ppos)
@@ -57,6 +64,361 @@ static ssize_t wilc_debug_region_write(struct file *filp,
 	return count;
 }
 
+static int wilc_txq_pool_show(struct seq_file *s, void *unused)
+{
+	struct wilc *wl = s->private;
+	struct wilc_txq_pool_stats *st = &wl->txq_pool_stats;
+	long allocs = atomic_long_read(&st->allocs);
+	long slab = atomic_long_read(&st->slab_allocs);
+
+	seq_printf(s, "reserve: %d\n", WILC_TXQ_POOL_RESERVE);
+	seq_printf(s, "allocs: %ld\n", allocs);
+	seq_printf(s, "hits: %ld\n", max(allocs - slab, 0L));
+	seq_printf(s, "misses: %ld\n", atomic_long_read(&st->misses));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wilc_txq_pool);
+
+static int wilc_ack_filter_show(struct seq_file *s, void *unused)
+{
+	struct wilc *wl = s->private;
+	struct wilc_ack_flow *flow;
+	struct wilc_vif *vif;
+	unsigned long flags;
+	int srcu_idx;
+
+	srcu_idx = srcu_read_lock(&wl->srcu);
+	list_for_each_entry_rcu(vif, &wl->vif_list, list) {
+		struct tcp_ack_filter *f = &vif->ack_filter;
+
+		spin_lock_irqsave(&f->lock, flags);
+		seq_printf(s, "%s: %u flows\n", vif->ndev->name, f->nr_flows);
+		list_for_each_entry(flow, &f->lru, lru) {
+			struct wilc_ack_flow_key *k = &flow->key;
+
+			if (ipv6_addr_v4mapped(&k->saddr))
+				seq_printf(s, "  %pI4:%u > %pI4:%u",
+					   &k->saddr.s6_addr32[3],
+					   ntohs(k->sport),
+					   &k->daddr.s6_addr32[3],
+					   ntohs(k->dport));
+			else
+				seq_printf(s, "  [%pI6c]:%u > [%pI6c]:%u",
+					   &k->saddr, ntohs(k->sport),
+					   &k->daddr, ntohs(k->dport));
+			seq_printf(s, " suppressed %llu\n", flow->suppressed);
+		}
+		spin_unlock_irqrestore(&f->lock, flags);
+	}
+	srcu_read_unlock(&wl->srcu, srcu_idx);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wilc_ack_filter);
+
+static int wilc_tx_backoff_show(struct seq_file *s, void *unused)
+{
+	struct wilc *wl = s->private;
+	struct wilc_tx_backoff_stats *st = &wl->tx_backoff_stats;
+	int i;
+
+	seq_printf(s, "woken: %ld\n", atomic_long_read(&st->woken));
+	seq_printf(s, "timeouts: %ld\n", atomic_long_read(&st->timeouts));
+	for (i = 0; i < WILC_BACKOFF_HIST_BUCKETS; i++)
+		seq_printf(s, "%s%lu us: %ld\n",
+			   i == WILC_BACKOFF_HIST_BUCKETS - 1 ? ">=" : "<",
+			   i == WILC_BACKOFF_HIST_BUCKETS - 1 ? BIT(i - 1) :
+			   BIT(i), atomic_long_read(&st->hist[i]));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wilc_tx_backoff);
+
+static int wilc_tx_batch_show(struct seq_file *s, void *unused)
+{
+	struct wilc *wl = s->private;
+	struct wilc_tx_batch_stats *st = &wl->tx_batch_stats;
+	int i;
+
+	seq_printf(s, "batches: %llu\n", READ_ONCE(st->batches));
+	seq_printf(s, "deferred: %ld\n", atomic_long_read(&st->deferred));
+	seq_printf(s, "holdoffs: %ld\n", atomic_long_read(&st->holdoffs));
+	for (i = 1; i < WILC_TX_BATCH_HIST_BUCKETS; i++)
+		seq_printf(s, ">=%lu pkts: %ld\n", BIT(i - 1),
+			   atomic_long_read(&st->hist[i]));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wilc_tx_batch);
+
+static int wilc_rx_page_show(struct seq_file *s, void *unused)
+{
+	struct wilc *wl = s->private;
+	struct wilc_rx_page_stats *st = &wl->rx_page_stats;
+
+	seq_printf(s, "pool: %s\n", wl->rx_page_pool ? "on" : "off");
+	seq_printf(s, "frags: %ld\n", atomic_long_read(&st->frags));
+	seq_printf(s, "copies: %ld\n", atomic_long_read(&st->copies));
+	seq_printf(s, "fallbacks: %ld\n", atomic_long_read(&st->fallbacks));
+	seq_printf(s, "ring: %u queued, %lu overruns\n",
+		   READ_ONCE(wl->rx_ring.head) - READ_ONCE(wl->rx_ring.tail),
+		   READ_ONCE(wl->rx_ring.overruns));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wilc_rx_page);
+
+static int wilc_rx_drops_show(struct seq_file *s, void *unused)
+{
+	struct wilc *wl = s->private;
+	struct wilc_rx_drop_stats *st = &wl->rx_drop_stats;
+
+	seq_printf(s, "corrupt: %ld\n", atomic_long_read(&st->corrupt));
+	seq_printf(s, "no_vif: %ld\n", atomic_long_read(&st->no_vif));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wilc_rx_drops);
+
+static int wilc_rx_poll_show(struct seq_file *s, void *unused)
+{
+	struct wilc *wl = s->private;
+	struct wilc_rx_poll_stats *st = &wl->rx_poll_stats;
+
+	seq_printf(s, "irqs: %llu\n", READ_ONCE(st->irqs));
+	seq_printf(s, "irqs_per_sec: %u\n", READ_ONCE(st->irq_rate));
+	seq_printf(s, "bursts: %llu\n", READ_ONCE(st->bursts));
+	seq_printf(s, "polled: %llu\n", READ_ONCE(st->polled));
+	seq_printf(s, "saved_per_sec: %u\n", READ_ONCE(st->saved_rate));
+	seq_printf(s, "replays: %llu\n", READ_ONCE(st->replays));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wilc_rx_poll);
+
+static int wilc_bus_show(struct seq_file *s, void *unused)
+{
+	struct wilc *wl = s->private;
+	u64 submits = READ_ONCE(wl->bus_stats.submits);
+	u64 bytes = READ_ONCE(wl->bus_stats.bytes);
+	u64 ns = READ_ONCE(wl->bus_stats.ns);
+
+	seq_printf(s, "submits: %llu\n", submits);
+	seq_printf(s, "bytes: %llu\n", bytes);
+	seq_printf(s, "submits_per_mb: %llu\n",
+		   bytes ? div64_u64(submits << 20, bytes) : 0);
+	/* while on the bus, so what the transfer path itself sustains */
+	seq_printf(s, "bytes_per_sec: %llu\n",
+		   ns ? mul_u64_u64_div_u64(bytes, NSEC_PER_SEC, ns) : 0);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wilc_bus);
+
+static const char * const wilc_ac_names[NQUEUES] = {
+	[AC_VO_Q] = "vo",
+	[AC_VI_Q] = "vi",
+	[AC_BE_Q] = "be",
+	[AC_BK_Q] = "bk",
+};
+
+static int wilc_ac_map_show(struct seq_file *s, void *unused)
+{
+	struct wilc *wl = s->private;
+	const struct wilc_ac_map *map;
+	int i;
+
+	rcu_read_lock();
+	map = rcu_dereference(wl->ac_map);
+	seq_puts(s, "dscp:");
+	for (i = 0; i < WILC_DSCP_NUM; i++)
+		seq_printf(s, "%s%s", i % 8 ? " " : "\n  ",
+			   wilc_ac_names[map->dscp[i]]);
+	seq_puts(s, "\nprio:\n ");
+	for (i = 0; i < WILC_PRIO_NUM; i++)
+		seq_printf(s, " %s", wilc_ac_names[map->prio[i]]);
+	rcu_read_unlock();
+
+	seq_puts(s, "\nenqueued:\n");
+	for (i = 0; i < NQUEUES; i++)
+		seq_printf(s, "  %s: %ld\n", wilc_ac_names[i],
+			   atomic_long_read(&wl->tx_ac_enqueued[i]));
+
+	return 0;
+}
+
+static int wilc_ac_map_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wilc_ac_map_show, inode->i_private);
+}
+
+/* "dscp <0-63> <ac>" or "prio <0-7> <ac>", ac one of vo, vi, be, bk */
+static ssize_t wilc_ac_map_write(struct file *file, const char __user *ubuf,
+				 size_t count, loff_t *ppos)
+{
+	struct wilc *wl = ((struct seq_file *)file->private_data)->private;
+	char buf[32], table[8], ac_name[8];
+	unsigned int idx;
+	int ac, ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%7s %u %7s", table, &idx, ac_name) != 3)
+		return -EINVAL;
+
+	ac = match_string(wilc_ac_names, NQUEUES, ac_name);
+	if (ac < 0)
+		return ac;
+
+	if (!strcmp(table, "dscp"))
+		ret = wilc_wlan_ac_map_set(wl, false, idx, ac);
+	else if (!strcmp(table, "prio"))
+		ret = wilc_wlan_ac_map_set(wl, true, idx, ac);
+	else
+		ret = -EINVAL;
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations wilc_ac_map_fops = {
+	.owner		= THIS_MODULE,
+	.open		= wilc_ac_map_open,
+	.read		= seq_read,
+	.write		= wilc_ac_map_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const char * const wilc_tx_lat_stage_names[WILC_TX_LAT_STAGES] = {
+	[WILC_TX_LAT_QUEUE] = "queue",
+	[WILC_TX_LAT_VMM] = "vmm",
+	[WILC_TX_LAT_BUS] = "bus",
+	[WILC_TX_LAT_TOTAL] = "total",
+};
+
+static int wilc_tx_latency_show(struct seq_file *s, void *unused)
+{
+	struct wilc *wl = s->private;
+	struct wilc_tx_lat_stats *st = &wl->tx_lat_stats;
+	int ac, stage, i;
+
+	seq_printf(s, "enabled: %d\n",
+		   static_branch_unlikely(&wilc_tx_lat_key));
+	for (ac = 0; ac < NQUEUES; ac++) {
+		atomic_long_t (*hist)[WILC_TX_LAT_HIST_BUCKETS] = st->hist[ac];
+
+		seq_printf(s, "%s:\n  latency_us", wilc_ac_names[ac]);
+		for (stage = 0; stage < WILC_TX_LAT_STAGES; stage++)
+			seq_printf(s, " %-8s", wilc_tx_lat_stage_names[stage]);
+		seq_putc(s, '\n');
+		for (i = 0; i < WILC_TX_LAT_HIST_BUCKETS; i++) {
+			seq_printf(s, "  >=%-8lu", i ? BIT(i - 1) : 0UL);
+			for (stage = 0; stage < WILC_TX_LAT_STAGES; stage++)
+				seq_printf(s, " %-8ld",
+					   atomic_long_read(&hist[stage][i]));
+			seq_putc(s, '\n');
+		}
+	}
+
+	return 0;
+}
+
+static int wilc_tx_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wilc_tx_latency_show, inode->i_private);
+}
+
+static void wilc_tx_latency_clear(struct wilc_tx_lat_stats *st)
+{
+	int ac, stage, i;
+
+	for (ac = 0; ac < NQUEUES; ac++)
+		for (stage = 0; stage < WILC_TX_LAT_STAGES; stage++)
+			for (i = 0; i < WILC_TX_LAT_HIST_BUCKETS; i++)
+				atomic_long_set(&st->hist[ac][stage][i], 0);
+}
+
+/*
+ * A boolean. wilc_tx_lat_key is one for the module, so any device's file
+ * switches tracking for all of them, and switching it on starts every
+ * device's histograms afresh.
+ */
+static ssize_t wilc_tx_latency_write(struct file *file,
+				     const char __user *ubuf, size_t count,
+				     loff_t *ppos)
+{
+	struct wilc *wl;
+	bool enable;
+	int ret;
+
+	ret = kstrtobool_from_user(ubuf, count, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&wilc_dir_lock);
+	if (!enable) {
+		static_branch_disable(&wilc_tx_lat_key);
+		goto out;
+	}
+
+	if (static_branch_unlikely(&wilc_tx_lat_key))
+		goto out;
+
+	list_for_each_entry(wl, &wilc_devs, debugfs_node)
+		wilc_tx_latency_clear(&wl->tx_lat_stats);
+	static_branch_enable(&wilc_tx_lat_key);
+out:
+	mutex_unlock(&wilc_dir_lock);
+
+	return count;
+}
+
+static const struct file_operations wilc_tx_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= wilc_tx_latency_open,
+	.read		= seq_read,
+	.write		= wilc_tx_latency_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const char * const wilc_poll_site_names[WILC_POLL_SITES] = {
+	[WILC_POLL_TX_CTRL] = "tx_ctrl",
+	[WILC_POLL_VMM_CTL] = "vmm_ctl",
+	[WILC_POLL_CORTUS_0] = "cortus_0",
+	[WILC_POLL_WAKEUP] = "wakeup",
+	[WILC_POLL_SLEEP] = "sleep",
+};
+
+static int wilc_poll_show(struct seq_file *s, void *unused)
+{
+	struct wilc *wl = s->private;
+	int site, i;
+
+	for (site = 0; site < WILC_POLL_SITES; site++) {
+		struct wilc_poll_stats *st = &wl->poll_stats[site];
+
+		seq_printf(s, "%s: ewma %llu ns, timeouts %ld\n",
+			   wilc_poll_site_names[site], READ_ONCE(st->ewma_ns),
+			   atomic_long_read(&st->timeouts));
+		seq_puts(s, "  bucket  reads  latency_us\n");
+		for (i = 0; i < WILC_POLL_HIST_BUCKETS; i++)
+			seq_printf(s, "  >=%-5lu %-6ld %ld\n",
+				   i ? BIT(i - 1) : 0UL,
+				   atomic_long_read(&st->iter_hist[i]),
+				   atomic_long_read(&st->lat_hist[i]));
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wilc_poll);
+
 #define FOPS(_open, _read, _write, _poll) { \
 		.owner	= THIS_MODULE, \
 		.open	= (_open), \
@@ -82,14 +444,22 @@ static struct wilc_debugfs_info_t debugfs_info[] = {
 	},
 };
 
-int wilc_debugfs_init(void)
+/* the "wilc" directory and the global files in it, shared by all devices */
+static int wilc_debugfs_get(void)
 {
 	int i;
 	struct wilc_debugfs_info_t *info;
 
+	mutex_lock(&wilc_dir_lock);
+	if (wilc_dir_users++)
+		goto out;
+
 	wilc_dir = debugfs_create_dir("wilc", NULL);
-	if (wilc_dir == NULL) {
+	if (IS_ERR_OR_NULL(wilc_dir)) {
 		pr_err("Error creating debugfs\n");
+		wilc_dir = NULL;
+		wilc_dir_users--;
+		mutex_unlock(&wilc_dir_lock);
 		return -EFAULT;
 	}
 	for (i = 0; i < ARRAY_SIZE(debugfs_info); i++) {
@@ -100,12 +470,71 @@ int wilc_debugfs_init(void)
 				    &info->data,
 				    &info->fops);
 	}
+out:
+	mutex_unlock(&wilc_dir_lock);
 	return 0;
 }
 
-void wilc_debugfs_remove(void)
+static void wilc_debugfs_put(void)
 {
-	debugfs_remove_recursive(wilc_dir);
+	mutex_lock(&wilc_dir_lock);
+	if (!--wilc_dir_users) {
+		debugfs_remove_recursive(wilc_dir);
+		wilc_dir = NULL;
+	}
+	mutex_unlock(&wilc_dir_lock);
+}
+
+/* per-device statistics go in a directory named after the bus device */
+int wilc_debugfs_init(struct wilc *wl)
+{
+	struct dentry *dir;
+	int ret;
+
+	ret = wilc_debugfs_get();
+	if (ret)
+		return ret;
+
+	dir = debugfs_create_dir(dev_name(wiphy_dev(wl->wiphy)), wilc_dir);
+	if (IS_ERR_OR_NULL(dir)) {
+		pr_err("Error creating debugfs for %s\n",
+		       dev_name(wiphy_dev(wl->wiphy)));
+		wilc_debugfs_put();
+		return -EFAULT;
+	}
+	wl->debugfs_dir = dir;
+	mutex_lock(&wilc_dir_lock);
+	list_add(&wl->debugfs_node, &wilc_devs);
+	mutex_unlock(&wilc_dir_lock);
+
+	debugfs_create_file("txq_pool", 0444, dir, wl, &wilc_txq_pool_fops);
+	debugfs_create_file("ack_filter", 0444, dir, wl,
+			    &wilc_ack_filter_fops);
+	debugfs_create_file("tx_backoff", 0444, dir, wl,
+			    &wilc_tx_backoff_fops);
+	debugfs_create_file("poll", 0444, dir, wl, &wilc_poll_fops);
+	debugfs_create_file("tx_batch", 0444, dir, wl, &wilc_tx_batch_fops);
+	debugfs_create_file("ac_map", 0644, dir, wl, &wilc_ac_map_fops);
+	debugfs_create_file("tx_latency", 0644, dir, wl,
+			    &wilc_tx_latency_fops);
+	debugfs_create_file("rx_page", 0444, dir, wl, &wilc_rx_page_fops);
+	debugfs_create_file("rx_drops", 0444, dir, wl, &wilc_rx_drops_fops);
+	debugfs_create_file("rx_poll", 0444, dir, wl, &wilc_rx_poll_fops);
+	debugfs_create_file("bus", 0444, dir, wl, &wilc_bus_fops);
+	return 0;
+}
+
+void wilc_debugfs_remove(struct wilc *wl)
+{
+	if (!wl->debugfs_dir)
+		return;
+
+	mutex_lock(&wilc_dir_lock);
+	list_del(&wl->debugfs_node);
+	mutex_unlock(&wilc_dir_lock);
+	debugfs_remove_recursive(wl->debugfs_dir);
+	wl->debugfs_dir = NULL;
+	wilc_debugfs_put();
 }
 
 #endif
@@ -47,8 +47,10 @@ extern atomic_t WILC_DEBUG_REGION;
 	__func__, __LINE__, ##__VA_ARGS__)
 
 #ifdef WILC_DEBUGFS
-int wilc_debugfs_init(void);
-void wilc_debugfs_remove(void);
+struct wilc;
+
+int wilc_debugfs_init(struct wilc *wl);
+void wilc_debugfs_remove(struct wilc *wl);
 #endif
 
 #endif /* WILC_DEBUGFS_H */
@@ -16,6 +16,9 @@
 #define WILC_MULTICAST_TABLE_SIZE	8
 #define WILC_MAX_FW_VERSION_STR_SIZE	50
 
+/* frames a vif may have waiting for its NAPI poll */
+#define WILC_RX_NAPI_QLEN		1024
+
 /* latest API version supported */
 #define WILC1000_API_VER		1
 
@@ -280,12 +283,71 @@ void eap_buff_timeout(struct timer_list *t)
 					(void *)priv);
 	if (status)
 		PRINT_ER(vif->ndev, "Failed so send buffered eap\n");
+	else
+		napi_schedule(&vif->napi);
+}
+
+/*
+ * Rehash vif under its new BSSID, a NULL or zero one just unhashes it.
+ * On -ENOMEM vif stays hashed as it was.
+ */
+static int wilc_bssid_hash_set(struct wilc_vif *vif, const u8 *bssid)
+{
+	struct wilc *wl = vif->wilc;
+	struct wilc_bssid_entry *ent = NULL, *old;
+
+	if (bssid && !is_zero_ether_addr(bssid)) {
+		ent = kmalloc(sizeof(*ent), GFP_KERNEL);
+		if (!ent)
+			return -ENOMEM;
+
+		ent->key = ether_addr_to_u64(bssid);
+		ent->vif = vif;
+	}
+
+	spin_lock_bh(&wl->bssid_lock);
+	old = vif->bssid_ent;
+	if (old)
+		hash_del_rcu(&old->node);
+	if (ent)
+		hash_add_rcu(wl->bssid_hash, &ent->node, ent->key);
+	vif->bssid_ent = ent;
+	spin_unlock_bh(&wl->bssid_lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return 0;
+}
+
+/*
+ * vif whose BSSID is addr while it is in iftype mode, under RCU; the
+ * caller's SRCU read section on vif_list keeps the vif alive.
+ */
+struct wilc_vif *wilc_bssid_lookup(struct wilc *wilc, const u8 *addr,
+				   u8 iftype)
+{
+	struct wilc_bssid_entry *ent;
+	u64 key = ether_addr_to_u64(addr);
+
+	hash_for_each_possible_rcu(wilc->bssid_hash, ent, node, key)
+		if (ent->key == key && READ_ONCE(ent->vif->iftype) == iftype)
+			return ent->vif;
+
+	return NULL;
 }
 
-void wilc_wlan_set_bssid(struct net_device *wilc_netdev, const u8 *bssid,
-			 u8 mode)
+int wilc_wlan_set_bssid(struct net_device *wilc_netdev, const u8 *bssid,
+			u8 mode)
 {
 	struct wilc_vif *vif = netdev_priv(wilc_netdev);
+	int ret;
+
+	ret = wilc_bssid_hash_set(vif, bssid);
+	if (ret) {
+		PRINT_ER(vif->ndev, "Failed to hash BSSID %pM\n", bssid);
+		return ret;
+	}
 
 	if (bssid)
 		ether_addr_copy(vif->bssid, bssid);
@@ -293,6 +355,7 @@ void wilc_wlan_set_bssid(struct net_device *wilc_netdev, const u8 *bssid,
 		eth_zero_addr(vif->bssid);
 
 	vif->iftype = mode;
+	return 0;
 }
 
 #define TX_BACKOFF_WEIGHT_INCR_STEP (1)
@@ -301,12 +364,59 @@ void wilc_wlan_set_bssid(struct net_device *wilc_netdev, const u8 *bssid,
 #define TX_BACKOFF_WEIGHT_MIN (0)
 #define TX_BCKOFF_WGHT_MS (1)
 
+/* wake the per-AC subqueues whose shared AC queue has drained */
+static void wilc_wake_tx_queues(struct wilc *wl)
+{
+	struct wilc_vif *ifc;
+	int srcu_idx;
+	u16 ac;
+
+	srcu_idx = srcu_read_lock(&wl->srcu);
+	for (ac = 0; ac < NQUEUES; ac++) {
+		if (atomic_read(&wl->txq[ac].count) >=
+		    FLOW_CONTROL_LOWER_THRESHOLD)
+			continue;
+
+		list_for_each_entry_rcu(ifc, &wl->vif_list, list) {
+			if (ifc->mac_opened &&
+			    __netif_subqueue_stopped(ifc->ndev, ac))
+				netif_wake_subqueue(ifc->ndev, ac);
+		}
+	}
+	srcu_read_unlock(&wl->srcu, srcu_idx);
+}
+
+/*
+ * Back off after the firmware ran out of VMM entries. Any interrupt from
+ * the firmware since fw_seq was sampled may mean entries were freed, so
+ * resume on it; the timeout only bounds the wait on a quiet link.
+ */
+static void wilc_txq_backoff(struct wilc *wl, int fw_seq, unsigned int ms)
+{
+	struct wilc_tx_backoff_stats *st = &wl->tx_backoff_stats;
+	ktime_t start = ktime_get();
+	s64 us;
+	int ret;
+
+	ret = wait_event_interruptible_hrtimeout(wl->fw_event_wq,
+						 atomic_read(&wl->fw_event_seq) !=
+						 fw_seq || wl->close,
+						 ms_to_ktime(ms));
+	if (ret == -ETIME)
+		atomic_long_inc(&st->timeouts);
+	else
+		atomic_long_inc(&st->woken);
+
+	us = ktime_us_delta(ktime_get(), start);
+	atomic_long_inc(&st->hist[wilc_hist_bucket(max_t(s64, us, 0),
+						   WILC_BACKOFF_HIST_BUCKETS)]);
+}
+
 static int wilc_txq_task(void *vp)
 {
 	int ret;
 	u32 txq_count;
 	int backoff_weight = TX_BACKOFF_WEIGHT_MIN;
-	signed long timeout;
 	struct wilc *wl = vp;
 
 	complete(&wl->txq_thread_started);
@@ -328,36 +438,16 @@ static int wilc_txq_task(void *vp)
 		}
 		PRINT_INFO(ndev, TX_DBG, "handle the tx packet\n");
 		do {
+			int fw_seq = atomic_read(&wl->fw_event_seq);
+			u64 batches = wl->tx_batch_stats.batches;
+
 			ret = wilc_wlan_handle_txq(wl, &txq_count);
-			if (txq_count < FLOW_CONTROL_LOWER_THRESHOLD) {
-				int srcu_idx;
-				struct wilc_vif *ifc;
-
-				srcu_idx = srcu_read_lock(&wl->srcu);
-				PRINT_INFO(ndev, TX_DBG, "Waking up queue\n");
-				list_for_each_entry_rcu(ifc, &wl->vif_list,
-							list) {
-					if (ifc->mac_opened &&
-					    netif_queue_stopped(ifc->ndev))
-						netif_wake_queue(ifc->ndev);
-				}
-				srcu_read_unlock(&wl->srcu, srcu_idx);
-			}
+			wilc_wake_tx_queues(wl);
 
 			if (ret == WILC_VMM_ENTRY_FULL_RETRY) {
-				timeout = msecs_to_jiffies(TX_BCKOFF_WGHT_MS <<
-							   backoff_weight);
-				do {
-			/* Back off from sending packets for some time.
-			 * schedule_timeout will allow RX task to run and free
-			 * buffers. Setting state to TASK_INTERRUPTIBLE will
-			 * put the thread back to CPU running queue when it's
-			 * signaled even if 'timeout' isn't elapsed. This gives
-			 * faster chance for reserved SK buffers to be freed
-			 */
-					set_current_state(TASK_INTERRUPTIBLE);
-					timeout = schedule_timeout(timeout);
-					} while (/*timeout*/0);
+				wilc_txq_backoff(wl, fw_seq,
+						 TX_BCKOFF_WGHT_MS <<
+						 backoff_weight);
 				backoff_weight += TX_BACKOFF_WEIGHT_INCR_STEP;
 				if (backoff_weight > TX_BACKOFF_WEIGHT_MAX)
 					backoff_weight = TX_BACKOFF_WEIGHT_MAX;
@@ -366,6 +456,14 @@ static int wilc_txq_task(void *vp)
 				if (backoff_weight < TX_BACKOFF_WEIGHT_MIN)
 					backoff_weight = TX_BACKOFF_WEIGHT_MIN;
 			}
+
+			/*
+			 * A burst posts a single wakeup; if it overflowed the
+			 * batch, come back for the rest.
+			 */
+			if (!ret && txq_count &&
+			    wl->tx_batch_stats.batches != batches)
+				complete(&wl->txq_event);
 		} while (ret == WILC_VMM_ENTRY_FULL_RETRY && !wl->close);
 	}
 	return 0;
@@ -642,11 +740,13 @@ static void wlan_deinitialize_threads(struct net_device *dev)
 	PRINT_INFO(vif->ndev, INIT_DBG, "Deinitializing Threads\n");
 
 	complete(&wl->txq_event);
+	wake_up_interruptible(&wl->fw_event_wq);
 
 	if (wl->txq_thread) {
 		kthread_stop(wl->txq_thread);
 		wl->txq_thread = NULL;
 	}
+	wilc_wlan_tx_flush(wl);
 }
 
 static void wilc_wlan_deinitialize(struct net_device *dev)
@@ -829,12 +929,19 @@ fail_wilc_wlan:
 
 static int mac_init_fn(struct net_device *ndev)
 {
-	netif_start_queue(ndev);
-	netif_stop_queue(ndev);
+	netif_tx_start_all_queues(ndev);
+	netif_tx_stop_all_queues(ndev);
 
 	return 0;
 }
 
+static void wilc_mac_uninit(struct net_device *ndev)
+{
+	struct wilc_vif *vif = netdev_priv(ndev);
+
+	skb_queue_purge(&vif->rx_napi_q);
+}
+
 static int wilc_mac_open(struct net_device *ndev)
 {
 	struct wilc_vif *vif = netdev_priv(ndev);
@@ -896,7 +1003,17 @@ static int wilc_mac_open(struct net_device *ndev)
 	wilc_update_mgmt_frame_registrations(vif->ndev->ieee80211_ptr->wiphy,
 					     vif->ndev->ieee80211_ptr,
 					     &mgmt_regs);
-	netif_wake_queue(ndev);
+	napi_enable(&vif->napi);
+	/*
+	 * Frames are queued as soon as the device runs, a kick before the
+	 * enable above could not schedule the poll for them.
+	 */
+	if (!skb_queue_empty_lockless(&vif->rx_napi_q)) {
+		local_bh_disable();
+		napi_schedule(&vif->napi);
+		local_bh_enable();
+	}
+	netif_tx_wake_all_queues(ndev);
 	wl->open_ifcs++;
 	vif->mac_opened = 1;
 	return 0;
@@ -1007,16 +1124,40 @@ static void wilc_tx_complete(void *priv, int status)
 {
 	struct tx_complete_data *pv_data = priv;
 
+	if (pv_data->txq) {
+		struct wilc_vif *vif = netdev_priv(pv_data->skb->dev);
+		unsigned long flags;
+
+		/* completions come from the tx work, txq thread and xmit */
+		spin_lock_irqsave(&vif->wilc->tx_bql_lock, flags);
+		netdev_tx_completed_queue(pv_data->txq, 1, pv_data->size);
+		spin_unlock_irqrestore(&vif->wilc->tx_bql_lock, flags);
+	}
+
+	/* pv_data lives in skb->cb and goes away with the skb */
 	dev_kfree_skb(pv_data->skb);
-	kfree(pv_data);
 }
 
-netdev_tx_t wilc_mac_xmit(struct sk_buff *skb, struct net_device *ndev)
+static u16 wilc_select_queue(struct net_device *ndev, struct sk_buff *skb,
+			     struct net_device *sb_dev)
+{
+	struct wilc_vif *vif = netdev_priv(ndev);
+
+	/* one TX queue per WMM AC, indexed like wilc->txq[] */
+	return wilc_ac_classify(vif->wilc, skb);
+}
+
+static netdev_tx_t wilc_xmit(struct sk_buff *skb, struct net_device *ndev,
+			     struct netdev_queue *txq)
 {
 	struct wilc_vif *vif = netdev_priv(ndev);
 	struct wilc *wilc = vif->wilc;
-	struct tx_complete_data *tx_data = NULL;
+	struct tx_complete_data *tx_data;
+	bool more = false;
 	int queue_count;
+	u8 ac;
+
+	BUILD_BUG_ON(sizeof(*tx_data) > sizeof_field(struct sk_buff, cb));
 
 	PRINT_INFO(vif->ndev, TX_DBG,
 		   "Sending packet just received from TCP/IP\n");
@@ -1025,42 +1166,68 @@ netdev_tx_t wilc_mac_xmit(struct sk_buff *skb, struct net_device *ndev)
 		return NETDEV_TX_OK;
 	}
 
-	tx_data = kmalloc(sizeof(*tx_data), GFP_ATOMIC);
-	if (!tx_data) {
-		PRINT_ER(ndev, "Failed to alloc memory for tx_data struct\n");
-		dev_kfree_skb(skb);
-		netif_wake_queue(ndev);
-		return NETDEV_TX_OK;
-	}
-
+	tx_data = WILC_TX_CB(skb);
 	tx_data->buff = skb->data;
 	tx_data->size = skb->len;
 	tx_data->skb  = skb;
+	tx_data->txq = txq;
 
 	PRINT_D(vif->ndev, TX_DBG, "Sending pkt Size= %d Add= %p SKB= %p\n",
 		tx_data->size, tx_data->buff, tx_data->skb);
 	PRINT_D(vif->ndev, TX_DBG, "Adding tx pkt to TX Queue\n");
 	vif->netstats.tx_packets++;
 	vif->netstats.tx_bytes += tx_data->size;
+	/*
+	 * Charge BQL first, the frame may be completed before we return.
+	 * With more frames on the way and the queue running, leave waking
+	 * the txq thread to the last of them.
+	 */
+	if (txq)
+		more = !__netdev_tx_sent_queue(txq, tx_data->size,
+					       netdev_xmit_more());
 	queue_count = wilc_wlan_txq_add_net_pkt(ndev, tx_data,
 						tx_data->buff, tx_data->size,
-						wilc_tx_complete);
-
-	if (queue_count > FLOW_CONTROL_UPPER_THRESHOLD) {
+						wilc_tx_complete, &ac);
+
+	/*
+	 * The AC queue is shared, so stop that AC on every interface. It is
+	 * the queue the frame went to, which may differ from its mapping
+	 * after an ACM downgrade; wilc_wake_tx_queues() wakes each subqueue
+	 * on the depth of the AC queue of the same index.
+	 */
+	if (txq && queue_count > FLOW_CONTROL_UPPER_THRESHOLD) {
 		int srcu_idx;
 		struct wilc_vif *vif;
 
 		srcu_idx = srcu_read_lock(&wilc->srcu);
 		list_for_each_entry_rcu(vif, &wilc->vif_list, list) {
 			if (vif->mac_opened)
-				netif_stop_queue(vif->ndev);
+				netif_stop_subqueue(vif->ndev, ac);
 		}
 		srcu_read_unlock(&wilc->srcu, srcu_idx);
 	}
 
+	/* nothing follows on a stopped queue, ship the burst now */
+	if (more && !netif_xmit_stopped(txq))
+		atomic_long_inc(&wilc->tx_batch_stats.deferred);
+	else
+		wilc_wlan_txq_kick(wilc);
+
 	return NETDEV_TX_OK;
 }
 
+/* frames injected through the monitor interface, not BQL accounted */
+netdev_tx_t wilc_mac_xmit(struct sk_buff *skb, struct net_device *ndev)
+{
+	return wilc_xmit(skb, ndev, NULL);
+}
+
+static netdev_tx_t wilc_mac_start_xmit(struct sk_buff *skb,
+				       struct net_device *ndev)
+{
+	return wilc_xmit(skb, ndev, skb_get_tx_queue(ndev, skb));
+}
+
 static int wilc_mac_close(struct net_device *ndev)
 {
 	struct wilc_vif *vif = netdev_priv(ndev);
@@ -1079,7 +1246,11 @@ static int wilc_mac_close(struct net_device *ndev)
 		wl->close = 1;
 
 	if (vif->ndev) {
-		netif_stop_queue(vif->ndev);
+		netif_tx_stop_all_queues(vif->ndev);
+		/* a failed recovery reopen left NAPI disabled already */
+		if (vif->mac_opened)
+			napi_disable(&vif->napi);
+		skb_queue_purge(&vif->rx_napi_q);
 
 		wilc_handle_disconnect(vif);
 
@@ -1092,6 +1263,7 @@ static int wilc_mac_close(struct net_device *ndev)
 		wilc_wlan_deinitialize(ndev);
 	}
 
+	wilc_ack_filter_flush(vif);
 	vif->mac_opened = 0;
 
 	return 0;
@@ -1101,7 +1273,6 @@ void wilc_frmw_to_host(struct wilc_vif *vif, u8 *buff, u32 size,
 		       u32 pkt_offset, u8 status)
 {
 	unsigned int frame_len = 0;
-	int stats;
 	unsigned char *buff_to_send = NULL;
 	struct sk_buff *skb;
 	struct wilc_priv *priv;
@@ -1150,21 +1321,68 @@ void wilc_frmw_to_host(struct wilc_vif *vif, u8 *buff, u32 size,
 			  msecs_to_jiffies(10)));
 		return;
 	}
-	skb = dev_alloc_skb(frame_len);
+	skb = wilc_wlan_rx_skb(vif->wilc, buff_to_send, frame_len,
+			       status == PKT_STATUS_NEW);
 	if (!skb) {
 		PRINT_ER(vif->ndev, "Low memory - packet dropped\n");
 		return;
 	}
 
 	skb->dev = vif->ndev;
-	skb_put_data(skb, buff_to_send, frame_len);
 
 	skb->protocol = eth_type_trans(skb, vif->ndev);
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+
+	/* a stopped or starved poll must not pin unbounded memory */
+	if (!netif_running(vif->ndev) ||
+	    skb_queue_len(&vif->rx_napi_q) >= WILC_RX_NAPI_QLEN) {
+		vif->netstats.rx_dropped++;
+		dev_kfree_skb_any(skb);
+		return;
+	}
+
 	vif->netstats.rx_packets++;
 	vif->netstats.rx_bytes += frame_len;
-	skb->ip_summed = CHECKSUM_UNNECESSARY;
-	stats = netif_rx(skb);
-	PRINT_D(vif->ndev, RX_DBG, "netif_rx ret value: %d\n", stats);
+	skb_queue_tail(&vif->rx_napi_q, skb);
+}
+
+/*
+ * Schedule the NAPI poll of every vif that got frames from the RX buffer
+ * just parsed, so the whole buffer reaches GRO in one softirq pass.
+ */
+void wilc_netdev_rx_kick(struct wilc *wilc)
+{
+	struct wilc_vif *vif;
+	int srcu_idx;
+
+	local_bh_disable();
+	srcu_idx = srcu_read_lock(&wilc->srcu);
+	list_for_each_entry_rcu(vif, &wilc->vif_list, list)
+		if (!skb_queue_empty_lockless(&vif->rx_napi_q))
+			napi_schedule(&vif->napi);
+	srcu_read_unlock(&wilc->srcu, srcu_idx);
+	local_bh_enable();
+}
+
+static int wilc_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct wilc_vif *vif = container_of(napi, struct wilc_vif, napi);
+	struct sk_buff *skb;
+	int done = 0;
+
+	while (done < budget) {
+		skb = skb_dequeue(&vif->rx_napi_q);
+		if (!skb)
+			break;
+
+		napi_gro_receive(napi, skb);
+		done++;
+	}
+
+	if (done < budget)
+		napi_complete_done(napi, done);
+
+	return done;
 }
 
 void wilc_wfi_mgmt_rx(struct wilc *wilc, u8 *buff, u32 size, bool is_auth)
@@ -1199,10 +1417,12 @@ void wilc_wfi_mgmt_rx(struct wilc *wilc, u8 *buff, u32 size, bool is_auth)
 
 static const struct net_device_ops wilc_netdev_ops = {
 	.ndo_init = mac_init_fn,
+	.ndo_uninit = wilc_mac_uninit,
 	.ndo_open = wilc_mac_open,
 	.ndo_stop = wilc_mac_close,
 	.ndo_set_mac_address = wilc_set_mac_addr,
-	.ndo_start_xmit = wilc_mac_xmit,
+	.ndo_start_xmit = wilc_mac_start_xmit,
+	.ndo_select_queue = wilc_select_queue,
 	.ndo_get_stats = mac_stats,
 	.ndo_set_rx_mode  = wilc_set_multicast_list,
 };
@@ -1224,6 +1444,7 @@ void wilc_netdev_cleanup(struct wilc *wilc)
 	list_for_each_entry_rcu(vif, &wilc->vif_list, list) {
 		/* clear the mode */
 		wilc_set_operation_mode(vif, 0, 0, 0);
+		wilc_bssid_hash_set(vif, NULL);
 		if (vif->ndev)
 			unregister_netdev(vif->ndev);
 	}
@@ -1232,6 +1453,8 @@ void wilc_netdev_cleanup(struct wilc *wilc)
 	wilc_wfi_deinit_mon_interface(wilc, false);
 	destroy_workqueue(wilc->hif_workqueue);
 	wilc->hif_workqueue = NULL;
+	wilc_wlan_tx_work_deinit(wilc);
+	wilc_wlan_rx_work_deinit(wilc);
 	while (ifc_cnt < WILC_NUM_CONCURRENT_IFC) {
 		mutex_lock(&wilc->vif_mutex);
 		if (wilc->vif_num <= 0) {
@@ -1249,8 +1472,10 @@ void wilc_netdev_cleanup(struct wilc *wilc)
 
 	wilc_wlan_cfg_deinit(wilc);
 #ifdef WILC_DEBUGFS
-	wilc_debugfs_remove();
+	wilc_debugfs_remove(wilc);
 #endif
+	wilc_wlan_ac_map_deinit(wilc);
+	wilc_wlan_txq_pool_deinit(wilc);
 	wilc_sysfs_exit();
 	wlan_deinit_locks(wilc);
 	wiphy_unregister(wilc->wiphy);
@@ -1284,7 +1509,7 @@ struct wilc_vif *wilc_netdev_ifc_init(struct wilc *wl, const char *name,
 	struct wilc_vif *vif;
 	int ret;
 
-	ndev = alloc_etherdev(sizeof(*vif));
+	ndev = alloc_etherdev_mq(sizeof(*vif), NQUEUES);
 	if (!ndev)
 		return ERR_PTR(-ENOMEM);
 
@@ -1294,6 +1519,9 @@ struct wilc_vif *wilc_netdev_ifc_init(struct wilc *wl, const char *name,
 	vif->wilc = wl;
 	vif->ndev = ndev;
 	ndev->ml_priv = vif;
+	wilc_ack_filter_init(vif);
+	skb_queue_head_init(&vif->rx_napi_q);
+	netif_napi_add(ndev, &vif->napi, wilc_napi_poll);
 
 	ndev->netdev_ops = &wilc_netdev_ops;
 
@@ -13,6 +13,11 @@
 #include <net/ieee80211_radiotap.h>
 #include <linux/if_arp.h>
 #include <linux/gpio/consumer.h>
+#include <linux/mempool.h>
+#include <linux/hashtable.h>
+#include <linux/log2.h>
+#include <linux/hrtimer.h>
+#include <linux/jump_label.h>
 
 #include "hif.h"
 #include "wlan.h"
@@ -23,6 +28,14 @@ extern int wait_for_recovery;
 #define FLOW_CONTROL_LOWER_THRESHOLD		128
 #define FLOW_CONTROL_UPPER_THRESHOLD		256
 
+/*
+ * txq_entry_t reserve: each AC is stopped on its own once it passes the
+ * upper threshold, and one VMM batch of entries can be on the bus.
+ */
+#define WILC_TXQ_POOL_RESERVE		(NQUEUES * \
+					 (FLOW_CONTROL_UPPER_THRESHOLD + 1) + \
+					 WILC_VMM_TBL_SIZE)
+
 #define PMKID_FOUND				1
 #define NUM_STA_ASSOCIATED			8
 
@@ -162,28 +175,42 @@ struct wilc_priv {
 	u64 inc_roc_cookie;
 };
 
-#define MAX_TCP_SESSION                25
 #define MAX_PENDING_ACKS               256
+#define WILC_ACK_FLOW_HASH_BITS        6
+
+/* IPv4 flows use v4-mapped addresses */
+struct wilc_ack_flow_key {
+	struct in6_addr saddr;
+	struct in6_addr daddr;
+	__be16 sport;
+	__be16 dport;
+};
 
-struct ack_session_info {
-	u32 seq_num;
+/* one TCP flow seen by the ACK filter, recycled in LRU order */
+struct wilc_ack_flow {
+	struct hlist_node node;
+	struct list_head lru;
+	struct wilc_ack_flow_key key;
 	u32 bigger_ack_num;
-	u16 src_port;
-	u16 dst_port;
-	u16 status;
+	u32 round;
+	u64 suppressed;
 };
 
 struct pending_acks {
 	u32 ack_num;
-	u32 session_index;
+	struct wilc_ack_flow *flow;
 	struct txq_entry_t  *txqe;
 };
 
+/* per-vif, so enqueue on one interface never waits for another */
 struct tcp_ack_filter {
-	struct ack_session_info ack_session_info[2 * MAX_TCP_SESSION];
+	spinlock_t lock;
+	DECLARE_HASHTABLE(flows, WILC_ACK_FLOW_HASH_BITS);
+	struct list_head lru;
+	u32 nr_flows;
+	/* bumped on every filter pass, flows seen in this pass are busy */
+	u32 round;
 	struct pending_acks pending_acks[MAX_PENDING_ACKS];
-	u32 pending_base;
-	u32 tcp_session;
 	u32 pending_acks_idx;
 	bool enabled;
 };
@@ -198,6 +225,16 @@ struct sysfs_attr_group {
 	u8 antenna2;
 };
 
+#define WILC_BSSID_HASH_BITS	3
+
+/* maps a vif's BSSID to it for RX demux, replaced under bssid_lock */
+struct wilc_bssid_entry {
+	struct hlist_node node;
+	u64 key;
+	struct wilc_vif *vif;
+	struct rcu_head rcu;
+};
+
 struct wilc_vif {
 	u8 idx;
 	u8 iftype;
@@ -207,6 +244,7 @@ struct wilc_vif {
 	struct net_device_stats netstats;
 	struct wilc *wilc;
 	u8 bssid[ETH_ALEN];
+	struct wilc_bssid_entry *bssid_ent;
 	struct host_if_drv *hif_drv;
 	struct net_device *ndev;
 
@@ -220,6 +258,10 @@ struct wilc_vif {
 	bool p2p_listen_state;
 	struct cfg80211_bss *bss;
 	struct cfg80211_external_auth_params auth;
+
+	/* RX frames parsed by the bus thread, delivered by the NAPI poll */
+	struct napi_struct napi;
+	struct sk_buff_head rx_napi_q;
 };
 
 struct wilc_power_gpios {
@@ -232,12 +274,151 @@ struct wilc_power {
 	u8 status[DEV_MAX];
 };
 
-struct wilc_tx_queue_status {
-	u8 buffer[AC_BUFFER_SIZE];
-	u16 end_index;
-	u16 cnt[NQUEUES];
-	u16 sum;
-	bool initialized;
+/* DSCP and 802.1D priority to AC tables, replaced whole under RCU */
+struct wilc_ac_map {
+	u8 dscp[WILC_DSCP_NUM];
+	u8 prio[WILC_PRIO_NUM];
+	struct rcu_head rcu;
+};
+
+/*
+ * Weighted EWMA of each AC's share of recent enqueues. Producers only
+ * bump offered[]; share[] and total are recomputed by the txq thread,
+ * which alone touches seen[].
+ */
+struct wilc_ac_share {
+	u32 share[NQUEUES];
+	u64 total;
+	atomic_t offered[NQUEUES];
+	u32 seen[NQUEUES];
+};
+
+/* deficit round robin state of the VMM scheduler, kept across batches */
+struct wilc_tx_sched_state {
+	s32 deficit[NQUEUES];
+	u8 rr;
+	bool credited;
+};
+
+/* txq_entry_t pool usage, exported through debugfs */
+struct wilc_txq_pool_stats {
+	atomic_long_t allocs;
+	atomic_long_t slab_allocs;
+	atomic_long_t misses;
+};
+
+/*
+ * RX data frames handed up as page fragments or copied into a fresh skb,
+ * and transfers that could not get a page-pool page.
+ */
+struct wilc_rx_page_stats {
+	atomic_long_t frags;
+	atomic_long_t copies;
+	atomic_long_t fallbacks;
+};
+
+/*
+ * Adaptive RX polling, only written by the interrupt handler. polled
+ * counts RX blocks drained without an interrupt of their own; irq_rate
+ * and saved_rate are per second over the last rate window.
+ */
+struct wilc_rx_poll_stats {
+	u64 irqs;
+	u64 polled;
+	u64 bursts;
+	u64 replays;
+	u32 irq_rate;
+	u32 saved_rate;
+};
+
+/*
+ * Bus controller submissions (spi_sync() calls on SPI), the bytes they
+ * moved and the time spent in them, only written under hif_cs.
+ */
+struct wilc_bus_stats {
+	u64 submits;
+	u64 bytes;
+	u64 ns;
+};
+
+/* RX data frames dropped before reaching a vif, by reason */
+struct wilc_rx_drop_stats {
+	atomic_long_t corrupt;
+	atomic_long_t no_vif;
+};
+
+/* log2 histogram bucket of v: 0 for 0, n for [2^(n-1), 2^n) */
+static inline int wilc_hist_bucket(u64 v, int nr_buckets)
+{
+	return min_t(int, v ? ilog2(v) + 1 : 0, nr_buckets - 1);
+}
+
+#define WILC_BACKOFF_HIST_BUCKETS	16
+
+/*
+ * VMM-full backoffs of the txq thread; hist[0] counts waits under 1us,
+ * hist[n] waits of [2^(n-1), 2^n) us, the last bucket everything longer.
+ */
+struct wilc_tx_backoff_stats {
+	atomic_long_t woken;
+	atomic_long_t timeouts;
+	atomic_long_t hist[WILC_BACKOFF_HIST_BUCKETS];
+};
+
+#define WILC_TX_BATCH_HIST_BUCKETS	8
+
+/*
+ * Packets per VMM batch, hist[n] counts batches of [2^(n-1), 2^n)
+ * packets. deferred counts wakeups skipped for xmit_more, holdoffs the
+ * ones delayed by the hold-off timer.
+ */
+struct wilc_tx_batch_stats {
+	u64 batches;
+	atomic_long_t deferred;
+	atomic_long_t holdoffs;
+	atomic_long_t hist[WILC_TX_BATCH_HIST_BUCKETS];
+};
+
+#define WILC_TX_LAT_HIST_BUCKETS	16
+
+/* legs of a TX frame's trip, each ending where the next one starts */
+enum wilc_tx_lat_stage {
+	WILC_TX_LAT_QUEUE,	/* enqueue to selection into a VMM table */
+	WILC_TX_LAT_VMM,	/* selection to the firmware taking the table */
+	WILC_TX_LAT_BUS,	/* VMM accept to hif_block_tx_ext done */
+	WILC_TX_LAT_TOTAL,	/* enqueue to hif_block_tx_ext done */
+	WILC_TX_LAT_STAGES
+};
+
+/*
+ * per-AC log2 histograms in us, only fed while wilc_tx_lat_key is on; the
+ * key is module-wide, not per device
+ */
+struct wilc_tx_lat_stats {
+	atomic_long_t hist[NQUEUES][WILC_TX_LAT_STAGES]
+			  [WILC_TX_LAT_HIST_BUCKETS];
+};
+
+DECLARE_STATIC_KEY_FALSE(wilc_tx_lat_key);
+
+/* register polling loops instrumented by wilc_poll_*() */
+enum wilc_poll_site {
+	WILC_POLL_TX_CTRL,
+	WILC_POLL_VMM_CTL,
+	WILC_POLL_CORTUS_0,
+	WILC_POLL_WAKEUP,
+	WILC_POLL_SLEEP,
+	WILC_POLL_SITES
+};
+
+#define WILC_POLL_HIST_BUCKETS		16
+
+/* iterations and response time (us) per poll, ewma_ns steers spinning */
+struct wilc_poll_stats {
+	u64 ewma_ns;
+	atomic_long_t timeouts;
+	atomic_long_t iter_hist[WILC_POLL_HIST_BUCKETS];
+	atomic_long_t lat_hist[WILC_POLL_HIST_BUCKETS];
 };
 
 struct wilc {
@@ -261,14 +442,22 @@ struct wilc {
 	/* protect head of transmit queue */
 	struct mutex txq_add_to_head_cs;
 
-	/* protect txq_entry_t transmit queue */
-	spinlock_t txq_spinlock;
+	/* serializes BQL completions from the different TX paths */
+	spinlock_t tx_bql_lock;
 
-	/* protect rxq_entry_t receiver queue */
-	struct mutex rxq_cs;
+	/* RX demux by BSSID, readers only hold RCU */
+	DECLARE_HASHTABLE(bssid_hash, WILC_BSSID_HASH_BITS);
+	spinlock_t bssid_lock;
+	struct wilc_rx_drop_stats rx_drop_stats;
+	struct wilc_rx_poll_stats rx_poll_stats;
+	unsigned long rx_poll_window;
+	u64 rx_poll_window_irqs;
+	u64 rx_poll_window_polled;
+	bool rx_poll_active;
 
 	/* lock to protect hif access */
 	struct mutex hif_cs;
+	struct wilc_bus_stats bus_stats;
 
 	struct completion cfg_event;
 	struct completion sync_event;
@@ -287,15 +476,61 @@ struct wilc {
 	u8 cfg_seq_no;
 
 	u8 *rx_buffer;
-	u32 rx_buffer_offset;
-	u8 *tx_buffer;
+	struct page_pool *rx_page_pool;
+	/*
+	 * RX transfer being parsed, only touched by the RX processing stage,
+	 * wilc_wlan_rx_work() on rx_workqueue
+	 */
+	struct rxq_entry_t *rx_cur;
+	struct wilc_rx_page_stats rx_page_stats;
 	u32 vmm_table[WILC_VMM_TBL_SIZE];
 
-	struct txq_handle txq[NQUEUES];
-	int txq_entries;
+	/* double-buffered VMM batches, tx_xfer_batch is the one on the bus */
+	struct wilc_tx_batch tx_batch[WILC_TX_BATCH_NUM];
+	struct wilc_tx_batch *tx_xfer_batch;
+	struct workqueue_struct *tx_workqueue;
+	struct work_struct tx_xfer_work;
+	/* RX processing stage, the consumer of rx_ring */
+	struct workqueue_struct *rx_workqueue;
+	struct work_struct rx_work;
 
-	struct wilc_tx_queue_status tx_q_limit;
-	struct rxq_entry_t rxq_head;
+	struct txq_handle txq[NQUEUES];
+	atomic_t txq_entries;
+
+	/* delayed txq thread wakeup that lets a burst fill the VMM batch */
+	struct hrtimer tx_holdoff_timer;
+	atomic_t tx_holdoff_armed;
+	atomic64_t tx_last_kick_ns;
+	struct wilc_tx_batch_stats tx_batch_stats;
+
+	/* txq_entry_t allocator, reserve sized to the flow control limits */
+	struct kmem_cache *txq_entry_cache;
+	char txq_entry_cache_name[32];
+	mempool_t *txq_entry_pool;
+	struct wilc_txq_pool_stats txq_pool_stats;
+
+	/* bumped on every firmware interrupt, wakes a VMM-full backoff */
+	atomic_t fw_event_seq;
+	wait_queue_head_t fw_event_wq;
+	struct wilc_tx_backoff_stats tx_backoff_stats;
+	struct wilc_poll_stats poll_stats[WILC_POLL_SITES];
+
+	struct wilc_ac_share tx_ac_share;
+	struct wilc_tx_sched_state tx_sched;
+	/* tx_sched before each pick of the current pass */
+	struct wilc_tx_sched_state tx_sched_trail[WILC_VMM_TBL_SIZE];
+	struct wilc_tx_lat_stats tx_lat_stats;
+
+	/* TX classification, swapped under ac_map_lock */
+	struct wilc_ac_map __rcu *ac_map;
+	struct mutex ac_map_lock;
+	atomic_long_t tx_ac_enqueued[NQUEUES];
+	struct wilc_rx_ring rx_ring;
+
+	/* this device's directory under the shared debugfs "wilc" one */
+	struct dentry *debugfs_dir;
+	/* entry in the debugfs list of devices, for module-wide switches */
+	struct list_head debugfs_node;
 
 	const struct firmware *firmware;
 
@@ -326,13 +561,16 @@ struct wilc_wfi_mon_priv {
 	struct net_device *real_ndev;
 };
 
+void wilc_netdev_rx_kick(struct wilc *wilc);
+struct wilc_vif *wilc_bssid_lookup(struct wilc *wilc, const u8 *addr,
+				   u8 iftype);
 void wilc_frmw_to_host(struct wilc_vif *vif, u8 *buff, u32 size,
 		       u32 pkt_offset, u8 status);
 void wilc_mac_indicate(struct wilc *wilc);
 void wilc_netdev_cleanup(struct wilc *wilc);
 void wilc_wfi_mgmt_rx(struct wilc *wilc, u8 *buff, u32 size, bool is_auth);
-void wilc_wlan_set_bssid(struct net_device *wilc_netdev, const u8 *bssid,
-			 u8 mode);
+int wilc_wlan_set_bssid(struct net_device *wilc_netdev, const u8 *bssid,
+			u8 mode);
 struct wilc_vif *wilc_netdev_ifc_init(struct wilc *wl, const char *name,
 				      int vif_type, enum nl80211_iftype type,
 				      bool rtnl_locked);
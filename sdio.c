@@ -41,6 +41,9 @@ struct wilc_sdio {
 	bool isinit;
 	struct wilc *wl;
 	u8 *cmd53_buf;
+	bool in_batch;		/* register batch holds the host */
+	bool csa_cached;	/* csa_hi matches the chip's CSA pointer */
+	u32 csa_hi;		/* CSA address bits 8-23 last programmed */
 };
 
 struct sdio_cmd52 {
@@ -357,9 +360,14 @@ static void wilc_sdio_disable_interrupt(struct wilc *dev)
 static int wilc_sdio_set_func0_csa_address(struct wilc *wilc, u32 adr)
 {
 	struct sdio_func *func = dev_to_sdio_func(wilc->dev);
+	struct wilc_sdio *sdio_priv = wilc->bus_data;
 	struct sdio_cmd52 cmd;
+	bool keep_hi;
 	int ret;
 
+	keep_hi = sdio_priv->csa_cached && sdio_priv->csa_hi == (adr >> 8);
+	sdio_priv->csa_cached = false;
+
 	/**
 	 *      Review: BIG ENDIAN
 	 **/
@@ -375,6 +383,9 @@ static int wilc_sdio_set_func0_csa_address(struct wilc *wilc, u32 adr)
 		return ret;
 	}
 
+	if (keep_hi)
+		goto done;
+
 	cmd.address = WILC_SDIO_FBR_CSA_REG + 1;
 	cmd.data = (u8)(adr >> 8);
 	ret = wilc_sdio_cmd52(wilc, &cmd);
@@ -393,6 +404,15 @@ static int wilc_sdio_set_func0_csa_address(struct wilc *wilc, u32 adr)
 		return ret;
 	}
 
+done:
+	/*
+	 * Within a register batch only 4-byte register accesses follow, so
+	 * the high bytes still hold unless the pointer may have advanced
+	 * into the next 256-byte page.
+	 */
+	sdio_priv->csa_hi = adr >> 8;
+	sdio_priv->csa_cached = sdio_priv->in_batch && (adr & 0xff) < 0xfc;
+
 	return 0;
 }
 
@@ -677,6 +697,30 @@ static int wilc_sdio_read(struct wilc *wilc, u32 addr, u8 *buf, u32 size)
 	return 0;
 }
 
+/*
+ * Run the register accesses with the host claimed once for the whole
+ * batch, and only reprogram the CSA bytes that change between them.
+ */
+static int wilc_sdio_xfer_batch(struct wilc *wilc, struct wilc_reg_op *ops,
+				int n)
+{
+	struct sdio_func *func = dev_to_sdio_func(wilc->dev);
+	struct wilc_sdio *sdio_priv = wilc->bus_data;
+	int i, ret = 0;
+
+	sdio_claim_host(func);
+	sdio_priv->in_batch = true;
+
+	for (i = 0; i < n && !ret; i++)
+		ret = wilc_wlan_reg_op(wilc, &ops[i]);
+
+	sdio_priv->in_batch = false;
+	sdio_priv->csa_cached = false;
+	sdio_release_host(func);
+
+	return ret;
+}
+
 /********************************************
  *
  *      Bus interfaces
@@ -1098,6 +1142,7 @@ static const struct wilc_hif_func wilc_hif_sdio = {
 	.hif_block_tx_ext = wilc_sdio_write,
 	.hif_block_rx_ext = wilc_sdio_read,
 	.hif_sync_ext = wilc_sdio_sync_ext,
+	.hif_xfer_batch = wilc_sdio_xfer_batch,
 	.enable_interrupt = wilc_sdio_enable_interrupt,
 	.disable_interrupt = wilc_sdio_disable_interrupt,
 	.hif_reset = wilc_sdio_reset,
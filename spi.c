@@ -47,6 +47,11 @@ struct wilc_spi {
 	bool probing_crc;	/* true if we're probing chip's CRC config */
 	bool crc7_enabled;	/* true if crc7 is currently enabled */
 	bool crc16_enabled;	/* true if crc16 is currently enabled */
+	struct spi_transfer *sg_xfer;	/* transfers of a gathered write */
+	u8 *sg_ctrl;		/* command and CRC bytes of a gathered write */
+	struct spi_transfer *reg_xfer;	/* transfers of a register batch */
+	struct wilc_spi_reg_slot *reg_buf; /* buffers of a register batch */
+	struct wilc_spi_scratch *scratch; /* buffers of a single transfer */
 };
 
 static const struct wilc_hif_func wilc_hif_spi;
@@ -105,6 +110,49 @@ static int wilc_spi_reset(struct wilc *wilc);
 #define DATA_PKT_LOG_SZ				DATA_PKT_LOG_SZ_MAX
 #define DATA_PKT_SZ				(1 << DATA_PKT_LOG_SZ)
 
+/*
+ * A gathered block write sends every segment as its own transfer, and
+ * a segment may be split across two data packets.  Each data packet
+ * adds a command byte and a CRC transfer, and the data response is read
+ * by one more transfer at the end.
+ */
+#define DATA_PKT_MAX_NUM			(WILC_TX_BUFF_SIZE / DATA_PKT_SZ + 1)
+#define WILC_SPI_SG_MAX_XFERS			(WILC_TX_VEC_MAX + \
+						 3 * DATA_PKT_MAX_NUM + 1)
+#define WILC_SPI_SG_CTRL_SZ			(3 * DATA_PKT_MAX_NUM)
+
+/*
+ * A register command and its response fit in 32 bytes.  A register
+ * batch queues up to WILC_SPI_REG_BATCH_MAX of them in one spi_message,
+ * each with its own command and response buffer.
+ */
+#define WILC_SPI_REG_BUF_SZ			32
+#define WILC_SPI_REG_BATCH_MAX			16
+
+/*
+ * Command, response and framing bytes of a single transaction.  They
+ * are handed to the SPI controller, which may DMA to and from them, so
+ * they live in one kmalloc'd block instead of on the stack.  Each is
+ * aligned to ARCH_DMA_MINALIGN, which can exceed L1_CACHE_BYTES, so
+ * cache maintenance on one never touches another.  Every user runs
+ * under hif_cs.
+ */
+struct wilc_spi_scratch {
+	u8 wb[WILC_SPI_REG_BUF_SZ] __aligned(ARCH_DMA_MINALIGN);
+	u8 rb[WILC_SPI_REG_BUF_SZ] __aligned(ARCH_DMA_MINALIGN);
+	u8 ctl[4] __aligned(ARCH_DMA_MINALIGN);
+};
+
+/*
+ * One command of a register batch.  The alignment also pads the slot,
+ * so a response buffer shares no DMA line with any command buffer, its
+ * own or the next slot's.
+ */
+struct wilc_spi_reg_slot {
+	u8 wb[WILC_SPI_REG_BUF_SZ] __aligned(ARCH_DMA_MINALIGN);
+	u8 rb[WILC_SPI_REG_BUF_SZ] __aligned(ARCH_DMA_MINALIGN);
+};
+
 #define WILC_SPI_COMMAND_STAT_SUCCESS		0
 #define WILC_GET_RESP_HDR_START(h)		(((h) >> 4) & 0xf)
 
@@ -171,6 +219,20 @@ static int wilc_bus_probe(struct spi_device *spi)
 	if (!spi_priv)
 		return -ENOMEM;
 
+	spi_priv->sg_xfer = kcalloc(WILC_SPI_SG_MAX_XFERS,
+				    sizeof(*spi_priv->sg_xfer), GFP_KERNEL);
+	spi_priv->sg_ctrl = kzalloc(WILC_SPI_SG_CTRL_SZ, GFP_KERNEL);
+	spi_priv->reg_xfer = kcalloc(WILC_SPI_REG_BATCH_MAX,
+				     sizeof(*spi_priv->reg_xfer), GFP_KERNEL);
+	spi_priv->reg_buf = kcalloc(WILC_SPI_REG_BATCH_MAX,
+				    sizeof(*spi_priv->reg_buf), GFP_KERNEL);
+	spi_priv->scratch = kzalloc(sizeof(*spi_priv->scratch), GFP_KERNEL);
+	if (!spi_priv->sg_xfer || !spi_priv->sg_ctrl ||
+	    !spi_priv->reg_xfer || !spi_priv->reg_buf || !spi_priv->scratch) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
 	ret = wilc_cfg80211_init(&wilc, dev, WILC_HIF_SPI, &wilc_hif_spi);
 	if (ret)
 		goto free;
@@ -209,6 +271,11 @@ disable_rtc_clk:
 netdev_cleanup:
 	wilc_netdev_cleanup(wilc);
 free:
+	kfree(spi_priv->scratch);
+	kfree(spi_priv->reg_buf);
+	kfree(spi_priv->reg_xfer);
+	kfree(spi_priv->sg_ctrl);
+	kfree(spi_priv->sg_xfer);
 	kfree(spi_priv);
 	return ret;
 }
@@ -220,6 +287,11 @@ static void wilc_bus_remove(struct spi_device *spi)
 
 	clk_disable_unprepare(wilc->rtc_clk);
 	wilc_netdev_cleanup(wilc);
+	kfree(spi_priv->scratch);
+	kfree(spi_priv->reg_buf);
+	kfree(spi_priv->reg_xfer);
+	kfree(spi_priv->sg_ctrl);
+	kfree(spi_priv->sg_xfer);
 	kfree(spi_priv);
 
 	wilc_bt_deinit();
@@ -303,49 +375,27 @@ module_spi_driver(wilc_spi_driver);
 MODULE_LICENSE("GPL");
 MODULE_VERSION("16.1");
 
-static int wilc_spi_tx(struct wilc *wilc, u8 *b, u32 len)
+/* every controller submission goes through here to be counted */
+static int wilc_spi_sync(struct wilc *wilc, struct spi_message *msg)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_bus_stats *st = &wilc->bus_stats;
+	u64 ns = ktime_get_ns();
 	int ret;
-	struct spi_message msg;
-
-	if (len > 0 && b) {
-		struct spi_transfer tr = {
-			.tx_buf = b,
-			.len = len,
-			.delay = {
-				.value = 0,
-				.unit = SPI_DELAY_UNIT_USECS
-			},
-		};
-		char *r_buffer = kzalloc(len, GFP_KERNEL);
-
-		if (!r_buffer)
-			return -ENOMEM;
-
-		tr.rx_buf = r_buffer;
-		dev_dbg(&spi->dev, "Request writing %d bytes\n", len);
-
-		memset(&msg, 0, sizeof(msg));
-		spi_message_init(&msg);
-		msg.spi = spi;
-		spi_message_add_tail(&tr, &msg);
 
-		ret = spi_sync(spi, &msg);
-		if (ret < 0)
-			dev_err(&spi->dev, "SPI transaction failed\n");
-
-		kfree(r_buffer);
-	} else {
-		dev_err(&spi->dev,
-			"can't write data with the following length: %d\n",
-			len);
-		ret = -EINVAL;
-	}
+	ret = spi_sync(spi, msg);
+	WRITE_ONCE(st->ns, st->ns + ktime_get_ns() - ns);
+	WRITE_ONCE(st->submits, st->submits + 1);
+	if (!ret)
+		WRITE_ONCE(st->bytes, st->bytes + msg->actual_length);
 
 	return ret;
 }
 
+/*
+ * Half duplex: tx_buf is left NULL, so the SPI core shifts out zeros,
+ * using its own dummy buffer on controllers that need one.
+ */
 static int wilc_spi_rx(struct wilc *wilc, u8 *rb, u32 rlen)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
@@ -362,22 +412,15 @@ static int wilc_spi_rx(struct wilc *wilc, u8 *rb, u32 rlen)
 			},
 
 		};
-		char *t_buffer = kzalloc(rlen, GFP_KERNEL);
-
-		if (!t_buffer)
-			return -ENOMEM;
-
-		tr.tx_buf = t_buffer;
 
 		memset(&msg, 0, sizeof(msg));
 		spi_message_init(&msg);
 		msg.spi = spi;
 		spi_message_add_tail(&tr, &msg);
 
-		ret = spi_sync(spi, &msg);
+		ret = wilc_spi_sync(wilc, &msg);
 		if (ret < 0)
 			dev_err(&spi->dev, "SPI transaction failed\n");
-		kfree(t_buffer);
 	} else {
 		dev_err(&spi->dev,
 			"can't read data with the following length: %u\n",
@@ -412,7 +455,7 @@ static int wilc_spi_tx_rx(struct wilc *wilc, u8 *wb, u8 *rb, u32 rlen)
 		msg.spi = spi;
 
 		spi_message_add_tail(&tr, &msg);
-		ret = spi_sync(spi, &msg);
+		ret = wilc_spi_sync(wilc, &msg);
 		if (ret < 0)
 			dev_err(&spi->dev, "SPI transaction failed\n");
 	} else {
@@ -425,76 +468,105 @@ static int wilc_spi_tx_rx(struct wilc *wilc, u8 *wb, u8 *rb, u32 rlen)
 	return ret;
 }
 
-static int spi_data_write(struct wilc *wilc, u8 *b, u32 sz)
+static struct spi_transfer *spi_sg_add_tx(struct spi_message *msg,
+					  struct spi_transfer *tr,
+					  const void *buf, u32 len)
+{
+	memset(tr, 0, sizeof(*tr));
+	tr->tx_buf = buf;
+	tr->len = len;
+	spi_message_add_tail(tr, msg);
+
+	return tr;
+}
+
+/*
+ * Write the data phase of a block write, gathering the payload from
+ * @vec.  The command byte, data and CRC of every packet and the read of
+ * the data response that spi_data_rsp() checks are queued as a single
+ * spi_message.  Chip select is released after each of them, exactly as
+ * if they were separate transfers.
+ */
+static int spi_data_write_sg(struct wilc *wilc, const struct kvec *vec,
+			     int nvec, u32 sz)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
 	struct wilc_spi *spi_priv = wilc->bus_data;
-	int ix, nbytes;
-	int result = 0;
-	u8 cmd, order, crc[2];
-	u16 crc_calc;
+	struct spi_transfer *tr = spi_priv->sg_xfer;
+	u8 *ctrl = spi_priv->sg_ctrl;
+	struct spi_message msg;
+	u32 seg_off = 0;
+	int ix = 0, ntr = 0, v = 0;
+	int ret;
+
+	spi_message_init(&msg);
 
-	/*
-	 * Data
-	 */
-	ix = 0;
 	do {
+		u32 nbytes, left;
+		u16 crc_calc = 0xffff;
+		u8 order;
+
 		if (sz <= DATA_PKT_SZ) {
 			nbytes = sz;
 			order = 0x3;
 		} else {
 			nbytes = DATA_PKT_SZ;
-			if (ix == 0)
-				order = 0x1;
-			else
-				order = 0x02;
+			order = ix == 0 ? 0x1 : 0x2;
 		}
 
-		/*
-		 * Write command
-		 */
-		cmd = 0xf0;
-		cmd |= order;
+		*ctrl = 0xf0 | order;
+		spi_sg_add_tx(&msg, &tr[ntr++], ctrl++, 1)->cs_change = 1;
 
-		if (wilc_spi_tx(wilc, &cmd, 1)) {
-			dev_err(&spi->dev,
-				"Failed data block cmd write, bus error...\n");
-			result = -EINVAL;
-			break;
-		}
+		for (left = nbytes; left; ) {
+			const u8 *base;
+			u32 len;
 
-		/*
-		 * Write data
-		 */
-		if (wilc_spi_tx(wilc, &b[ix], nbytes)) {
-			dev_err(&spi->dev,
-				"Failed data block write, bus error...\n");
-			result = -EINVAL;
-			break;
+			if (v >= nvec || ntr >= WILC_SPI_SG_MAX_XFERS - 3) {
+				dev_err(&spi->dev, "Gathered write overflow\n");
+				return -EINVAL;
+			}
+
+			base = (const u8 *)vec[v].iov_base + seg_off;
+			len = min_t(u32, left, vec[v].iov_len - seg_off);
+
+			spi_sg_add_tx(&msg, &tr[ntr++], base, len);
+
+			if (spi_priv->crc16_enabled)
+				crc_calc = crc_itu_t(crc_calc, base, len);
+
+			left -= len;
+			seg_off += len;
+			if (seg_off == vec[v].iov_len) {
+				seg_off = 0;
+				v++;
+			}
 		}
+		tr[ntr - 1].cs_change = 1;
 
-		/*
-		 * Write CRC
-		 */
 		if (spi_priv->crc16_enabled) {
-			crc_calc = crc_itu_t(0xffff, &b[ix], nbytes);
-			crc[0] = crc_calc >> 8;
-			crc[1] = crc_calc;
-			if (wilc_spi_tx(wilc, crc, 2)) {
-				dev_err(&spi->dev, "Failed data block crc write, bus error...\n");
-				result = -EINVAL;
-				break;
-			}
+			ctrl[0] = crc_calc >> 8;
+			ctrl[1] = crc_calc;
+			spi_sg_add_tx(&msg, &tr[ntr++], ctrl, 2)->cs_change = 1;
+			ctrl += 2;
 		}
 
-		/*
-		 * No need to wait for response
-		 */
 		ix += nbytes;
 		sz -= nbytes;
 	} while (sz);
 
-	return result;
+	memset(&tr[ntr], 0, sizeof(tr[ntr]));
+	tr[ntr].rx_buf = spi_priv->scratch->ctl;
+	tr[ntr].len = sizeof(spi_priv->scratch->ctl);
+	spi_message_add_tail(&tr[ntr], &msg);
+
+	ret = wilc_spi_sync(wilc, &msg);
+	if (ret < 0) {
+		dev_err(&spi->dev,
+			"Failed data block gathered write, bus error...\n");
+		return -EINVAL;
+	}
+
+	return 0;
 }
 
 /********************************************
@@ -507,57 +579,99 @@ static u8 wilc_get_crc7(u8 *buffer, u32 len)
 	return crc7_be(0xfe, buffer, len);
 }
 
-static int wilc_spi_single_read(struct wilc *wilc, u8 cmd, u32 adr, void *b,
-				u8 clockless)
+/*
+ * Build a single register command in @wb and return the number of
+ * command bytes in @cmd_len and response bytes to clock in @resp_len.
+ */
+static int wilc_spi_reg_cmd_build(struct wilc *wilc, u8 cmd, u32 adr,
+				  u32 data, u8 clockless, u8 *wb,
+				  int *cmd_len, int *resp_len)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
 	struct wilc_spi *spi_priv = wilc->bus_data;
-	u8 wb[32], rb[32];
-	int cmd_len, resp_len, i;
-	u16 crc_calc, crc_recv;
 	struct wilc_spi_cmd *c;
-	struct wilc_spi_rsp_data *r;
-	struct wilc_spi_read_rsp_data *r_data;
+	int len;
 
-	memset(wb, 0x0, sizeof(wb));
-	memset(rb, 0x0, sizeof(rb));
+	memset(wb, 0x0, WILC_SPI_REG_BUF_SZ);
 	c = (struct wilc_spi_cmd *)wb;
 	c->cmd_type = cmd;
-	if (cmd == CMD_SINGLE_READ) {
+	switch (cmd) {
+	case CMD_SINGLE_READ:
 		c->u.simple_cmd.addr[0] = adr >> 16;
 		c->u.simple_cmd.addr[1] = adr >> 8;
 		c->u.simple_cmd.addr[2] = adr;
-	} else if (cmd == CMD_INTERNAL_READ) {
+		len = offsetof(struct wilc_spi_cmd, u.simple_cmd.crc);
+		*resp_len = sizeof(struct wilc_spi_rsp_data) +
+			    sizeof(struct wilc_spi_read_rsp_data) +
+			    WILC_SPI_RSP_HDR_EXTRA_DATA;
+		break;
+	case CMD_INTERNAL_READ:
 		c->u.simple_cmd.addr[0] = adr >> 8;
 		if (clockless == 1)
 			c->u.simple_cmd.addr[0] |= BIT(7);
 		c->u.simple_cmd.addr[1] = adr;
 		c->u.simple_cmd.addr[2] = 0x0;
-	} else {
+		len = offsetof(struct wilc_spi_cmd, u.simple_cmd.crc);
+		*resp_len = sizeof(struct wilc_spi_rsp_data) +
+			    sizeof(struct wilc_spi_read_rsp_data) +
+			    WILC_SPI_RSP_HDR_EXTRA_DATA;
+		break;
+	case CMD_INTERNAL_WRITE:
+		c->u.internal_w_cmd.addr[0] = adr >> 8;
+		if (clockless == 1)
+			c->u.internal_w_cmd.addr[0] |= BIT(7);
+
+		c->u.internal_w_cmd.addr[1] = adr;
+		c->u.internal_w_cmd.data = cpu_to_be32(data);
+		len = offsetof(struct wilc_spi_cmd, u.internal_w_cmd.crc);
+		*resp_len = sizeof(struct wilc_spi_rsp_data);
+		break;
+	case CMD_SINGLE_WRITE:
+		c->u.w_cmd.addr[0] = adr >> 16;
+		c->u.w_cmd.addr[1] = adr >> 8;
+		c->u.w_cmd.addr[2] = adr;
+		c->u.w_cmd.data = cpu_to_be32(data);
+		len = offsetof(struct wilc_spi_cmd, u.w_cmd.crc);
+		*resp_len = sizeof(struct wilc_spi_rsp_data);
+		break;
+	default:
 		dev_err(&spi->dev, "cmd [%x] not supported\n", cmd);
 		return -EINVAL;
 	}
 
-	cmd_len = offsetof(struct wilc_spi_cmd, u.simple_cmd.crc);
-	resp_len = sizeof(*r) + sizeof(*r_data) + WILC_SPI_RSP_HDR_EXTRA_DATA;
-
 	if (spi_priv->crc7_enabled) {
-		c->u.simple_cmd.crc[0] = wilc_get_crc7(wb, cmd_len);
-		cmd_len += 1;
-		resp_len += 2;
+		/* the CRC7 byte always directly follows the command fields */
+		wb[len] = wilc_get_crc7(wb, len);
+		len += 1;
+		if (cmd == CMD_SINGLE_READ || cmd == CMD_INTERNAL_READ)
+			*resp_len += 2;
 	}
 
-	if (cmd_len + resp_len > ARRAY_SIZE(wb)) {
+	if (len + *resp_len > WILC_SPI_REG_BUF_SZ) {
 		dev_err(&spi->dev,
-			"spi buffer size too small (%d) (%d) (%zu)\n",
-			cmd_len, resp_len, ARRAY_SIZE(wb));
+			"spi buffer size too small (%d) (%d) (%d)\n",
+			len, *resp_len, WILC_SPI_REG_BUF_SZ);
 		return -EINVAL;
 	}
 
-	if (wilc_spi_tx_rx(wilc, wb, rb, cmd_len + resp_len)) {
-		dev_err(&spi->dev, "Failed cmd write, bus error...\n");
-		return -EINVAL;
-	}
+	*cmd_len = len;
+
+	return 0;
+}
+
+/*
+ * Check the response to a single register command clocked into @rb and,
+ * for reads, copy the register value to @b.
+ */
+static int wilc_spi_reg_rsp_check(struct wilc *wilc, u8 cmd, u8 *rb,
+				  int cmd_len, void *b, u8 clockless)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	struct wilc_spi_read_rsp_data *r_data;
+	struct wilc_spi_rsp_data *r;
+	u16 crc_calc, crc_recv;
+	int i;
 
 	r = (struct wilc_spi_rsp_data *)&rb[cmd_len];
 	/*
@@ -578,6 +692,9 @@ static int wilc_spi_single_read(struct wilc *wilc, u8 cmd, u32 adr, void *b,
 		return -EINVAL;
 	}
 
+	if (cmd != CMD_SINGLE_READ && cmd != CMD_INTERNAL_READ)
+		return 0;
+
 	for (i = 0; i < SPI_RESP_RETRY_COUNT; ++i)
 		if (WILC_GET_RESP_HDR_START(r->data[i]) == 0xf)
 			break;
@@ -606,79 +723,58 @@ static int wilc_spi_single_read(struct wilc *wilc, u8 cmd, u32 adr, void *b,
 	return 0;
 }
 
-static int wilc_spi_write_cmd(struct wilc *wilc, u8 cmd, u32 adr, u32 data,
-			      u8 clockless)
+static int wilc_spi_single_read(struct wilc *wilc, u8 cmd, u32 adr, void *b,
+				u8 clockless)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
 	struct wilc_spi *spi_priv = wilc->bus_data;
-	u8 wb[32], rb[32];
-	int cmd_len, resp_len;
-	struct wilc_spi_cmd *c;
-	struct wilc_spi_rsp_data *r;
-
-	memset(wb, 0x0, sizeof(wb));
-	memset(rb, 0x0, sizeof(rb));
-	c = (struct wilc_spi_cmd *)wb;
-	c->cmd_type = cmd;
-	if (cmd == CMD_INTERNAL_WRITE) {
-		c->u.internal_w_cmd.addr[0] = adr >> 8;
-		if (clockless == 1)
-			c->u.internal_w_cmd.addr[0] |= BIT(7);
+	u8 *wb = spi_priv->scratch->wb, *rb = spi_priv->scratch->rb;
+	int cmd_len, resp_len, ret;
 
-		c->u.internal_w_cmd.addr[1] = adr;
-		c->u.internal_w_cmd.data = cpu_to_be32(data);
-		cmd_len = offsetof(struct wilc_spi_cmd, u.internal_w_cmd.crc);
-		if (spi_priv->crc7_enabled)
-			c->u.internal_w_cmd.crc[0] = wilc_get_crc7(wb, cmd_len);
-	} else if (cmd == CMD_SINGLE_WRITE) {
-		c->u.w_cmd.addr[0] = adr >> 16;
-		c->u.w_cmd.addr[1] = adr >> 8;
-		c->u.w_cmd.addr[2] = adr;
-		c->u.w_cmd.data = cpu_to_be32(data);
-		cmd_len = offsetof(struct wilc_spi_cmd, u.w_cmd.crc);
-		if (spi_priv->crc7_enabled)
-			c->u.w_cmd.crc[0] = wilc_get_crc7(wb, cmd_len);
-	} else {
-		dev_err(&spi->dev, "write cmd [%x] not supported\n", cmd);
+	if (cmd != CMD_SINGLE_READ && cmd != CMD_INTERNAL_READ) {
+		dev_err(&spi->dev, "cmd [%x] not supported\n", cmd);
 		return -EINVAL;
 	}
 
-	if (spi_priv->crc7_enabled)
-		cmd_len += 1;
-
-	resp_len = sizeof(*r);
-
-	if (cmd_len + resp_len > ARRAY_SIZE(wb)) {
-		dev_err(&spi->dev,
-			"spi buffer size too small (%d) (%d) (%zu)\n",
-			cmd_len, resp_len, ARRAY_SIZE(wb));
-		return -EINVAL;
-	}
+	ret = wilc_spi_reg_cmd_build(wilc, cmd, adr, 0, clockless, wb,
+				     &cmd_len, &resp_len);
+	if (ret)
+		return ret;
 
+	memset(rb, 0x0, WILC_SPI_REG_BUF_SZ);
 	if (wilc_spi_tx_rx(wilc, wb, rb, cmd_len + resp_len)) {
 		dev_err(&spi->dev, "Failed cmd write, bus error...\n");
 		return -EINVAL;
 	}
 
-	r = (struct wilc_spi_rsp_data *)&rb[cmd_len];
-	/*
-	 * Clockless registers operations might return unexptected responses,
-	 * even if successful.
-	 */
-	if (r->rsp_cmd_type != cmd && !clockless) {
-		dev_err(&spi->dev,
-			"Failed cmd response, cmd (%02x), resp (%02x)\n",
-			cmd, r->rsp_cmd_type);
+	return wilc_spi_reg_rsp_check(wilc, cmd, rb, cmd_len, b, clockless);
+}
+
+static int wilc_spi_write_cmd(struct wilc *wilc, u8 cmd, u32 adr, u32 data,
+			      u8 clockless)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	u8 *wb = spi_priv->scratch->wb, *rb = spi_priv->scratch->rb;
+	int cmd_len, resp_len, ret;
+
+	if (cmd != CMD_SINGLE_WRITE && cmd != CMD_INTERNAL_WRITE) {
+		dev_err(&spi->dev, "write cmd [%x] not supported\n", cmd);
 		return -EINVAL;
 	}
 
-	if (r->status != WILC_SPI_COMMAND_STAT_SUCCESS && !clockless) {
-		dev_err(&spi->dev, "Failed cmd state response state (%02x)\n",
-			r->status);
+	ret = wilc_spi_reg_cmd_build(wilc, cmd, adr, data, clockless, wb,
+				     &cmd_len, &resp_len);
+	if (ret)
+		return ret;
+
+	memset(rb, 0x0, WILC_SPI_REG_BUF_SZ);
+	if (wilc_spi_tx_rx(wilc, wb, rb, cmd_len + resp_len)) {
+		dev_err(&spi->dev, "Failed cmd write, bus error...\n");
 		return -EINVAL;
 	}
 
-	return 0;
+	return wilc_spi_reg_rsp_check(wilc, cmd, rb, cmd_len, NULL, clockless);
 }
 
 static int wilc_spi_dma_rw(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz)
@@ -686,15 +782,17 @@ static int wilc_spi_dma_rw(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz)
 	struct spi_device *spi = to_spi_device(wilc->dev);
 	struct wilc_spi *spi_priv = wilc->bus_data;
 	u16 crc_recv, crc_calc;
-	u8 wb[32], rb[32];
+	u8 *wb = spi_priv->scratch->wb, *rb = spi_priv->scratch->rb;
+	u8 *crc = spi_priv->scratch->ctl;
+	u8 *rsp = &spi_priv->scratch->ctl[2];
+	bool have_hdr = false;
 	int cmd_len, resp_len;
 	int retry, ix = 0;
-	u8 crc[2];
 	struct wilc_spi_cmd *c;
 	struct wilc_spi_rsp_data *r;
 
-	memset(wb, 0x0, sizeof(wb));
-	memset(rb, 0x0, sizeof(rb));
+	memset(wb, 0x0, WILC_SPI_REG_BUF_SZ);
+	memset(rb, 0x0, WILC_SPI_REG_BUF_SZ);
 	c = (struct wilc_spi_cmd *)wb;
 	c->cmd_type = cmd;
 	if (cmd == CMD_DMA_WRITE || cmd == CMD_DMA_READ) {
@@ -726,9 +824,9 @@ static int wilc_spi_dma_rw(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz)
 
 	resp_len = sizeof(*r);
 
-	if (cmd_len + resp_len > ARRAY_SIZE(wb)) {
-		dev_err(&spi->dev, "spi buffer size too small (%d)(%d) (%zu)\n",
-			cmd_len, resp_len, ARRAY_SIZE(wb));
+	if (cmd_len + resp_len > WILC_SPI_REG_BUF_SZ) {
+		dev_err(&spi->dev, "spi buffer size too small (%d)(%d) (%d)\n",
+			cmd_len, resp_len, WILC_SPI_REG_BUF_SZ);
 		return -EINVAL;
 	}
 
@@ -754,9 +852,17 @@ static int wilc_spi_dma_rw(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz)
 	if (cmd == CMD_DMA_WRITE || cmd == CMD_DMA_EXT_WRITE)
 		return 0;
 
+	/*
+	 * Each packet's data and CRC are read with one spi_message, which
+	 * also clocks in the first response header byte of the next one.
+	 * That byte is what the first poll below would have read, so the
+	 * header is only polled for when it wasn't there yet.
+	 */
 	while (sz > 0) {
-		int nbytes;
-		u8 rsp;
+		struct spi_transfer tr[3] = {};
+		struct spi_message msg;
+		int nbytes, ntr = 0;
+		bool prefetch;
 
 		nbytes = min_t(u32, sz, DATA_PKT_SZ);
 
@@ -764,34 +870,46 @@ static int wilc_spi_dma_rw(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz)
 		 * Data Response header
 		 */
 		retry = SPI_RESP_RETRY_COUNT;
-		do {
-			if (wilc_spi_rx(wilc, &rsp, 1)) {
+		while (!have_hdr) {
+			if (wilc_spi_rx(wilc, rsp, 1)) {
 				dev_err(&spi->dev,
 					"Failed resp read, bus err\n");
 				return -EINVAL;
 			}
-			if (WILC_GET_RESP_HDR_START(rsp) == 0xf)
+			if (WILC_GET_RESP_HDR_START(*rsp) == 0xf || !retry--)
 				break;
-		} while (retry--);
+		}
 
 		/*
-		 * Read bytes
+		 * Read bytes and CRC
 		 */
-		if (wilc_spi_rx(wilc, &b[ix], nbytes)) {
+		spi_message_init(&msg);
+		tr[ntr].rx_buf = &b[ix];
+		tr[ntr].len = nbytes;
+		tr[ntr].cs_change = 1;
+		spi_message_add_tail(&tr[ntr++], &msg);
+		if (spi_priv->crc16_enabled) {
+			tr[ntr].rx_buf = crc;
+			tr[ntr].len = 2;
+			tr[ntr].cs_change = 1;
+			spi_message_add_tail(&tr[ntr++], &msg);
+		}
+		prefetch = sz > nbytes;
+		if (prefetch) {
+			tr[ntr].rx_buf = rsp;
+			tr[ntr].len = 1;
+			spi_message_add_tail(&tr[ntr++], &msg);
+		}
+		tr[ntr - 1].cs_change = 0;
+
+		if (wilc_spi_sync(wilc, &msg)) {
 			dev_err(&spi->dev,
 				"Failed block read, bus err\n");
 			return -EINVAL;
 		}
+		have_hdr = prefetch && WILC_GET_RESP_HDR_START(*rsp) == 0xf;
 
-		/*
-		 * Read CRC
-		 */
 		if (spi_priv->crc16_enabled) {
-			if (wilc_spi_rx(wilc, crc, 2)) {
-				dev_err(&spi->dev,
-					"Failed block CRC read, bus err\n");
-				return -EINVAL;
-			}
 			crc_recv = (crc[0] << 8) | crc[1];
 			crc_calc = crc_itu_t(0xffff, &b[ix], nbytes);
 			if (crc_recv != crc_calc) {
@@ -812,7 +930,7 @@ static int wilc_spi_special_cmd(struct wilc *wilc, u8 cmd)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
 	struct wilc_spi *spi_priv = wilc->bus_data;
-	u8 wb[32], rb[32];
+	u8 *wb = spi_priv->scratch->wb, *rb = spi_priv->scratch->rb;
 	int cmd_len, resp_len = 0;
 	struct wilc_spi_cmd *c;
 	struct wilc_spi_special_cmd_rsp *r;
@@ -820,8 +938,8 @@ static int wilc_spi_special_cmd(struct wilc *wilc, u8 cmd)
 	if (cmd != CMD_TERMINATE && cmd != CMD_REPEAT && cmd != CMD_RESET)
 		return -EINVAL;
 
-	memset(wb, 0x0, sizeof(wb));
-	memset(rb, 0x0, sizeof(rb));
+	memset(wb, 0x0, WILC_SPI_REG_BUF_SZ);
+	memset(rb, 0x0, WILC_SPI_REG_BUF_SZ);
 	c = (struct wilc_spi_cmd *)wb;
 	c->cmd_type = cmd;
 
@@ -835,9 +953,9 @@ static int wilc_spi_special_cmd(struct wilc *wilc, u8 cmd)
 		c->u.simple_cmd.crc[0] = wilc_get_crc7(wb, cmd_len);
 		cmd_len += 1;
 	}
-	if (cmd_len + resp_len > ARRAY_SIZE(wb)) {
-		dev_err(&spi->dev, "spi buffer size too small (%d) (%d) (%zu)\n",
-			cmd_len, resp_len, ARRAY_SIZE(wb));
+	if (cmd_len + resp_len > WILC_SPI_REG_BUF_SZ) {
+		dev_err(&spi->dev, "spi buffer size too small (%d) (%d) (%d)\n",
+			cmd_len, resp_len, WILC_SPI_REG_BUF_SZ);
 		return -EINVAL;
 	}
 
@@ -1017,31 +1135,178 @@ retry:
 	return 0;
 }
 
+/*
+ * Queue a run of register commands as one spi_message, releasing chip
+ * select between them.  The write of a read-modify-write depends on the
+ * value read, so its read ends the run and the write opens the next one.
+ *
+ * A run that fails is never replayed if it holds a write: a controller
+ * error may come after some of its commands were clocked out, and a bad
+ * response says nothing about the commands after it.  Both return the
+ * error.  Only a run of reads whose submission failed is redone, with the
+ * rest of the batch, one register at a time through the retrying
+ * single-register path.
+ */
+static int wilc_spi_xfer_batch(struct wilc *wilc, struct wilc_reg_op *ops,
+			       int n)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	struct spi_transfer *tr = spi_priv->reg_xfer;
+	struct {
+		int idx;
+		u8 cmd;
+		u8 clockless;
+		u8 cmd_len;
+		bool write;
+	} slot[WILC_SPI_REG_BATCH_MAX];
+	bool rmw_write = false;
+	u32 rmw_val = 0;
+	int i = 0, ns, j, ret;
+
+	while (i < n) {
+		struct spi_message msg;
+		bool stop = false, writes = false;
+
+		spi_message_init(&msg);
+		for (ns = 0; i < n && ns < WILC_SPI_REG_BATCH_MAX && !stop;
+		     ns++) {
+			struct wilc_reg_op *op = &ops[i];
+			int cmd_len, resp_len;
+			u32 val = 0;
+			u8 *wb, *rb;
+
+			wb = spi_priv->reg_buf[ns].wb;
+			rb = spi_priv->reg_buf[ns].rb;
+
+			slot[ns].idx = i;
+			slot[ns].write = rmw_write || op->type == WILC_REG_WRITE;
+			writes |= slot[ns].write;
+			slot[ns].clockless =
+				op->addr <= WILC_SPI_CLOCKLESS_ADDR_LIMIT;
+			if (slot[ns].write) {
+				slot[ns].cmd = slot[ns].clockless ?
+					       CMD_INTERNAL_WRITE :
+					       CMD_SINGLE_WRITE;
+				val = rmw_write ? rmw_val : op->val;
+			} else {
+				slot[ns].cmd = slot[ns].clockless ?
+					       CMD_INTERNAL_READ :
+					       CMD_SINGLE_READ;
+			}
+
+			ret = wilc_spi_reg_cmd_build(wilc, slot[ns].cmd,
+						     op->addr, val,
+						     slot[ns].clockless, wb,
+						     &cmd_len, &resp_len);
+			if (ret)
+				return ret;
+			slot[ns].cmd_len = cmd_len;
+
+			memset(rb, 0x0, WILC_SPI_REG_BUF_SZ);
+			memset(&tr[ns], 0, sizeof(tr[ns]));
+			tr[ns].tx_buf = wb;
+			tr[ns].rx_buf = rb;
+			tr[ns].len = cmd_len + resp_len;
+			tr[ns].bits_per_word = 8;
+			tr[ns].cs_change = 1;
+			spi_message_add_tail(&tr[ns], &msg);
+
+			if (!slot[ns].write && op->type != WILC_REG_READ) {
+				stop = true;
+			} else {
+				rmw_write = false;
+				i++;
+			}
+		}
+		/* leave chip select released after the last command */
+		tr[ns - 1].cs_change = 0;
+
+		ret = wilc_spi_sync(wilc, &msg);
+		if (ret < 0) {
+			dev_err(&spi->dev,
+				"Failed register batch, bus error...\n");
+			if (writes)
+				return ret;
+			goto single;
+		}
+
+		for (j = 0; j < ns; j++) {
+			struct wilc_reg_op *op = &ops[slot[j].idx];
+			u8 *rb = spi_priv->reg_buf[j].rb;
+			u32 val;
+
+			ret = wilc_spi_reg_rsp_check(wilc, slot[j].cmd, rb,
+						     slot[j].cmd_len, &val,
+						     slot[j].clockless);
+			if (ret) {
+				/*
+				 * The rest of the message was clocked out
+				 * all the same, replaying it would repeat
+				 * its writes.
+				 */
+				dev_err(&spi->dev,
+					"Failed cmd, batch reg (%08x)...\n",
+					op->addr);
+				return ret;
+			}
+
+			if (slot[j].write) {
+				if (op->type != WILC_REG_WRITE && op->out)
+					*op->out = rmw_val;
+				continue;
+			}
+
+			le32_to_cpus(&val);
+			if (op->type == WILC_REG_READ) {
+				if (op->out)
+					*op->out = val;
+				continue;
+			}
+
+			rmw_val = wilc_reg_op_apply(op, val);
+			if (op->type == WILC_REG_RMW_DIFF && rmw_val == val) {
+				if (op->out)
+					*op->out = val;
+				i++;
+			} else {
+				rmw_write = true;
+			}
+		}
+	}
+
+	return 0;
+
+single:
+	for (i = slot[0].idx; i < n; i++) {
+		ret = wilc_wlan_reg_op(wilc, &ops[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 static int spi_data_rsp(struct wilc *wilc, u8 cmd)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
-	int result, i;
-	u8 rsp[4];
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	u8 *rsp = spi_priv->scratch->ctl;
+	int i;
 
 	/*
 	 * The response to data packets is two bytes long.  For
-	 * efficiency's sake, wilc_spi_write() wisely ignores the
+	 * efficiency's sake, spi_data_write_sg() wisely ignores the
 	 * responses for all packets but the final one.  The downside
 	 * of that optimization is that when the final data packet is
 	 * short, we may receive (part of) the response to the
 	 * second-to-last packet before the one for the final packet.
-	 * To handle this, we always read 4 bytes and then search for
-	 * the last byte that contains the "Response Start" code (0xc
-	 * in the top 4 bits).  We then know that this byte is the
+	 * To handle this, it always reads 4 bytes and we then search
+	 * for the last byte that contains the "Response Start" code
+	 * (0xc in the top 4 bits).  We then know that this byte is the
 	 * first response byte of the final data packet.
 	 */
-	result = wilc_spi_rx(wilc, rsp, sizeof(rsp));
-	if (result) {
-		dev_err(&spi->dev, "Failed bus error...\n");
-		return result;
-	}
-
-	for (i = sizeof(rsp) - 2; i >= 0; --i)
+	for (i = sizeof(spi_priv->scratch->ctl) - 2; i >= 0; --i)
 		if (FIELD_GET(RSP_START_FIELD, rsp[i]) == RSP_START_TAG)
 			break;
 
@@ -1063,15 +1328,13 @@ static int spi_data_rsp(struct wilc *wilc, u8 cmd)
 	return 0;
 }
 
-static int wilc_spi_write(struct wilc *wilc, u32 addr, u8 *buf, u32 size)
+static int wilc_spi_write_sg(struct wilc *wilc, u32 addr,
+			     const struct kvec *vec, int nvec, u32 size)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
 	int result;
 	u8 retry_limit = SPI_RETRY_MAX_LIMIT;
 
-	/*
-	 * has to be greated than 4
-	 */
 	if (size <= 4)
 		return -EINVAL;
 
@@ -1083,17 +1346,12 @@ retry:
 		goto fail;
 	}
 
-	/*
-	 * Data
-	 */
-	result = spi_data_write(wilc, buf, size);
+	result = spi_data_write_sg(wilc, vec, nvec, size);
 	if (result) {
 		dev_err(&spi->dev, "Failed block data write...\n");
 		goto fail;
 	}
-	/*
-	 * Data response
-	 */
+
 	result = spi_data_rsp(wilc, CMD_DMA_EXT_WRITE);
 	if (result) {
 		dev_err(&spi->dev, "Failed block data rsp...\n");
@@ -1111,6 +1369,13 @@ fail:
 	return result;
 }
 
+static int wilc_spi_write(struct wilc *wilc, u32 addr, u8 *buf, u32 size)
+{
+	struct kvec vec = { .iov_base = buf, .iov_len = size };
+
+	return wilc_spi_write_sg(wilc, addr, &vec, 1, size);
+}
+
 /********************************************
  *
  *      Bus interfaces
@@ -1374,6 +1639,8 @@ static const struct wilc_hif_func wilc_hif_spi = {
 	.hif_clear_int_ext = wilc_spi_clear_int_ext,
 	.hif_read_size = wilc_spi_read_size,
 	.hif_block_tx_ext = wilc_spi_write,
+	.hif_block_tx_ext_sg = wilc_spi_write_sg,
+	.hif_xfer_batch = wilc_spi_xfer_batch,
 	.hif_block_rx_ext = wilc_spi_read,
 	.hif_sync_ext = wilc_spi_sync_ext,
 	.hif_reset = wilc_spi_reset,
@@ -6,12 +6,44 @@
 
 #include <linux/if_ether.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
+#include <linux/module.h>
+#include <linux/if_vlan.h>
+#include <linux/version.h>
 #include <net/dsfield.h>
+#include <net/ipv6.h>
+#include <net/tcp.h>
+/*
+ * The page-pool frag helpers RX reads into (page_pool_unref_page() and
+ * page_pool_put_unrefed_page()) appeared in 6.8. Older kernels copy
+ * every RX frame out of rx_buffer.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#include <net/page_pool/helpers.h>
+#define WILC_RX_PAGE_POOL
+#endif
 #include "cfg80211.h"
 #include "wlan_cfg.h"
 
 #define WAKE_UP_TRIAL_RETRY		10000
 
+/* adaptive register polling, see wilc_poll_wait() */
+#define WILC_POLL_SPIN_MIN_NS		(20 * NSEC_PER_USEC)
+#define WILC_POLL_SPIN_MAX_NS		(500 * NSEC_PER_USEC)
+#define WILC_POLL_SLEEP_MIN_US		8
+#define WILC_POLL_SLEEP_MAX_US		256
+#define WILC_POLL_MAX_US		(20 * USEC_PER_MSEC)
+#define WILC_POLL_WAKEUP_MAX_US		(100 * USEC_PER_MSEC)
+
+struct wilc_poll {
+	struct wilc_poll_stats *st;
+	ktime_t start;
+	u64 spin_ns;
+	u32 iter;
+	u32 sleep_us;
+	bool timed_out;
+};
 
 void acquire_bus(struct wilc *wilc, enum bus_acquire acquire, int source)
 {
@@ -27,71 +59,365 @@ void release_bus(struct wilc *wilc, enum bus_release release, int source)
 	mutex_unlock(&wilc->hif_cs);
 }
 
+static void wilc_poll_start(struct wilc *wilc, struct wilc_poll *p,
+			    enum wilc_poll_site site)
+{
+	p->st = &wilc->poll_stats[site];
+	p->start = ktime_get();
+	/* spin for about twice the usual response time, then sleep */
+	p->spin_ns = clamp_t(u64, 2 * READ_ONCE(p->st->ewma_ns),
+			     WILC_POLL_SPIN_MIN_NS, WILC_POLL_SPIN_MAX_NS);
+	p->iter = 1;
+	p->sleep_us = WILC_POLL_SLEEP_MIN_US;
+	p->timed_out = false;
+}
+
+/*
+ * Called after each read that did not see the expected value. Returns
+ * false once max_iter reads or max_us have been spent, otherwise waits
+ * for the next read: a cpu_relax() while within the spin budget, then
+ * usleep_range() with exponentially growing steps.
+ */
+static bool wilc_poll_wait(struct wilc_poll *p, u32 max_iter, u32 max_us)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), p->start));
+
+	if (p->iter >= max_iter || ns >= (s64)max_us * NSEC_PER_USEC) {
+		p->timed_out = true;
+		return false;
+	}
+
+	p->iter++;
+	if (ns < p->spin_ns) {
+		cpu_relax();
+		return true;
+	}
+
+	usleep_range(p->sleep_us, p->sleep_us * 2);
+	p->sleep_us = min_t(u32, p->sleep_us * 2, WILC_POLL_SLEEP_MAX_US);
+	return true;
+}
+
+static void wilc_poll_end(struct wilc_poll *p)
+{
+	struct wilc_poll_stats *st = p->st;
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), p->start));
+
+	atomic_long_inc(&st->iter_hist[wilc_hist_bucket(p->iter,
+						WILC_POLL_HIST_BUCKETS)]);
+	if (p->timed_out) {
+		atomic_long_inc(&st->timeouts);
+		return;
+	}
+
+	atomic_long_inc(&st->lat_hist[wilc_hist_bucket(ns / NSEC_PER_USEC,
+						WILC_POLL_HIST_BUCKETS)]);
+	/* all poll sites run under hif_cs */
+	WRITE_ONCE(st->ewma_ns, st->ewma_ns - (st->ewma_ns >> 3) + (ns >> 3));
+}
+
+/*
+ * Run one queued register access with the plain read/write ops. This is
+ * what a batch falls back to on buses without a batched transfer.
+ */
+int wilc_wlan_reg_op(struct wilc *wilc, struct wilc_reg_op *op)
+{
+	const struct wilc_hif_func *func = wilc->hif_func;
+	u32 reg, val;
+	int ret;
+
+	if (op->type == WILC_REG_WRITE)
+		return func->hif_write_reg(wilc, op->addr, op->val);
+
+	ret = func->hif_read_reg(wilc, op->addr, &reg);
+	if (ret)
+		return ret;
+
+	val = reg;
+	if (op->type != WILC_REG_READ) {
+		val = wilc_reg_op_apply(op, reg);
+		if (op->type == WILC_REG_RMW || val != reg) {
+			ret = func->hif_write_reg(wilc, op->addr, val);
+			if (ret)
+				return ret;
+		}
+	}
+
+	if (op->out)
+		*op->out = val;
+
+	return 0;
+}
+
+/*
+ * Run @n register accesses in order, as few bus transactions as the bus
+ * allows. Stops at the first failing access.
+ */
+int wilc_wlan_reg_batch(struct wilc *wilc, struct wilc_reg_op *ops, int n)
+{
+	const struct wilc_hif_func *func = wilc->hif_func;
+	int i, ret;
+
+	if (func->hif_xfer_batch)
+		return func->hif_xfer_batch(wilc, ops, n);
+
+	for (i = 0; i < n; i++) {
+		ret = wilc_wlan_reg_op(wilc, &ops[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void *wilc_txq_entry_alloc(gfp_t gfp_mask, void *pool_data)
+{
+	struct wilc *wilc = pool_data;
+	struct txq_entry_t *tqe;
+
+	tqe = kmem_cache_alloc(wilc->txq_entry_cache, gfp_mask);
+	if (tqe)
+		atomic_long_inc(&wilc->txq_pool_stats.slab_allocs);
+
+	return tqe;
+}
+
+static void wilc_txq_entry_free(void *element, void *pool_data)
+{
+	struct wilc *wilc = pool_data;
+
+	kmem_cache_free(wilc->txq_entry_cache, element);
+}
+
+int wilc_wlan_txq_pool_init(struct wilc *wilc)
+{
+	/* slab cache names must be unique, one cache per wiphy */
+	snprintf(wilc->txq_entry_cache_name,
+		 sizeof(wilc->txq_entry_cache_name), "wilc_txq_entry_%s",
+		 wiphy_name(wilc->wiphy));
+	wilc->txq_entry_cache = kmem_cache_create(wilc->txq_entry_cache_name,
+						  sizeof(struct txq_entry_t),
+						  0, 0, NULL);
+	if (!wilc->txq_entry_cache)
+		return -ENOMEM;
+
+	wilc->txq_entry_pool = mempool_create(WILC_TXQ_POOL_RESERVE,
+					      wilc_txq_entry_alloc,
+					      wilc_txq_entry_free, wilc);
+	if (!wilc->txq_entry_pool) {
+		kmem_cache_destroy(wilc->txq_entry_cache);
+		wilc->txq_entry_cache = NULL;
+		return -ENOMEM;
+	}
+
+	/* don't account the reserve prefill as slab allocations */
+	atomic_long_set(&wilc->txq_pool_stats.allocs, 0);
+	atomic_long_set(&wilc->txq_pool_stats.slab_allocs, 0);
+	atomic_long_set(&wilc->txq_pool_stats.misses, 0);
+
+	return 0;
+}
+
+void wilc_wlan_txq_pool_deinit(struct wilc *wilc)
+{
+	mempool_destroy(wilc->txq_entry_pool);
+	wilc->txq_entry_pool = NULL;
+	kmem_cache_destroy(wilc->txq_entry_cache);
+	wilc->txq_entry_cache = NULL;
+}
+
+DEFINE_STATIC_KEY_FALSE(wilc_tx_lat_key);
+
+/* timestamp for the TX latency histograms, 0 while they are off */
+static inline u64 wilc_tx_lat_now(void)
+{
+	if (static_branch_unlikely(&wilc_tx_lat_key))
+		return ktime_get_ns();
+
+	return 0;
+}
+
+static void wilc_tx_lat_account(struct wilc *wilc, u8 ac,
+				enum wilc_tx_lat_stage stage, u64 from, u64 to)
+{
+	u64 us = div_u64(to - from, NSEC_PER_USEC);
+
+	atomic_long_inc(&wilc->tx_lat_stats.hist[ac][stage]
+			[wilc_hist_bucket(us, WILC_TX_LAT_HIST_BUCKETS)]);
+}
+
+static void wilc_tx_lat_record(struct wilc *wilc,
+			       struct wilc_tx_batch *batch,
+			       struct txq_entry_t *tqe, u64 done)
+{
+	u8 ac = tqe->txq_num;
+
+	/* frames stamped before tracking was switched on are skipped */
+	if (!tqe->ts_enq || !batch->ts_sel || !batch->ts_vmm)
+		return;
+
+	wilc_tx_lat_account(wilc, ac, WILC_TX_LAT_QUEUE, tqe->ts_enq,
+			    batch->ts_sel);
+	wilc_tx_lat_account(wilc, ac, WILC_TX_LAT_VMM, batch->ts_sel,
+			    batch->ts_vmm);
+	wilc_tx_lat_account(wilc, ac, WILC_TX_LAT_BUS, batch->ts_vmm, done);
+	wilc_tx_lat_account(wilc, ac, WILC_TX_LAT_TOTAL, tqe->ts_enq, done);
+}
+
+static struct txq_entry_t *wilc_wlan_txq_entry_get(struct wilc *wilc,
+						   gfp_t gfp_mask)
+{
+	struct txq_entry_t *tqe;
+
+	tqe = mempool_alloc(wilc->txq_entry_pool, gfp_mask);
+	if (tqe) {
+		tqe->queued = false;
+		tqe->ts_enq = wilc_tx_lat_now();
+		atomic_long_inc(&wilc->txq_pool_stats.allocs);
+	} else {
+		atomic_long_inc(&wilc->txq_pool_stats.misses);
+	}
+
+	return tqe;
+}
+
+static void wilc_wlan_txq_entry_put(struct wilc *wilc,
+				    struct txq_entry_t *tqe)
+{
+	mempool_free(tqe, wilc->txq_entry_pool);
+}
+
 static void wilc_wlan_txq_remove(struct wilc *wilc, u8 q_num,
 				 struct txq_entry_t *tqe)
 {
 	list_del(&tqe->list);
-	wilc->txq_entries -= 1;
-	wilc->txq[q_num].count--;
+	tqe->queued = false;
+	atomic_dec(&wilc->txq_entries);
+	atomic_dec(&wilc->txq[q_num].count);
+}
+
+/* move what the producers pushed onto the txq thread's own list */
+static void wilc_wlan_txq_drain(struct wilc *wilc, u8 q_num)
+{
+	struct txq_handle *q = &wilc->txq[q_num];
+	struct txq_entry_t *tqe, *tmp;
+	struct llist_node *first;
+	LIST_HEAD(head);
+
+	/* llist hands back the newest first, as repeated list_add() did */
+	first = llist_del_all(&q->head_add);
+	llist_for_each_entry_safe(tqe, tmp, first, lnode) {
+		tqe->txq_num = q_num;
+		tqe->queued = true;
+		list_add_tail(&tqe->list, &head);
+	}
+	list_splice(&head, &q->txq_head);
+
+	first = llist_reverse_order(llist_del_all(&q->tail_add));
+	llist_for_each_entry_safe(tqe, tmp, first, lnode) {
+		tqe->txq_num = q_num;
+		tqe->queued = true;
+		list_add_tail(&tqe->list, &q->txq_head);
+	}
 }
 
 static struct txq_entry_t *
 wilc_wlan_txq_remove_from_head(struct wilc *wilc, u8 q_num)
 {
-	struct txq_entry_t *tqe = NULL;
-	unsigned long flags;
-
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
+	struct txq_entry_t *tqe;
 
-	if (!list_empty(&wilc->txq[q_num].txq_head.list)) {
-		tqe = list_first_entry(&wilc->txq[q_num].txq_head.list,
+	wilc_wlan_txq_drain(wilc, q_num);
+	tqe = list_first_entry_or_null(&wilc->txq[q_num].txq_head,
 				       struct txq_entry_t, list);
-		list_del(&tqe->list);
-		wilc->txq_entries -= 1;
-		wilc->txq[q_num].count--;
-	}
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
+	if (tqe)
+		wilc_wlan_txq_remove(wilc, q_num, tqe);
+
 	return tqe;
 }
 
 static void wilc_wlan_txq_add_to_tail(struct net_device *dev, u8 q_num,
 				      struct txq_entry_t *tqe)
 {
-	unsigned long flags;
 	struct wilc_vif *vif = netdev_priv(dev);
 	struct wilc *wilc = vif->wilc;
+	int entries;
 
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
-
-	list_add_tail(&tqe->list, &wilc->txq[q_num].txq_head.list);
-	wilc->txq_entries += 1;
-	wilc->txq[q_num].count++;
+	atomic_inc(&wilc->txq[q_num].count);
+	entries = atomic_inc_return(&wilc->txq_entries);
 	PRINT_INFO(vif->ndev, TX_DBG, "Number of entries in TxQ = %d\n",
-		   wilc->txq_entries);
+		   entries);
+	llist_add(&tqe->lnode, &wilc->txq[q_num].tail_add);
+}
+
+static unsigned int tx_holdoff_us;
+module_param(tx_holdoff_us, uint, 0644);
+MODULE_PARM_DESC(tx_holdoff_us,
+		 "Time in us the TX thread wakeup for a data frame is held\n"
+		 "\t\t\toff while frames arrive back to back, so more of\n"
+		 "\t\t\tthem share a VMM batch. 0 (default) disables it.");
+
+static unsigned int tx_min_batch = 8;
+module_param(tx_min_batch, uint, 0644);
+MODULE_PARM_DESC(tx_min_batch,
+		 "Number of queued frames that wakes the TX thread at\n"
+		 "\t\t\tonce, cutting the hold-off short.");
+
+/* a frame this many hold-offs after the previous one finds the link idle */
+#define WILC_TX_HOLDOFF_IDLE		4
 
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
+static enum hrtimer_restart wilc_wlan_txq_holdoff_fn(struct hrtimer *t)
+{
+	struct wilc *wilc = container_of(t, struct wilc, tx_holdoff_timer);
 
-	PRINT_INFO(vif->ndev, TX_DBG, "Wake the txq_handling\n");
+	atomic_set(&wilc->tx_holdoff_armed, 0);
 	complete(&wilc->txq_event);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Wake the txq thread for queued data frames. With tx_holdoff_us set and
+ * frames arriving back to back, the wakeup waits that long for more of
+ * them unless tx_min_batch frames are already queued. A frame on an idle
+ * link goes out at once, so the hold-off only costs latency under load.
+ */
+void wilc_wlan_txq_kick(struct wilc *wilc)
+{
+	u32 holdoff = READ_ONCE(tx_holdoff_us);
+	u64 now = ktime_get_ns();
+	u64 last = atomic64_xchg(&wilc->tx_last_kick_ns, now);
+
+	if (!holdoff ||
+	    atomic_read(&wilc->txq_entries) >= READ_ONCE(tx_min_batch) ||
+	    now - last > (u64)holdoff * WILC_TX_HOLDOFF_IDLE * NSEC_PER_USEC) {
+		/* a timer that fires anyway only costs an empty pass */
+		if (atomic_xchg(&wilc->tx_holdoff_armed, 0))
+			hrtimer_try_to_cancel(&wilc->tx_holdoff_timer);
+		complete(&wilc->txq_event);
+		return;
+	}
+
+	if (!atomic_xchg(&wilc->tx_holdoff_armed, 1)) {
+		atomic_long_inc(&wilc->tx_batch_stats.holdoffs);
+		hrtimer_start(&wilc->tx_holdoff_timer, us_to_ktime(holdoff),
+			      HRTIMER_MODE_REL);
+	}
 }
 
 static void wilc_wlan_txq_add_to_head(struct wilc_vif *vif, u8 q_num,
 				      struct txq_entry_t *tqe)
 {
-	unsigned long flags;
 	struct wilc *wilc = vif->wilc;
+	int entries;
 
 	mutex_lock(&wilc->txq_add_to_head_cs);
 
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
-
-	list_add(&tqe->list, &wilc->txq[q_num].txq_head.list);
-	wilc->txq_entries += 1;
-	wilc->txq[q_num].count++;
+	atomic_inc(&wilc->txq[q_num].count);
+	entries = atomic_inc_return(&wilc->txq_entries);
 	PRINT_INFO(vif->ndev, TX_DBG, "Number of entries in TxQ = %d\n",
-		   wilc->txq_entries);
+		   entries);
+	llist_add(&tqe->lnode, &wilc->txq[q_num].head_add);
 
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
 	mutex_unlock(&wilc->txq_add_to_head_cs);
 	complete(&wilc->txq_event);
 	PRINT_INFO(vif->ndev, TX_DBG, "Wake up the txq_handler\n");
@@ -99,97 +425,195 @@ static void wilc_wlan_txq_add_to_head(struct wilc_vif *vif, u8 q_num,
 
 #define NOT_TCP_ACK			(-1)
 
-static inline void add_tcp_session(struct wilc_vif *vif, u32 src_prt,
-				   u32 dst_prt, u32 seq)
+static unsigned int ack_filter_flows = 64;
+module_param(ack_filter_flows, uint, 0644);
+MODULE_PARM_DESC(ack_filter_flows,
+		 "Number of TCP flows tracked per interface by the ACK\n"
+		 "\t\t\tfilter. Past this the least recently used flow is\n"
+		 "\t\t\trecycled; lowering it only affects new flows.");
+
+void wilc_ack_filter_init(struct wilc_vif *vif)
 {
 	struct tcp_ack_filter *f = &vif->ack_filter;
 
-	if (f->tcp_session < 2 * MAX_TCP_SESSION) {
-		f->ack_session_info[f->tcp_session].seq_num = seq;
-		f->ack_session_info[f->tcp_session].bigger_ack_num = 0;
-		f->ack_session_info[f->tcp_session].src_port = src_prt;
-		f->ack_session_info[f->tcp_session].dst_port = dst_prt;
-		f->tcp_session++;
-		PRINT_INFO(vif->ndev, TCP_ENH, "TCP Session %d to Ack %d\n",
-			   f->tcp_session, seq);
-	}
+	spin_lock_init(&f->lock);
+	hash_init(f->flows);
+	INIT_LIST_HEAD(&f->lru);
+	f->nr_flows = 0;
+	f->pending_acks_idx = 0;
 }
 
-static inline void update_tcp_session(struct wilc_vif *vif, u32 index, u32 ack)
+void wilc_ack_filter_flush(struct wilc_vif *vif)
 {
 	struct tcp_ack_filter *f = &vif->ack_filter;
+	struct wilc_ack_flow *flow, *tmp;
+	unsigned long flags;
 
-	if (index < 2 * MAX_TCP_SESSION &&
-	    ack > f->ack_session_info[index].bigger_ack_num)
-		f->ack_session_info[index].bigger_ack_num = ack;
+	spin_lock_irqsave(&f->lock, flags);
+	list_for_each_entry_safe(flow, tmp, &f->lru, lru) {
+		hash_del(&flow->node);
+		list_del(&flow->lru);
+		kfree(flow);
+	}
+	f->nr_flows = 0;
+	f->pending_acks_idx = 0;
+	spin_unlock_irqrestore(&f->lock, flags);
+}
+
+static struct wilc_ack_flow *
+wilc_ack_flow_get(struct tcp_ack_filter *f, const struct wilc_ack_flow_key *key)
+{
+	u32 hash = jhash(key, sizeof(*key), 0);
+	struct wilc_ack_flow *flow;
+
+	hash_for_each_possible(f->flows, flow, node, hash) {
+		if (!memcmp(&flow->key, key, sizeof(*key))) {
+			list_move(&flow->lru, &f->lru);
+			return flow;
+		}
+	}
+
+	if (f->nr_flows < READ_ONCE(ack_filter_flows)) {
+		flow = kzalloc(sizeof(*flow), GFP_ATOMIC);
+		if (!flow)
+			return NULL;
+		f->nr_flows++;
+	} else {
+		/* pending ACKs still point at flows seen in this round */
+		flow = list_last_entry_or_null(&f->lru, struct wilc_ack_flow,
+					       lru);
+		if (!flow || flow->round == f->round)
+			return NULL;
+		hash_del(&flow->node);
+		list_del(&flow->lru);
+		flow->suppressed = 0;
+	}
+
+	flow->key = *key;
+	flow->round = f->round - 1;
+	hash_add(f->flows, &flow->node, hash);
+	list_add(&flow->lru, &f->lru);
+
+	return flow;
 }
 
 static inline void add_tcp_pending_ack(struct wilc_vif *vif, u32 ack,
-				       u32 session_index,
+				       struct wilc_ack_flow *flow,
 				       struct txq_entry_t *txqe)
 {
 	struct tcp_ack_filter *f = &vif->ack_filter;
-	u32 i = f->pending_base + f->pending_acks_idx;
+	u32 i = f->pending_acks_idx;
 
 	if (i < MAX_PENDING_ACKS) {
 		f->pending_acks[i].ack_num = ack;
 		f->pending_acks[i].txqe = txqe;
-		f->pending_acks[i].session_index = session_index;
+		f->pending_acks[i].flow = flow;
 		txqe->ack_idx = i;
 		f->pending_acks_idx++;
 	}
 }
 
-static inline void tcp_process(struct net_device *dev, struct txq_entry_t *tqe)
+/*
+ * Fill in the flow key and ACK number of a pure TCP ACK, IPv4 or IPv6.
+ * IPv4 addresses are stored v4-mapped so both share one key layout.
+ */
+static bool tcp_ack_parse(struct txq_entry_t *tqe,
+			  struct wilc_ack_flow_key *key, u32 *ack_no)
 {
-	void *buffer = tqe->buffer;
-	const struct ethhdr *eth_hdr_ptr = buffer;
-	int i;
-	unsigned long flags;
-	struct wilc_vif *vif = netdev_priv(dev);
-	struct wilc *wilc = vif->wilc;
-	struct tcp_ack_filter *f = &vif->ack_filter;
-	const struct iphdr *ip_hdr_ptr;
+	struct sk_buff *skb = ((struct tx_complete_data *)tqe->priv)->skb;
+	const struct ethhdr *eth_hdr_ptr = (void *)tqe->buffer;
 	const struct tcphdr *tcp_hdr_ptr;
-	u32 ihl, total_length, data_offset;
+	u32 len = tqe->buffer_size;
+	u32 ip_end, tcp_off;
+
+	if (len < ETH_HLEN)
+		return false;
+
+	if (eth_hdr_ptr->h_proto == htons(ETH_P_IP)) {
+		const struct iphdr *ip_hdr_ptr = (void *)&tqe->buffer[ETH_HLEN];
+
+		if (len < ETH_HLEN + sizeof(*ip_hdr_ptr) ||
+		    ip_hdr_ptr->protocol != IPPROTO_TCP ||
+		    ip_hdr_ptr->ihl < 5 || ip_is_fragment(ip_hdr_ptr))
+			return false;
+
+		tcp_off = ETH_HLEN + (ip_hdr_ptr->ihl << 2);
+		ip_end = ntohs(ip_hdr_ptr->tot_len) + ETH_HLEN;
+		ipv6_addr_set_v4mapped(ip_hdr_ptr->saddr, &key->saddr);
+		ipv6_addr_set_v4mapped(ip_hdr_ptr->daddr, &key->daddr);
+	} else if (eth_hdr_ptr->h_proto == htons(ETH_P_IPV6)) {
+		const struct ipv6hdr *ip6_hdr_ptr;
+		__be16 frag_off;
+		u8 nexthdr;
+		int off;
+
+		if (len < ETH_HLEN + sizeof(*ip6_hdr_ptr))
+			return false;
+
+		ip6_hdr_ptr = (void *)&tqe->buffer[ETH_HLEN];
+		nexthdr = ip6_hdr_ptr->nexthdr;
+		off = ipv6_skip_exthdr(skb, ETH_HLEN + sizeof(*ip6_hdr_ptr),
+				       &nexthdr, &frag_off);
+		if (off < 0 || nexthdr != IPPROTO_TCP || frag_off)
+			return false;
+
+		tcp_off = off;
+		ip_end = ntohs(ip6_hdr_ptr->payload_len) + ETH_HLEN +
+			 sizeof(*ip6_hdr_ptr);
+		key->saddr = ip6_hdr_ptr->saddr;
+		key->daddr = ip6_hdr_ptr->daddr;
+	} else {
+		return false;
+	}
 
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
+	if (len < tcp_off + sizeof(*tcp_hdr_ptr))
+		return false;
 
-	if (eth_hdr_ptr->h_proto != htons(ETH_P_IP))
-		goto out;
+	tcp_hdr_ptr = (void *)&tqe->buffer[tcp_off];
 
-	ip_hdr_ptr = buffer + ETH_HLEN;
+	/* only pure ACKs: no SYN, FIN, RST or URG and no payload */
+	if ((tcp_flag_word(tcp_hdr_ptr) &
+	     (TCP_FLAG_ACK | TCP_FLAG_SYN | TCP_FLAG_FIN | TCP_FLAG_RST |
+	      TCP_FLAG_URG)) != TCP_FLAG_ACK ||
+	    ip_end != tcp_off + (tcp_hdr_ptr->doff << 2))
+		return false;
 
-	if (ip_hdr_ptr->protocol != IPPROTO_TCP)
-		goto out;
+	key->sport = tcp_hdr_ptr->source;
+	key->dport = tcp_hdr_ptr->dest;
+	*ack_no = ntohl(tcp_hdr_ptr->ack_seq);
 
-	ihl = ip_hdr_ptr->ihl << 2;
-	tcp_hdr_ptr = buffer + ETH_HLEN + ihl;
-	total_length = ntohs(ip_hdr_ptr->tot_len);
+	return true;
+}
 
-	data_offset = tcp_hdr_ptr->doff << 2;
-	if (total_length == (ihl + data_offset)) {
-		u32 seq_no, ack_no;
+static inline void tcp_process(struct net_device *dev, struct txq_entry_t *tqe)
+{
+	unsigned long flags;
+	struct wilc_vif *vif = netdev_priv(dev);
+	struct tcp_ack_filter *f = &vif->ack_filter;
+	struct wilc_ack_flow_key key;
+	struct wilc_ack_flow *flow;
+	u32 ack_no;
 
-		seq_no = ntohl(tcp_hdr_ptr->seq);
-		ack_no = ntohl(tcp_hdr_ptr->ack_seq);
-		for (i = 0; i < f->tcp_session; i++) {
-			u32 j = f->ack_session_info[i].seq_num;
+	if (!tcp_ack_parse(tqe, &key, &ack_no))
+		return;
 
-			if (i < 2 * MAX_TCP_SESSION &&
-			    j == seq_no) {
-				update_tcp_session(vif, i, ack_no);
-				break;
-			}
-		}
-		if (i == f->tcp_session)
-			add_tcp_session(vif, 0, 0, seq_no);
+	spin_lock_irqsave(&f->lock, flags);
 
-		add_tcp_pending_ack(vif, ack_no, i, tqe);
+	flow = wilc_ack_flow_get(f, &key);
+	if (!flow)
+		goto out;
+
+	if (flow->round != f->round) {
+		flow->round = f->round;
+		flow->bigger_ack_num = ack_no;
+	} else if (after(ack_no, flow->bigger_ack_num)) {
+		flow->bigger_ack_num = ack_no;
 	}
 
+	add_tcp_pending_ack(vif, ack_no, flow, tqe);
+
 out:
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
+	spin_unlock_irqrestore(&f->lock, flags);
 }
 
 static void wilc_wlan_txq_filter_dup_tcp_ack(struct net_device *dev)
@@ -198,80 +622,56 @@ static void wilc_wlan_txq_filter_dup_tcp_ack(struct net_device *dev)
 	struct wilc *wilc = vif->wilc;
 	struct tcp_ack_filter *f = &vif->ack_filter;
 	u32 i = 0;
-	u32 dropped = 0;
 	unsigned long flags;
 
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
-	for (i = f->pending_base;
-	     i < (f->pending_base + f->pending_acks_idx); i++) {
-		u32 index;
-		u32 bigger_ack_num;
-
-		if (i >= MAX_PENDING_ACKS)
-			break;
-
-		index = f->pending_acks[i].session_index;
-
-		if (index >= 2 * MAX_TCP_SESSION)
-			break;
-
-		bigger_ack_num = f->ack_session_info[index].bigger_ack_num;
+	spin_lock_irqsave(&f->lock, flags);
+	for (i = 0; i < f->pending_acks_idx; i++) {
+		struct wilc_ack_flow *flow = f->pending_acks[i].flow;
 
-		if (f->pending_acks[i].ack_num < bigger_ack_num) {
+		if (before(f->pending_acks[i].ack_num, flow->bigger_ack_num)) {
 			struct txq_entry_t *tqe;
 
 			PRINT_INFO(vif->ndev, TCP_ENH, "DROP ACK: %u\n",
 				   f->pending_acks[i].ack_num);
 			tqe = f->pending_acks[i].txqe;
-			if (tqe) {
-				wilc_wlan_txq_remove(wilc, tqe->q_num, tqe);
+			/* skip ACKs still on their way into the queue */
+			if (tqe && tqe->queued) {
+				wilc_wlan_txq_remove(wilc, tqe->txq_num, tqe);
 				tqe->status = 1;
 				if (tqe->tx_complete_func)
 					tqe->tx_complete_func(tqe->priv,
 							      tqe->status);
-				kfree(tqe);
-				dropped++;
+				wilc_wlan_txq_entry_put(wilc, tqe);
+				flow->suppressed++;
 			}
 		}
 	}
 	f->pending_acks_idx = 0;
-	f->tcp_session = 0;
-
-	if (f->pending_base == 0)
-		f->pending_base = MAX_TCP_SESSION;
-	else
-		f->pending_base = 0;
-
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
+	f->round++;
 
-	while (dropped > 0) {
-		if (!wait_for_completion_timeout(&wilc->txq_event,
-						 msecs_to_jiffies(1)))
-			PRINT_ER(vif->ndev, "completion timedout\n");
-		dropped--;
-	}
+	spin_unlock_irqrestore(&f->lock, flags);
 }
 
 static struct net_device *get_if_handler(struct wilc *wilc, u8 *mac_header)
 {
-	struct net_device *mon_netdev = NULL;
-	struct wilc_vif *vif;
 	struct ieee80211_hdr *h = (struct ieee80211_hdr *)mac_header;
+	struct net_device *ndev = NULL;
+	struct wilc_vif *vif;
 
-	list_for_each_entry_rcu(vif, &wilc->vif_list, list) {
-		if (vif->iftype == WILC_STATION_MODE)
-			if (ether_addr_equal_unaligned(h->addr2, vif->bssid))
-				return vif->ndev;
-		if (vif->iftype == WILC_AP_MODE)
-			if (ether_addr_equal_unaligned(h->addr1, vif->bssid))
-				return vif->ndev;
+	rcu_read_lock();
+	vif = wilc_bssid_lookup(wilc, h->addr2, WILC_STATION_MODE);
+	if (!vif)
+		vif = wilc_bssid_lookup(wilc, h->addr1, WILC_AP_MODE);
+	rcu_read_unlock();
+	if (vif)
+		return vif->ndev;
+
+	/* frames of no known BSS go to a monitor vif, if there is one */
+	list_for_each_entry_rcu(vif, &wilc->vif_list, list)
 		if (vif->iftype == WILC_MONITOR_MODE)
-			mon_netdev = vif->ndev;
-	}
+			ndev = vif->ndev;
 
-	if (!mon_netdev)
-		pr_warn("%s Invalid handle\n", __func__);
-	return mon_netdev;
+	return ndev;
 }
 
 void wilc_enable_tcp_ack_filter(struct wilc_vif *vif, bool value)
@@ -297,7 +697,7 @@ static int wilc_wlan_txq_add_cfg_pkt(struct wilc_vif *vif, u8 *buffer,
 		complete(&wilc->cfg_event);
 		return 0;
 	}
-	tqe = kmalloc(sizeof(*tqe), GFP_KERNEL);
+	tqe = wilc_wlan_txq_entry_get(wilc, GFP_KERNEL);
 	if (!tqe) {
 		complete(&wilc->cfg_event);
 		return 0;
@@ -320,88 +720,193 @@ static int wilc_wlan_txq_add_cfg_pkt(struct wilc_vif *vif, u8 *buffer,
 	return 1;
 }
 
-static bool is_ac_q_limit(struct wilc *wl, u8 q_num)
+static unsigned int ac_weight[NQUEUES] = {1, 1, 1, 1};
+module_param_array(ac_weight, uint, NULL, 0644);
+MODULE_PARM_DESC(ac_weight,
+		 "Admission weight per AC (VO,VI,BE,BK). An AC's slice\n"
+		 "\t\t\tof the TX queue limit follows its weighted share of\n"
+		 "\t\t\trecent frames.");
+
+static unsigned int ac_min_share;
+module_param(ac_min_share, uint, 0644);
+MODULE_PARM_DESC(ac_min_share,
+		 "Minimum slice of the TX queue limit, in percent, that\n"
+		 "\t\t\tevery AC keeps however little it was used.");
+
+void wilc_wlan_ac_share_init(struct wilc *wilc)
 {
-	u8 factors[NQUEUES] = {1, 1, 1, 1};
-	u16 i;
-	unsigned long flags;
-	struct wilc_tx_queue_status *q = &wl->tx_q_limit;
-	u8 end_index;
-	u8 q_limit;
-	bool ret = false;
-
-	spin_lock_irqsave(&wl->txq_spinlock, flags);
-	if (!q->initialized) {
-		for (i = 0; i < AC_BUFFER_SIZE; i++)
-			q->buffer[i] = i % NQUEUES;
-
-		for (i = 0; i < NQUEUES; i++) {
-			q->cnt[i] = AC_BUFFER_SIZE * factors[i] / NQUEUES;
-			q->sum += q->cnt[i];
-		}
-		q->end_index = AC_BUFFER_SIZE - 1;
-		q->initialized = 1;
+	struct wilc_ac_share *s = &wilc->tx_ac_share;
+	int i;
+
+	/* start out as if every AC had sent the same number of frames */
+	s->total = 0;
+	for (i = 0; i < NQUEUES; i++) {
+		s->share[i] = (ac_weight[i] << WILC_AC_SHARE_FRAC) / NQUEUES;
+		s->total += s->share[i];
+		atomic_set(&s->offered[i], 0);
+		s->seen[i] = 0;
+	}
+}
+
+/*
+ * Fold the frames offered to each AC since the last pass into the
+ * shares. Up to 2^WILC_AC_SHARE_SHIFT frames this is the per-frame
+ * decay, linearised, with the frames of the pass spread evenly; past
+ * that the old history is gone and the shares are the mix of the pass.
+ */
+static void wilc_wlan_ac_share_update(struct wilc *wilc)
+{
+	struct wilc_ac_share *s = &wilc->tx_ac_share;
+	u32 n[NQUEUES], frames = 0;
+	u64 total = 0;
+	int i;
+
+	for (i = 0; i < NQUEUES; i++) {
+		u32 offered = atomic_read(&s->offered[i]);
+
+		n[i] = offered - s->seen[i];
+		s->seen[i] = offered;
+		frames += n[i];
 	}
+	if (!frames)
+		return;
 
-	end_index = q->end_index;
-	q->cnt[q->buffer[end_index]] -= factors[q->buffer[end_index]];
-	q->cnt[q_num] += factors[q_num];
-	q->sum += (factors[q_num] - factors[q->buffer[end_index]]);
+	for (i = 0; i < NQUEUES; i++) {
+		u64 w = (u64)READ_ONCE(ac_weight[i]) << WILC_AC_SHARE_FRAC;
+		u64 share = s->share[i];
 
-	q->buffer[end_index] = q_num;
-	if (end_index > 0)
-		q->end_index--;
-	else
-		q->end_index = AC_BUFFER_SIZE - 1;
+		if (frames < BIT(WILC_AC_SHARE_SHIFT))
+			share += ((w * n[i]) >> WILC_AC_SHARE_SHIFT) -
+				 ((share * frames) >> WILC_AC_SHARE_SHIFT);
+		else
+			share = div_u64(w * n[i], frames);
+		WRITE_ONCE(s->share[i], share);
+		total += share;
+	}
+	WRITE_ONCE(s->total, total);
+}
 
-	if (!q->sum)
-		q_limit = 1;
-	else
-		q_limit = (q->cnt[q_num] * FLOW_CONTROL_UPPER_THRESHOLD / q->sum) + 1;
+/*
+ * Admit a frame to AC q_num while the queue holds no more than the AC's
+ * share of FLOW_CONTROL_UPPER_THRESHOLD, plus one. Written as a product
+ * so the enqueue path does a fixed amount of work, no division and no
+ * locking; the shares it reads may be one txq pass old.
+ */
+static bool is_ac_q_limit(struct wilc *wl, u8 q_num)
+{
+	struct wilc_ac_share *s = &wl->tx_ac_share;
+	u32 count = atomic_read(&wl->txq[q_num].count);
+	u64 share, total;
 
-	if (wl->txq[q_num].count <= q_limit)
-		ret = true;
+	atomic_inc(&s->offered[q_num]);
+	if (!count)
+		return true;
 
-	spin_unlock_irqrestore(&wl->txq_spinlock, flags);
+	share = READ_ONCE(s->share[q_num]);
+	total = READ_ONCE(s->total);
+	if (!total)
+		return true;
 
-	return ret;
+	/* scale both sides by 100 to apply the percent floor */
+	share = max(share * 100, total * READ_ONCE(ac_min_share));
+
+	return (u64)(count - 1) * total * 100 <=
+	       share * FLOW_CONTROL_UPPER_THRESHOLD;
+}
+
+/* the DSCP code points the driver always prioritised, everything else BE */
+static const u8 wilc_default_dscp_ac[WILC_DSCP_NUM] = {
+	[0 ... WILC_DSCP_NUM - 1] = AC_BE_Q,
+	[2] = AC_BK_Q, [8] = AC_BK_Q, [16] = AC_BK_Q,
+	[10] = AC_VI_Q, [32] = AC_VI_Q, [40] = AC_VI_Q,
+	[34] = AC_VO_Q, [46] = AC_VO_Q, [48] = AC_VO_Q, [52] = AC_VO_Q,
+	[56] = AC_VO_Q,
+};
+
+/* 802.1D user priority to AC, as in IEEE 802.11 Table 10-1 */
+static const u8 wilc_default_prio_ac[WILC_PRIO_NUM] = {
+	AC_BE_Q, AC_BK_Q, AC_BK_Q, AC_BE_Q, AC_VI_Q, AC_VI_Q, AC_VO_Q, AC_VO_Q,
+};
+
+int wilc_wlan_ac_map_init(struct wilc *wilc)
+{
+	struct wilc_ac_map *map;
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+
+	memcpy(map->dscp, wilc_default_dscp_ac, sizeof(map->dscp));
+	memcpy(map->prio, wilc_default_prio_ac, sizeof(map->prio));
+	RCU_INIT_POINTER(wilc->ac_map, map);
+
+	return 0;
 }
 
-static inline u8 ac_classify(struct wilc *wilc, struct sk_buff *skb)
+void wilc_wlan_ac_map_deinit(struct wilc *wilc)
 {
+	kfree(rcu_dereference_protected(wilc->ac_map, true));
+	RCU_INIT_POINTER(wilc->ac_map, NULL);
+}
+
+/*
+ * Map DSCP code point (or 802.1D priority if @prio) @idx to @ac. The
+ * table is copied and swapped so the TX path never sees a partial update.
+ */
+int wilc_wlan_ac_map_set(struct wilc *wilc, bool prio, unsigned int idx,
+			 u8 ac)
+{
+	struct wilc_ac_map *old, *map;
+
+	if (ac >= NQUEUES || idx >= (prio ? WILC_PRIO_NUM : WILC_DSCP_NUM))
+		return -EINVAL;
+
+	map = kmalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+
+	mutex_lock(&wilc->ac_map_lock);
+	old = rcu_dereference_protected(wilc->ac_map,
+					lockdep_is_held(&wilc->ac_map_lock));
+	memcpy(map, old, sizeof(*map));
+	if (prio)
+		map->prio[idx] = ac;
+	else
+		map->dscp[idx] = ac;
+	rcu_assign_pointer(wilc->ac_map, map);
+	mutex_unlock(&wilc->ac_map_lock);
+
+	kfree_rcu(old, rcu);
+
+	return 0;
+}
+
+/*
+ * An 802.1D priority from the stack (skb->priority 256-263) or a VLAN
+ * tag wins over the DSCP of the IP header; either way it is one lookup.
+ */
+u8 wilc_ac_classify(struct wilc *wilc, struct sk_buff *skb)
+{
+	const struct wilc_ac_map *map;
+	int prio = -1, dscp = -1;
 	u8 q_num = AC_BE_Q;
-	u8 dscp;
-
-	switch (skb->protocol) {
-	case htons(ETH_P_IP):
-		dscp = ipv4_get_dsfield(ip_hdr(skb)) & 0xfc;
-		break;
-	case htons(ETH_P_IPV6):
-		dscp = ipv6_get_dsfield(ipv6_hdr(skb)) & 0xfc;
-		break;
-	default:
-		return q_num;
-	}
-
-	switch (dscp) {
-	case 0x08:
-	case 0x20:
-	case 0x40:
-		q_num = AC_BK_Q;
-		break;
-	case 0x80:
-	case 0xA0:
-	case 0x28:
-		q_num = AC_VI_Q;
-		break;
-	case 0xC0:
-	case 0xD0:
-	case 0xE0:
-	case 0x88:
-	case 0xB8:
-		q_num = AC_VO_Q;
-		break;
-	}
+
+	if (skb->priority >= 256 && skb->priority <= 263)
+		prio = skb->priority - 256;
+	else if (skb_vlan_tag_present(skb))
+		prio = skb_vlan_tag_get_prio(skb);
+	else if (skb->protocol == htons(ETH_P_IP))
+		dscp = ipv4_get_dsfield(ip_hdr(skb)) >> 2;
+	else if (skb->protocol == htons(ETH_P_IPV6))
+		dscp = ipv6_get_dsfield(ipv6_hdr(skb)) >> 2;
+
+	rcu_read_lock();
+	map = rcu_dereference(wilc->ac_map);
+	if (prio >= 0)
+		q_num = map->prio[prio];
+	else if (dscp >= 0)
+		q_num = map->dscp[dscp];
+	rcu_read_unlock();
 
 	return q_num;
 }
@@ -447,10 +952,15 @@ static inline u8 ac_change(struct wilc *wilc, u8 *ac)
 	return 1;
 }
 
+/*
+ * Queue a data frame. Returns the depth of the AC queue it went to, which
+ * is stored in @ac and may be below the one it was classified to when
+ * that AC requires admission control; 0 if the frame was dropped.
+ */
 int wilc_wlan_txq_add_net_pkt(struct net_device *dev,
 			      struct tx_complete_data *tx_data, u8 *buffer,
 			      u32 buffer_size,
-			      void (*tx_complete_fn)(void *, int))
+			      void (*tx_complete_fn)(void *, int), u8 *ac)
 {
 	struct txq_entry_t *tqe;
 	struct wilc_vif *vif = netdev_priv(dev);
@@ -473,7 +983,13 @@ int wilc_wlan_txq_add_net_pkt(struct net_device *dev,
 		return 0;
 	}
 
-	tqe = kmalloc(sizeof(*tqe), GFP_ATOMIC);
+	/*
+	 * Only tx_complete_data lives in skb->cb. The queue entry is about
+	 * twice the size of the cb and shared with config and management
+	 * frames, so it comes from the mempool, which cannot run dry below
+	 * the flow control limit.
+	 */
+	tqe = wilc_wlan_txq_entry_get(wilc, GFP_ATOMIC);
 
 	if (!tqe) {
 		PRINT_INFO(vif->ndev, TX_DBG,
@@ -488,13 +1004,17 @@ int wilc_wlan_txq_add_net_pkt(struct net_device *dev,
 	tqe->priv = tx_data;
 	tqe->vif = vif;
 
-	q_num = ac_classify(wilc, tx_data->skb);
+	/* frames through the AC netdev queues were classified on selection */
+	if (tx_data->txq)
+		q_num = skb_get_queue_mapping(tx_data->skb);
+	else
+		q_num = wilc_ac_classify(wilc, tx_data->skb);
 	tqe->q_num = q_num;
 	if (ac_change(wilc, &q_num)) {
 		PRINT_INFO(vif->ndev, GENERIC_DBG,
 			   "No suitable non-ACM queue\n");
 		tx_complete_fn(tx_data, 0);
-		kfree(tqe);
+		wilc_wlan_txq_entry_put(wilc, tqe);
 		return 0;
 	}
 
@@ -505,12 +1025,15 @@ int wilc_wlan_txq_add_net_pkt(struct net_device *dev,
 		if (vif->ack_filter.enabled)
 			tcp_process(dev, tqe);
 		wilc_wlan_txq_add_to_tail(dev, q_num, tqe);
+		atomic_long_inc(&wilc->tx_ac_enqueued[tqe->q_num]);
 	} else {
 		tx_complete_fn(tx_data, 0);
-		kfree(tqe);
+		wilc_wlan_txq_entry_put(wilc, tqe);
+		return 0;
 	}
 
-	return wilc->txq_entries;
+	*ac = q_num;
+	return atomic_read(&wilc->txq[q_num].count);
 }
 
 int wilc_wlan_txq_add_mgmt_pkt(struct net_device *dev, void *priv, u8 *buffer,
@@ -534,7 +1057,7 @@ int wilc_wlan_txq_add_mgmt_pkt(struct net_device *dev, void *priv, u8 *buffer,
 		tx_complete_fn(priv, 0);
 		return 0;
 	}
-	tqe = kmalloc(sizeof(*tqe), GFP_ATOMIC);
+	tqe = wilc_wlan_txq_entry_get(wilc, GFP_ATOMIC);
 
 	if (!tqe) {
 		PRINT_INFO(vif->ndev, TX_DBG, "Queue malloc failed\n");
@@ -552,64 +1075,24 @@ int wilc_wlan_txq_add_mgmt_pkt(struct net_device *dev, void *priv, u8 *buffer,
 
 	PRINT_INFO(vif->ndev, TX_DBG, "Adding Mgmt packet to Queue tail\n");
 	wilc_wlan_txq_add_to_tail(dev, AC_VO_Q, tqe);
+	complete(&wilc->txq_event);
 	return 1;
 }
 
 static struct txq_entry_t *wilc_wlan_txq_get_first(struct wilc *wilc, u8 q_num)
 {
-	struct txq_entry_t *tqe = NULL;
-	unsigned long flags;
-
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
-
-	if (!list_empty(&wilc->txq[q_num].txq_head.list))
-		tqe = list_first_entry(&wilc->txq[q_num].txq_head.list,
-				       struct txq_entry_t, list);
-
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
-
-	return tqe;
+	return list_first_entry_or_null(&wilc->txq[q_num].txq_head,
+					struct txq_entry_t, list);
 }
 
 static struct txq_entry_t *wilc_wlan_txq_get_next(struct wilc *wilc,
 						  struct txq_entry_t *tqe,
 						  u8 q_num)
 {
-	unsigned long flags;
-
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
-
-	if (!list_is_last(&tqe->list, &wilc->txq[q_num].txq_head.list))
-		tqe = list_next_entry(tqe, list);
-	else
-		tqe = NULL;
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
-
-	return tqe;
-}
-
-static void wilc_wlan_rxq_add(struct wilc *wilc, struct rxq_entry_t *rqe)
-{
-	if (wilc->quit)
-		return;
-
-	mutex_lock(&wilc->rxq_cs);
-	list_add_tail(&rqe->list, &wilc->rxq_head.list);
-	mutex_unlock(&wilc->rxq_cs);
-}
-
-static struct rxq_entry_t *wilc_wlan_rxq_remove(struct wilc *wilc)
-{
-	struct rxq_entry_t *rqe = NULL;
+	if (list_is_last(&tqe->list, &wilc->txq[q_num].txq_head))
+		return NULL;
 
-	mutex_lock(&wilc->rxq_cs);
-	if (!list_empty(&wilc->rxq_head.list)) {
-		rqe = list_first_entry(&wilc->rxq_head.list, struct rxq_entry_t,
-				       list);
-		list_del(&rqe->list);
-	}
-	mutex_unlock(&wilc->rxq_cs);
-	return rqe;
+	return list_next_entry(tqe, list);
 }
 
 static int chip_allow_sleep_wilc1000(struct wilc *wilc, int source)
@@ -619,7 +1102,8 @@ static int chip_allow_sleep_wilc1000(struct wilc *wilc, int source)
 	u32 wakeup_reg, wakeup_bit;
 	u32 to_host_from_fw_reg, to_host_from_fw_bit;
 	u32 from_host_to_fw_reg, from_host_to_fw_bit;
-	u32 trials = 100;
+	struct wilc_reg_op ops[2];
+	struct wilc_poll poll;
 	int ret;
 
 	if (wilc->io_type == WILC_HIF_SDIO ||
@@ -639,67 +1123,39 @@ static int chip_allow_sleep_wilc1000(struct wilc *wilc, int source)
 		to_host_from_fw_bit = WILC_SPI_FW_TO_HOST_BIT;
 	}
 
-	while (--trials) {
+	wilc_poll_start(wilc, &poll, WILC_POLL_SLEEP);
+	do {
 		ret = hif_func->hif_read_reg(wilc, to_host_from_fw_reg, &reg);
 		if (ret)
 			return ret;
 		if ((reg & to_host_from_fw_bit) == 0)
 			break;
-	}
-	if (!trials)
+	} while (wilc_poll_wait(&poll, 100, WILC_POLL_MAX_US));
+	wilc_poll_end(&poll);
+	if (poll.timed_out)
 		pr_warn("FW not responding\n");
 
 	/* Clear bit 1 */
-	ret = hif_func->hif_read_reg(wilc, wakeup_reg, &reg);
-	if (ret)
-		return ret;
-	if (reg & wakeup_bit) {
-		reg &= ~wakeup_bit;
-		ret = hif_func->hif_write_reg(wilc, wakeup_reg, reg);
-		if (ret)
-			return ret;
-	}
+	ops[0] = WILC_REG_OP_CLEAR_DIFF(wakeup_reg, wakeup_bit);
+	ops[1] = WILC_REG_OP_CLEAR_DIFF(from_host_to_fw_reg,
+					from_host_to_fw_bit);
 
-	ret = hif_func->hif_read_reg(wilc, from_host_to_fw_reg, &reg);
-	if (ret)
-		return ret;
-	if (reg & from_host_to_fw_bit) {
-		reg &= ~from_host_to_fw_bit;
-		ret = hif_func->hif_write_reg(wilc, from_host_to_fw_reg, reg);
-		if (ret)
-			return ret;
-	}
-
-	return 0;
+	return wilc_wlan_reg_batch(wilc, ops, ARRAY_SIZE(ops));
 }
 
 static int chip_allow_sleep_wilc3000(struct wilc *wilc, int source)
 {
-	u32 reg = 0;
-	int ret;
-	const struct wilc_hif_func *hif_func = wilc->hif_func;
+	struct wilc_reg_op op;
 
 	if (wilc->io_type == WILC_HIF_SDIO ||
-	    wilc->io_type == WILC_HIF_SDIO_GPIO_IRQ) {
-		ret = hif_func->hif_read_reg(wilc, WILC3000_SDIO_WAKEUP_REG,
-					     &reg);
-		if (ret)
-			return ret;
-		ret = hif_func->hif_write_reg(wilc, WILC3000_SDIO_WAKEUP_REG,
-					      reg & ~WILC3000_SDIO_WAKEUP_BIT);
-		if (ret)
-			return ret;
-	} else {
-		ret = hif_func->hif_read_reg(wilc, WILC3000_SPI_WAKEUP_REG,
-					     &reg);
-		if (ret)
-			return ret;
-		ret = hif_func->hif_write_reg(wilc, WILC3000_SPI_WAKEUP_REG,
-					      reg & ~WILC3000_SPI_WAKEUP_BIT);
-		if (ret)
-			return ret;
-	}
-	return 0;
+	    wilc->io_type == WILC_HIF_SDIO_GPIO_IRQ)
+		op = WILC_REG_OP_CLEAR(WILC3000_SDIO_WAKEUP_REG,
+				       WILC3000_SDIO_WAKEUP_BIT);
+	else
+		op = WILC_REG_OP_CLEAR(WILC3000_SPI_WAKEUP_REG,
+				       WILC3000_SPI_WAKEUP_BIT);
+
+	return wilc_wlan_reg_batch(wilc, &op, 1);
 }
 
 void chip_allow_sleep(struct wilc *wilc, int source)
@@ -722,11 +1178,13 @@ void chip_allow_sleep(struct wilc *wilc, int source)
 static void chip_wakeup_wilc1000(struct wilc *wilc, int source)
 {
 	u32 ret = 0;
-	u32 clk_status_val = 0, trials = 0;
+	u32 clk_status_val = 0;
+	struct wilc_poll poll;
 	u32 wakeup_reg, wakeup_bit;
 	u32 clk_status_reg, clk_status_bit;
 	u32 from_host_to_fw_reg, from_host_to_fw_bit;
 	const struct wilc_hif_func *hif_func = wilc->hif_func;
+	struct wilc_reg_op ops[2];
 
 	if (wilc->io_type == WILC_HIF_SDIO ||
 	    wilc->io_type == WILC_HIF_SDIO_GPIO_IRQ) {
@@ -745,19 +1203,15 @@ static void chip_wakeup_wilc1000(struct wilc *wilc, int source)
 		from_host_to_fw_bit = WILC_SPI_HOST_TO_FW_BIT;
 	}
 
-	/* indicate host wakeup */
-	ret = hif_func->hif_write_reg(wilc, from_host_to_fw_reg,
-				      from_host_to_fw_bit);
-	if (ret)
-		return;
-
-	/* Set wake-up bit */
-	ret = hif_func->hif_write_reg(wilc, wakeup_reg,
-				      wakeup_bit);
+	/* indicate host wakeup, then set wake-up bit */
+	ops[0] = WILC_REG_OP_WRITE(from_host_to_fw_reg, from_host_to_fw_bit);
+	ops[1] = WILC_REG_OP_WRITE(wakeup_reg, wakeup_bit);
+	ret = wilc_wlan_reg_batch(wilc, ops, ARRAY_SIZE(ops));
 	if (ret)
 		return;
 
-	while (trials < WAKE_UP_TRIAL_RETRY) {
+	wilc_poll_start(wilc, &poll, WILC_POLL_WAKEUP);
+	do {
 		ret = hif_func->hif_read_reg(wilc, clk_status_reg,
 					     &clk_status_val);
 		if (ret) {
@@ -766,10 +1220,10 @@ static void chip_wakeup_wilc1000(struct wilc *wilc, int source)
 		}
 		if (clk_status_val & clk_status_bit)
 			break;
-
-		trials++;
-	}
-	if (trials >= WAKE_UP_TRIAL_RETRY) {
+	} while (wilc_poll_wait(&poll, WAKE_UP_TRIAL_RETRY,
+				WILC_POLL_WAKEUP_MAX_US));
+	wilc_poll_end(&poll);
+	if (poll.timed_out) {
 		pr_err("Failed to wake-up the chip\n");
 		return;
 	}
@@ -782,7 +1236,9 @@ static void chip_wakeup_wilc1000(struct wilc *wilc, int source)
 
 static void chip_wakeup_wilc3000(struct wilc *wilc, int source)
 {
-	u32 wakeup_reg_val, clk_status_reg_val, trials = 0;
+	u32 wakeup_reg_val, clk_status_reg_val = 0;
+	struct wilc_reg_op ops[2];
+	struct wilc_poll poll;
 	u32 wakeup_reg, wakeup_bit;
 	u32 clk_status_reg, clk_status_bit;
 	int wake_seq_trials = 5;
@@ -802,31 +1258,22 @@ static void chip_wakeup_wilc3000(struct wilc *wilc, int source)
 	}
 
 	hif_func->hif_read_reg(wilc, wakeup_reg, &wakeup_reg_val);
+	ops[0] = WILC_REG_OP_WRITE(wakeup_reg, wakeup_reg_val | wakeup_bit);
+	/* Check the clock status */
+	ops[1] = WILC_REG_OP_READ(clk_status_reg, &clk_status_reg_val);
 	do {
-		hif_func->hif_write_reg(wilc, wakeup_reg, wakeup_reg_val |
-							  wakeup_bit);
-		/* Check the clock status */
-		hif_func->hif_read_reg(wilc, clk_status_reg,
-				       &clk_status_reg_val);
+		wilc_wlan_reg_batch(wilc, ops, ARRAY_SIZE(ops));
 
 		/*
-		 * in case of clocks off, wait 1ms, and check it again.
-		 * if still off, wait for another 1ms, for a total wait of 3ms.
+		 * in case of clocks off, keep polling for up to 3ms.
 		 * If still off, redo the wake up sequence
 		 */
+		wilc_poll_start(wilc, &poll, WILC_POLL_WAKEUP);
 		while ((clk_status_reg_val & clk_status_bit) == 0 &&
-		       (++trials % 4) != 0) {
-			/* Wait for the chip to stabilize*/
-			usleep_range(1000, 1100);
-
-			/*
-			 * Make sure chip is awake. This is an extra step that
-			 * can be removed later to avoid the bus access
-			 * overhead
-			 */
+		       wilc_poll_wait(&poll, UINT_MAX, 3 * USEC_PER_MSEC))
 			hif_func->hif_read_reg(wilc, clk_status_reg,
 					       &clk_status_reg_val);
-		}
+		wilc_poll_end(&poll);
 		/* in case of failure, Reset the wakeup bit to introduce a new
 		 * edge on the next loop
 		 */
@@ -863,43 +1310,422 @@ void host_wakeup_notify(struct wilc *wilc, int source)
 	release_bus(wilc, WILC_BUS_RELEASE_ONLY, source);
 }
 
-void host_sleep_notify(struct wilc *wilc, int source)
+void host_sleep_notify(struct wilc *wilc, int source)
+{
+	acquire_bus(wilc, WILC_BUS_ACQUIRE_ONLY, source);
+	if (wilc->chip == WILC_1000)
+		wilc->hif_func->hif_write_reg(wilc, WILC1000_CORTUS_INTERRUPT_1,
+					      1);
+	else
+		wilc->hif_func->hif_write_reg(wilc, WILC3000_CORTUS_INTERRUPT_1,
+					      1);
+	release_bus(wilc, WILC_BUS_RELEASE_ONLY, source);
+}
+
+static inline void wilc_wlan_tx_vec_add(struct wilc_tx_batch *batch,
+					void *base, u32 len)
+{
+	batch->vec[batch->nvec].iov_base = base;
+	batch->vec[batch->nvec].iov_len = len;
+	batch->nvec++;
+}
+
+static void wilc_wlan_tx_batch_reset(struct wilc_tx_batch *batch, bool use_sg)
+{
+	batch->size = 0;
+	batch->nvec = 0;
+	batch->count = 0;
+	batch->hdr_offset = 0;
+	if (use_sg) {
+		/*
+		 * The payload goes out straight from the packet buffers; only
+		 * the VMM headers are built in the batch buffer, after a zeroed
+		 * word shared by all entries for their alignment padding.
+		 */
+		memset(batch->buffer, 0, 4);
+		batch->hdr_offset = 4;
+	}
+}
+
+/* VMM header bytes in front of a queued frame */
+static u32 wilc_wlan_tx_hdr_len(struct txq_entry_t *tqe)
+{
+	if (tqe->type == WILC_CFG_PKT)
+		return ETH_CONFIG_PKT_HDR_OFFSET;
+	if (tqe->type == WILC_NET_PKT)
+		return ETH_ETHERNET_HDR_OFFSET;
+
+	return HOST_HDR_OFFSET;
+}
+
+/*
+ * Without a gathered block write the payloads are copied into the batch
+ * buffer, which is only done by wilc_wlan_tx_batch_copy() once the
+ * firmware has taken the entries.
+ */
+static void wilc_wlan_tx_batch_add(struct wilc_tx_batch *batch,
+				   struct txq_entry_t *tqe, u32 vmm_sz,
+				   bool use_sg)
+{
+	u32 buffer_offset = wilc_wlan_tx_hdr_len(tqe);
+	u8 *txb = batch->buffer;
+	u8 mgmt_ptk = 0;
+	u32 header;
+	u8 *hdr;
+
+	if (tqe->type == WILC_MGMT_PKT)
+		mgmt_ptk = 1;
+
+	header = (FIELD_PREP(WILC_VMM_HDR_TYPE, tqe->type) |
+		  FIELD_PREP(WILC_VMM_HDR_MGMT_FIELD, mgmt_ptk) |
+		  FIELD_PREP(WILC_VMM_HDR_PKT_SIZE, tqe->buffer_size) |
+		  FIELD_PREP(WILC_VMM_HDR_BUFF_SIZE, vmm_sz));
+
+	hdr = use_sg ? &txb[batch->hdr_offset] : &txb[batch->size];
+	cpu_to_le32s(&header);
+	memcpy(hdr, &header, 4);
+	if (tqe->type == WILC_NET_PKT) {
+		int prio = tqe->q_num;
+
+		memcpy(&hdr[4], &prio, sizeof(prio));
+		memcpy(&hdr[8], tqe->vif->bssid, 6);
+	}
+
+	if (use_sg) {
+		u32 pad = vmm_sz - buffer_offset - tqe->buffer_size;
+
+		wilc_wlan_tx_vec_add(batch, hdr, buffer_offset);
+		wilc_wlan_tx_vec_add(batch, tqe->buffer, tqe->buffer_size);
+		if (pad)
+			wilc_wlan_tx_vec_add(batch, txb, pad);
+		batch->hdr_offset += buffer_offset;
+	}
+	batch->size += vmm_sz;
+
+	batch->tqe[batch->count] = tqe;
+	batch->end[batch->count] = batch->size;
+	batch->nvec_end[batch->count] = batch->nvec;
+	batch->count++;
+}
+
+static void wilc_wlan_tx_batch_copy(struct wilc_tx_batch *batch)
+{
+	u32 start = 0;
+	int i;
+
+	for (i = 0; i < batch->count; i++) {
+		struct txq_entry_t *tqe = batch->tqe[i];
+
+		memcpy(&batch->buffer[start + wilc_wlan_tx_hdr_len(tqe)],
+		       tqe->buffer, tqe->buffer_size);
+		start = batch->end[i];
+	}
+}
+
+static void wilc_wlan_tx_xfer_work(struct work_struct *work)
+{
+	struct wilc *wilc = container_of(work, struct wilc, tx_xfer_work);
+	struct wilc_tx_batch *batch = wilc->tx_xfer_batch;
+	const struct wilc_hif_func *func = wilc->hif_func;
+	u64 done;
+	int ret, i;
+
+	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
+
+	ret = func->hif_clear_int_ext(wilc, ENABLE_TX_VMM);
+	if (!ret) {
+		if (func->hif_block_tx_ext_sg)
+			ret = func->hif_block_tx_ext_sg(wilc, 0, batch->vec,
+							batch->nvec,
+							batch->size);
+		else
+			ret = func->hif_block_tx_ext(wilc, 0, batch->buffer,
+						     batch->size);
+	}
+
+	done = wilc_tx_lat_now();
+	if (!ret)
+		cfg_packet_timeout = 0;
+
+	release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
+
+	for (i = 0; i < batch->count; i++) {
+		struct txq_entry_t *tqe = batch->tqe[i];
+
+		if (done)
+			wilc_tx_lat_record(wilc, batch, tqe, done);
+		tqe->status = 1;
+		if (tqe->tx_complete_func)
+			tqe->tx_complete_func(tqe->priv, tqe->status);
+		wilc_wlan_txq_entry_put(wilc, tqe);
+	}
+	batch->count = 0;
+}
+
+int wilc_wlan_tx_work_init(struct wilc *wilc)
+{
+	wilc->tx_workqueue = alloc_ordered_workqueue("wilc_tx_wq",
+						     WQ_HIGHPRI |
+						     WQ_MEM_RECLAIM);
+	if (!wilc->tx_workqueue)
+		return -ENOMEM;
+
+	INIT_WORK(&wilc->tx_xfer_work, wilc_wlan_tx_xfer_work);
+	hrtimer_init(&wilc->tx_holdoff_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	wilc->tx_holdoff_timer.function = wilc_wlan_txq_holdoff_fn;
+	return 0;
+}
+
+void wilc_wlan_tx_work_deinit(struct wilc *wilc)
+{
+	if (!wilc->tx_workqueue)
+		return;
+
+	hrtimer_cancel(&wilc->tx_holdoff_timer);
+
+	destroy_workqueue(wilc->tx_workqueue);
+	wilc->tx_workqueue = NULL;
+}
+
+/* wait for the batch on the bus to be written and its entries completed */
+void wilc_wlan_tx_flush(struct wilc *wilc)
+{
+	flush_work(&wilc->tx_xfer_work);
+}
+
+/* VMM size of a queued frame, header included */
+static u32 wilc_wlan_vmm_size(struct txq_entry_t *tqe)
+{
+	return ALIGN(wilc_wlan_tx_hdr_len(tqe) + tqe->buffer_size, 4);
+}
+
+/*
+ * Queue heads the scheduler picks from while one VMM table is filled.
+ * staged[] counts the bytes picked per AC so far; they are only charged
+ * once the firmware has accepted the entries.
+ */
+struct wilc_tx_sched_ctx {
+	struct txq_entry_t *head[NQUEUES];
+	u32 size[NQUEUES];
+	u32 staged[NQUEUES];
+	u8 quota[NQUEUES];
+	u8 ac;
+	u8 picks;
+	bool exist;
+};
+
+struct wilc_tx_sched_ops {
+	const char *name;
+	int (*begin)(struct wilc *wilc, struct wilc_tx_sched_ctx *ctx);
+	/* AC of the next frame to add, -1 once every queue is empty */
+	int (*pick)(struct wilc *wilc, struct wilc_tx_sched_ctx *ctx);
+	/* an entry of @ac the firmware accepted */
+	void (*charge)(struct wilc *wilc, u8 ac, u32 vmm_sz);
+	/* the firmware took only the first @kept of the picked entries */
+	void (*rewind)(struct wilc *wilc, struct wilc_tx_sched_ctx *ctx,
+		       u8 kept);
+};
+
+/*
+ * Firmware ratio: top each AC up to the fullest firmware queue, then take
+ * one frame per AC and round.
+ */
+static int wilc_tx_sched_ratio_begin(struct wilc *wilc,
+				     struct wilc_tx_sched_ctx *ctx)
+{
+	return ac_balance(wilc, ctx->quota);
+}
+
+static int wilc_tx_sched_ratio_pick(struct wilc *wilc,
+				    struct wilc_tx_sched_ctx *ctx)
+{
+	u8 ac;
+
+	for (;;) {
+		for (; ctx->ac < NQUEUES; ctx->ac++) {
+			ac = ctx->ac;
+			if (!ctx->head[ac])
+				continue;
+
+			ctx->exist = true;
+			if (ctx->quota[ac]) {
+				ctx->quota[ac]--;
+				return ac;
+			}
+		}
+
+		if (!ctx->exist)
+			return -1;
+
+		ctx->exist = false;
+		ctx->ac = 0;
+		for (ac = 0; ac < NQUEUES; ac++)
+			ctx->quota[ac] = 1;
+	}
+}
+
+static unsigned int tx_sched_weight[NQUEUES] = {1, 1, 1, 1};
+module_param_array(tx_sched_weight, uint, NULL, 0644);
+MODULE_PARM_DESC(tx_sched_weight,
+		 "Deficit round robin weight per AC (VO,VI,BE,BK). Each\n"
+		 "\t\t\tround an AC may send weight times 1600 bytes,\n"
+		 "\t\t\tweights run from 1 to 64.");
+
+static bool tx_sched_strict_vo;
+module_param(tx_sched_strict_vo, bool, 0644);
+MODULE_PARM_DESC(tx_sched_strict_vo,
+		 "Serve VO ahead of the deficit round robin whenever it\n"
+		 "\t\t\thas frames queued.");
+
+/* above the largest frame, so every visit to a backlogged AC sends */
+#define WILC_TX_SCHED_QUANTUM		1600
+#define WILC_TX_SCHED_WEIGHT_MAX	64
+
+static s32 wilc_tx_sched_quantum(u8 ac)
+{
+	u32 weight = READ_ONCE(tx_sched_weight[ac]);
+
+	return clamp_t(u32, weight, 1, WILC_TX_SCHED_WEIGHT_MAX) *
+	       WILC_TX_SCHED_QUANTUM;
+}
+
+static int wilc_tx_sched_drr_pick(struct wilc *wilc,
+				  struct wilc_tx_sched_ctx *ctx)
+{
+	struct wilc_tx_sched_state *st = &wilc->tx_sched;
+	u8 ac;
+
+	if (ctx->picks < WILC_VMM_TBL_SIZE)
+		wilc->tx_sched_trail[ctx->picks++] = *st;
+
+	if (READ_ONCE(tx_sched_strict_vo) && ctx->head[AC_VO_Q])
+		return AC_VO_Q;
+
+	for (ac = 0; ac < NQUEUES; ac++)
+		if (ctx->head[ac])
+			break;
+	if (ac == NQUEUES)
+		return -1;
+
+	for (;;) {
+		ac = st->rr;
+		if (!ctx->head[ac]) {
+			st->deficit[ac] = 0;
+		} else {
+			if (!st->credited) {
+				st->deficit[ac] += wilc_tx_sched_quantum(ac);
+				st->credited = true;
+			}
+			if ((s32)(ctx->staged[ac] + ctx->size[ac]) <=
+			    st->deficit[ac])
+				return ac;
+		}
+
+		st->rr = (st->rr + 1) % NQUEUES;
+		st->credited = false;
+	}
+}
+
+static void wilc_tx_sched_drr_charge(struct wilc *wilc, u8 ac, u32 vmm_sz)
+{
+	/* strict VO frames bypass the round and are not charged */
+	if (ac == AC_VO_Q && READ_ONCE(tx_sched_strict_vo))
+		return;
+
+	wilc->tx_sched.deficit[ac] -= vmm_sz;
+}
+
+/*
+ * Go back to the state the pick of the first dropped entry started
+ * from, as if the pass had stopped after @kept entries. The quanta and
+ * round robin moves of the dropped picks are undone; the kept entries
+ * are charged afterwards.
+ */
+static void wilc_tx_sched_drr_rewind(struct wilc *wilc,
+				     struct wilc_tx_sched_ctx *ctx, u8 kept)
+{
+	if (kept < ctx->picks)
+		wilc->tx_sched = wilc->tx_sched_trail[kept];
+}
+
+enum {
+	WILC_TX_SCHED_RATIO,
+	WILC_TX_SCHED_DRR,
+	WILC_TX_SCHED_NUM
+};
+
+static const struct wilc_tx_sched_ops wilc_tx_scheds[WILC_TX_SCHED_NUM] = {
+	[WILC_TX_SCHED_RATIO] = {
+		.name = "ratio",
+		.begin = wilc_tx_sched_ratio_begin,
+		.pick = wilc_tx_sched_ratio_pick,
+	},
+	[WILC_TX_SCHED_DRR] = {
+		.name = "drr",
+		.pick = wilc_tx_sched_drr_pick,
+		.charge = wilc_tx_sched_drr_charge,
+		.rewind = wilc_tx_sched_drr_rewind,
+	},
+};
+
+static unsigned int tx_sched = WILC_TX_SCHED_RATIO;
+
+static int wilc_tx_sched_set(const char *val, const struct kernel_param *kp)
+{
+	int i;
+
+	for (i = 0; i < WILC_TX_SCHED_NUM; i++) {
+		if (sysfs_streq(val, wilc_tx_scheds[i].name)) {
+			WRITE_ONCE(tx_sched, i);
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int wilc_tx_sched_get(char *buf, const struct kernel_param *kp)
 {
-	acquire_bus(wilc, WILC_BUS_ACQUIRE_ONLY, source);
-	if (wilc->chip == WILC_1000)
-		wilc->hif_func->hif_write_reg(wilc, WILC1000_CORTUS_INTERRUPT_1,
-					      1);
-	else
-		wilc->hif_func->hif_write_reg(wilc, WILC3000_CORTUS_INTERRUPT_1,
-					      1);
-	release_bus(wilc, WILC_BUS_RELEASE_ONLY, source);
+	unsigned int i = READ_ONCE(tx_sched);
+
+	return sysfs_emit(buf, "%s\n", wilc_tx_scheds[i].name);
 }
 
+static const struct kernel_param_ops wilc_tx_sched_param_ops = {
+	.set = wilc_tx_sched_set,
+	.get = wilc_tx_sched_get,
+};
+
+module_param_cb(tx_sched, &wilc_tx_sched_param_ops, NULL, 0644);
+MODULE_PARM_DESC(tx_sched,
+		 "AC scheduler filling the VMM table: \"ratio\" (default)\n"
+		 "\t\t\tfollows the firmware queue counts, \"drr\" is a\n"
+		 "\t\t\tbyte based deficit round robin.");
+
 int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 {
 	int i, entries = 0;
-	u8 k, ac;
+	u8 ac;
 	u32 sum;
 	u32 reg;
-	u8 ac_desired_ratio[NQUEUES] = {0, 0, 0, 0};
-	u8 ac_preserve_ratio[NQUEUES] = {1, 1, 1, 1};
-	u8 *num_pkts_to_add;
 	u8 vmm_entries_ac[WILC_VMM_TBL_SIZE];
-	u32 offset = 0;
-	bool max_size_over = 0, ac_exist = 0;
-	int vmm_sz = 0;
-	struct txq_entry_t *tqe_q[NQUEUES];
+	u32 vmm_sz;
+	const struct wilc_tx_sched_ops *sched;
+	struct wilc_tx_sched_ctx ctx = {};
+	struct txq_entry_t *tqe;
 	int ret = 0;
-	int counter;
-	int timeout;
+	struct wilc_poll poll;
 	u32 *vmm_table = wilc->vmm_table;
 	u8 ac_pkt_num_to_chip[NQUEUES] = {0, 0, 0, 0};
 	const struct wilc_hif_func *func;
 	int srcu_idx;
-	u8 *txb = wilc->tx_buffer;
 	struct wilc_vif *vif;
+	struct wilc_tx_batch *batch;
+	unsigned long flags;
+	bool use_sg;
 
-	if (!wilc->txq_entries) {
+	if (!atomic_read(&wilc->txq_entries)) {
 		*txq_count = 0;
 		return 0;
 	}
@@ -907,75 +1733,86 @@ int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 	if (wilc->quit)
 		goto out_update_cnt;
 
-	if (ac_balance(wilc, ac_desired_ratio))
+	wilc_wlan_ac_share_update(wilc);
+
+	sched = &wilc_tx_scheds[READ_ONCE(tx_sched)];
+	if (sched->begin && sched->begin(wilc, &ctx))
 		return -EINVAL;
 
 	mutex_lock(&wilc->txq_add_to_head_cs);
 
+	for (ac = 0; ac < NQUEUES; ac++)
+		wilc_wlan_txq_drain(wilc, ac);
+
 	srcu_idx = srcu_read_lock(&wilc->srcu);
 	list_for_each_entry_rcu(vif, &wilc->vif_list, list)
 		wilc_wlan_txq_filter_dup_tcp_ack(vif->ndev);
 	srcu_read_unlock(&wilc->srcu, srcu_idx);
 
-	for (ac = 0; ac < NQUEUES; ac++)
-		tqe_q[ac] = wilc_wlan_txq_get_first(wilc, ac);
+	for (ac = 0; ac < NQUEUES; ac++) {
+		ctx.head[ac] = wilc_wlan_txq_get_first(wilc, ac);
+		if (ctx.head[ac])
+			ctx.size[ac] = wilc_wlan_vmm_size(ctx.head[ac]);
+	}
+
+	func = wilc->hif_func;
+	use_sg = !!func->hif_block_tx_ext_sg;
+
+	/* stage into the buffer that was not on the bus last time */
+	batch = &wilc->tx_batch[0];
+	if (batch == wilc->tx_xfer_batch)
+		batch = &wilc->tx_batch[1];
+	wilc_wlan_tx_batch_reset(batch, use_sg);
 
 	i = 0;
 	sum = 0;
-	max_size_over = 0;
-	num_pkts_to_add = ac_desired_ratio;
-	do {
-		ac_exist = 0;
-		for (ac = 0; (ac < NQUEUES) && (!max_size_over); ac++) {
-			if (!tqe_q[ac])
-				continue;
+	while (i < (WILC_VMM_TBL_SIZE - 1)) {
+		int next = sched->pick(wilc, &ctx);
 
-			ac_exist = 1;
-			for (k = 0; (k < num_pkts_to_add[ac]) &&
-			     (!max_size_over) && tqe_q[ac]; k++) {
-				if (i >= (WILC_VMM_TBL_SIZE - 1)) {
-					max_size_over = 1;
-					break;
-				}
+		if (next < 0)
+			break;
 
-				if (tqe_q[ac]->type == WILC_CFG_PKT)
-					vmm_sz = ETH_CONFIG_PKT_HDR_OFFSET;
-				else if (tqe_q[ac]->type == WILC_NET_PKT)
-					vmm_sz = ETH_ETHERNET_HDR_OFFSET;
-				else
-					vmm_sz = HOST_HDR_OFFSET;
+		ac = next;
+		tqe = ctx.head[ac];
+		vmm_sz = ctx.size[ac];
+		if ((sum + vmm_sz) > WILC_TX_BUFF_SIZE)
+			break;
 
-				vmm_sz += tqe_q[ac]->buffer_size;
-				vmm_sz = ALIGN(vmm_sz, 4);
+		vmm_table[i] = vmm_sz / 4;
+		if (tqe->type == WILC_CFG_PKT)
+			vmm_table[i] |= BIT(10);
 
-				if ((sum + vmm_sz) > WILC_TX_BUFF_SIZE) {
-					max_size_over = 1;
-					break;
-				}
-				vmm_table[i] = vmm_sz / 4;
-				if (tqe_q[ac]->type == WILC_CFG_PKT)
-					vmm_table[i] |= BIT(10);
-
-				cpu_to_le32s(&vmm_table[i]);
-				vmm_entries_ac[i] = ac;
-
-				i++;
-				sum += vmm_sz;
-				tqe_q[ac] = wilc_wlan_txq_get_next(wilc,
-								   tqe_q[ac],
-								   ac);
-			}
-		}
-		num_pkts_to_add = ac_preserve_ratio;
-	} while (!max_size_over && ac_exist);
+		cpu_to_le32s(&vmm_table[i]);
+		vmm_entries_ac[i] = ac;
+		wilc_wlan_tx_batch_add(batch, tqe, vmm_sz, use_sg);
+		ctx.staged[ac] += vmm_sz;
+
+		i++;
+		sum += vmm_sz;
+		ctx.head[ac] = wilc_wlan_txq_get_next(wilc, tqe, ac);
+		if (ctx.head[ac])
+			ctx.size[ac] = wilc_wlan_vmm_size(ctx.head[ac]);
+	}
+
+	/*
+	 * The queue lists and the staged entries belong to this thread, so
+	 * head-insert producers can go on while the batch is negotiated.
+	 */
+	mutex_unlock(&wilc->txq_add_to_head_cs);
 
 	if (i == 0)
-		goto out_unlock;
+		goto out_schedule;
 	vmm_table[i] = 0x0;
+	batch->ts_sel = wilc_tx_lat_now();
+
+	/*
+	 * This batch was staged while the previous one was on the bus; the
+	 * firmware only needs that one written before the next VMM request.
+	 */
+	flush_work(&wilc->tx_xfer_work);
 
 	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
-	counter = 0;
-	func = wilc->hif_func;
+	wilc_poll_start(wilc, &poll, WILC_POLL_TX_CTRL);
 	do {
 		ret = func->hif_read_reg(wilc, WILC_HOST_TX_CTRL, &reg);
 		if (ret)
@@ -985,19 +1822,15 @@ int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 			ac_update_fw_ac_pkt_info(wilc, reg);
 			break;
 		}
+	} while (!wilc->quit && wilc_poll_wait(&poll, 200, WILC_POLL_MAX_US));
+	wilc_poll_end(&poll);
 
-		counter++;
-		if (counter > 200) {
-			counter = 0;
-			ret = func->hif_write_reg(wilc, WILC_HOST_TX_CTRL, 0);
-			break;
-		}
-	} while (!wilc->quit);
+	if (!ret && poll.timed_out)
+		ret = func->hif_write_reg(wilc, WILC_HOST_TX_CTRL, 0);
 
 	if (ret)
 		goto out_release_bus;
 
-	timeout = 200;
 	do {
 		ret = func->hif_block_tx(wilc,
 					 WILC_VMM_TBL_RX_SHADOW_BASE,
@@ -1013,6 +1846,7 @@ int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 			if (ret)
 				break;
 
+			wilc_poll_start(wilc, &poll, WILC_POLL_VMM_CTL);
 			do {
 				ret = func->hif_read_reg(wilc,
 						      WILC_HOST_VMM_CTL,
@@ -1025,21 +1859,19 @@ int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 							    reg);
 					break;
 				}
-			} while (--timeout);
+			} while (wilc_poll_wait(&poll, 200, WILC_POLL_MAX_US));
 		} else {
-			ret = func->hif_write_reg(wilc,
-					      WILC_HOST_VMM_CTL,
-					      0);
-			if (ret)
-				break;
+			/* clear the VMM request, then interrupt firmware */
+			struct wilc_reg_op ops[] = {
+				WILC_REG_OP_WRITE(WILC_HOST_VMM_CTL, 0),
+				WILC_REG_OP_WRITE(WILC_INTERRUPT_CORTUS_0, 1),
+			};
 
-			/* interrupt firmware */
-			ret = func->hif_write_reg(wilc,
-					      WILC_INTERRUPT_CORTUS_0,
-					      1);
+			ret = wilc_wlan_reg_batch(wilc, ops, ARRAY_SIZE(ops));
 			if (ret)
 				break;
 
+			wilc_poll_start(wilc, &poll, WILC_POLL_CORTUS_0);
 			do {
 				ret = func->hif_read_reg(wilc,
 						      WILC_INTERRUPT_CORTUS_0,
@@ -1060,9 +1892,10 @@ int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 							    reg);
 					break;
 				}
-			} while (--timeout);
+			} while (wilc_poll_wait(&poll, 200, WILC_POLL_MAX_US));
 		}
-		if (timeout <= 0) {
+		wilc_poll_end(&poll);
+		if (poll.timed_out) {
 			ret = func->hif_write_reg(wilc, WILC_HOST_VMM_CTL, 0x0);
 			break;
 		}
@@ -1071,12 +1904,10 @@ int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 			break;
 
 		if (entries == 0) {
-			ret = func->hif_read_reg(wilc, WILC_HOST_TX_CTRL, &reg);
-			if (ret)
-				break;
+			struct wilc_reg_op op =
+				WILC_REG_OP_CLEAR(WILC_HOST_TX_CTRL, BIT(0));
 
-			reg &= ~BIT(0);
-			ret = func->hif_write_reg(wilc, WILC_HOST_TX_CTRL, reg);
+			ret = wilc_wlan_reg_batch(wilc, &op, 1);
 		}
 	} while (0);
 
@@ -1093,90 +1924,255 @@ int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 	}
 
 	release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
-	schedule();
-	offset = 0;
-	i = 0;
-	do {
-		struct txq_entry_t *tqe;
-		u32 header, buffer_offset;
-		char *bssid;
-		u8 mgmt_ptk = 0;
-
-		if (vmm_table[i] == 0 || vmm_entries_ac[i] >= NQUEUES)
-			break;
-
-		tqe = wilc_wlan_txq_remove_from_head(wilc, vmm_entries_ac[i]);
-		if (!tqe)
-			break;
 
+	/* cut the staged batch down to what the firmware accepted */
+	if (entries < batch->count && sched->rewind)
+		sched->rewind(wilc, &ctx, entries);
+	entries = min(entries, batch->count);
+	batch->count = entries;
+	wilc->tx_batch_stats.batches++;
+	atomic_long_inc(&wilc->tx_batch_stats.hist[wilc_hist_bucket(entries,
+					WILC_TX_BATCH_HIST_BUCKETS)]);
+	batch->size = batch->end[entries - 1];
+	batch->nvec = batch->nvec_end[entries - 1];
+	if (!use_sg)
+		wilc_wlan_tx_batch_copy(batch);
+
+	/* the queues are ours, only the ACK filter state needs its lock */
+	for (i = 0; i < entries; i++) {
+		tqe = batch->tqe[i];
+		wilc_wlan_txq_remove(wilc, vmm_entries_ac[i], tqe);
 		ac_pkt_num_to_chip[vmm_entries_ac[i]]++;
-		vif = tqe->vif;
-
-		le32_to_cpus(&vmm_table[i]);
-		vmm_sz = FIELD_GET(WILC_VMM_BUFFER_SIZE, vmm_table[i]);
-		vmm_sz *= 4;
-
-		if (tqe->type == WILC_MGMT_PKT)
-			mgmt_ptk = 1;
-
-		header = (FIELD_PREP(WILC_VMM_HDR_TYPE, tqe->type) |
-			  FIELD_PREP(WILC_VMM_HDR_MGMT_FIELD, mgmt_ptk) |
-			  FIELD_PREP(WILC_VMM_HDR_PKT_SIZE, tqe->buffer_size) |
-			  FIELD_PREP(WILC_VMM_HDR_BUFF_SIZE, vmm_sz));
-
-		cpu_to_le32s(&header);
-		memcpy(&txb[offset], &header, 4);
-		if (tqe->type == WILC_CFG_PKT) {
-			buffer_offset = ETH_CONFIG_PKT_HDR_OFFSET;
-		} else if (tqe->type == WILC_NET_PKT) {
-			int prio = tqe->q_num;
-
-			bssid = tqe->vif->bssid;
-			buffer_offset = ETH_ETHERNET_HDR_OFFSET;
-			memcpy(&txb[offset + 4], &prio, sizeof(prio));
-			memcpy(&txb[offset + 8], bssid, 6);
-		} else {
-			buffer_offset = HOST_HDR_OFFSET;
+		if (sched->charge)
+			sched->charge(wilc, vmm_entries_ac[i],
+				      wilc_wlan_vmm_size(tqe));
+		if (tqe->ack_idx != NOT_TCP_ACK &&
+		    tqe->ack_idx < MAX_PENDING_ACKS) {
+			struct tcp_ack_filter *f = &tqe->vif->ack_filter;
+
+			/* a slot from an earlier round may hold a newer ACK */
+			spin_lock_irqsave(&f->lock, flags);
+			if (f->pending_acks[tqe->ack_idx].txqe == tqe)
+				f->pending_acks[tqe->ack_idx].txqe = NULL;
+			spin_unlock_irqrestore(&f->lock, flags);
 		}
+	}
 
-		memcpy(&txb[offset + buffer_offset],
-		       tqe->buffer, tqe->buffer_size);
-		offset += vmm_sz;
-		i++;
-		tqe->status = 1;
-		if (tqe->tx_complete_func)
-			tqe->tx_complete_func(tqe->priv, tqe->status);
-		if (tqe->ack_idx != NOT_TCP_ACK &&
-		    tqe->ack_idx < MAX_PENDING_ACKS)
-			vif->ack_filter.pending_acks[tqe->ack_idx].txqe = NULL;
-		kfree(tqe);
-	} while (--entries);
 	for (i = 0; i < NQUEUES; i++)
 		wilc->txq[i].fw.count += ac_pkt_num_to_chip[i];
 
-	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
-
-	ret = func->hif_clear_int_ext(wilc, ENABLE_TX_VMM);
-	if (ret)
-		goto out_release_bus;
-
-	ret = func->hif_block_tx_ext(wilc, 0, txb, offset);
-
-	if (!ret)
-		cfg_packet_timeout = 0;
+	/* entries are completed by the tx work once they are on the chip */
+	batch->ts_vmm = wilc_tx_lat_now();
+	wilc->tx_xfer_batch = batch;
+	queue_work(wilc->tx_workqueue, &wilc->tx_xfer_work);
+	goto out_schedule;
 
 out_release_bus:
 	release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
+	/* nothing was sent, the next pass picks again */
+	if (sched->rewind)
+		sched->rewind(wilc, &ctx, 0);
 
-out_unlock:
-	mutex_unlock(&wilc->txq_add_to_head_cs);
+out_schedule:
 	schedule();
 
 out_update_cnt:
-	*txq_count = wilc->txq_entries;
+	*txq_count = atomic_read(&wilc->txq_entries);
 	return ret;
 }
 
+static unsigned int rx_copybreak = 256;
+module_param(rx_copybreak, uint, 0644);
+MODULE_PARM_DESC(rx_copybreak,
+		 "RX data frames up to this many bytes are copied into a\n"
+		 "\t\t\tnew skb, larger ones are passed up as fragments\n"
+		 "\t\t\tof the page they were read into.");
+
+#ifdef WILC_RX_PAGE_POOL
+static struct page *wilc_wlan_rx_page_get(struct wilc *wilc, u32 size)
+{
+	struct page *page = NULL;
+
+	if (wilc->rx_page_pool && size <= WILC_RX_PAGE_SIZE)
+		page = page_pool_alloc_pages(wilc->rx_page_pool,
+					     GFP_KERNEL | __GFP_NOWARN);
+	if (!page) {
+		atomic_long_inc(&wilc->rx_page_stats.fallbacks);
+		return NULL;
+	}
+
+	/* every frag handed up takes one, the rest go back after parsing */
+	page_pool_fragment_page(page, WILC_RX_PAGE_BIAS);
+	return page;
+}
+
+static void wilc_wlan_rx_page_put(struct wilc *wilc, struct page *page,
+				  long refs)
+{
+	if (!page_pool_unref_page(page, refs))
+		page_pool_put_unrefed_page(wilc->rx_page_pool, page, -1,
+					   false);
+}
+#else
+static struct page *wilc_wlan_rx_page_get(struct wilc *wilc, u32 size)
+{
+	atomic_long_inc(&wilc->rx_page_stats.fallbacks);
+	return NULL;
+}
+
+static void wilc_wlan_rx_page_put(struct wilc *wilc, struct page *page,
+				  long refs)
+{
+}
+#endif
+
+/* descriptor the producer fills next, NULL while the ring is full */
+static struct rxq_entry_t *wilc_wlan_rx_ring_next(struct wilc *wilc)
+{
+	struct wilc_rx_ring *ring = &wilc->rx_ring;
+
+	if (ring->head - smp_load_acquire(&ring->tail) >= WILC_RX_RING_SIZE)
+		return NULL;
+
+	return &ring->desc[ring->head % WILC_RX_RING_SIZE];
+}
+
+/* size bytes of rx_buffer, NULL while unconsumed transfers are in the way */
+static u8 *wilc_wlan_rx_ring_buf_get(struct wilc *wilc, u32 size)
+{
+	struct wilc_rx_ring *ring = &wilc->rx_ring;
+	u32 head = ring->buf_head;
+	u32 tail = smp_load_acquire(&ring->buf_tail);
+	bool empty = smp_load_acquire(&ring->tail) == ring->head;
+
+	if (size > WILC_RX_BUFF_SIZE)
+		return NULL;
+
+	if (head >= tail || empty) {
+		if (size <= WILC_RX_BUFF_SIZE - head)
+			return &wilc->rx_buffer[head];
+		/* wrap, [head, end) stays unused until the consumer passes */
+		if (size < tail || empty)
+			return wilc->rx_buffer;
+	} else if (head + size < tail) {
+		return &wilc->rx_buffer[head];
+	}
+
+	return NULL;
+}
+
+static void wilc_wlan_rx_ring_publish(struct wilc *wilc,
+				      struct rxq_entry_t *rqe)
+{
+	struct wilc_rx_ring *ring = &wilc->rx_ring;
+
+	if (!rqe->page)
+		ring->buf_head = rqe->buffer - wilc->rx_buffer +
+				 rqe->buffer_size;
+	smp_store_release(&ring->head, ring->head + 1);
+}
+
+/* oldest published descriptor, NULL once the consumer caught up */
+static struct rxq_entry_t *wilc_wlan_rx_ring_peek(struct wilc *wilc)
+{
+	struct wilc_rx_ring *ring = &wilc->rx_ring;
+
+	if (ring->tail == smp_load_acquire(&ring->head))
+		return NULL;
+
+	return &ring->desc[ring->tail % WILC_RX_RING_SIZE];
+}
+
+static void wilc_wlan_rx_ring_release(struct wilc *wilc,
+				      struct rxq_entry_t *rqe)
+{
+	struct wilc_rx_ring *ring = &wilc->rx_ring;
+
+	if (rqe->page)
+		wilc_wlan_rx_page_put(wilc, rqe->page, rqe->page_refs);
+	else
+		smp_store_release(&ring->buf_tail, rqe->buffer -
+				  wilc->rx_buffer + rqe->buffer_size);
+	smp_store_release(&ring->tail, ring->tail + 1);
+}
+
+/*
+ * skb for a data frame at buff. in_rx_buff is set when buff lies in the
+ * RX transfer being parsed; then, unless the frame is under rx_copybreak,
+ * its payload stays in the page-pool page and only the Ethernet header is
+ * copied, as eth_type_trans() wants it linear.
+ */
+struct sk_buff *wilc_wlan_rx_skb(struct wilc *wilc, u8 *buff, u32 len,
+				 bool in_rx_buff)
+{
+	struct rxq_entry_t *rqe = in_rx_buff ? wilc->rx_cur : NULL;
+	struct sk_buff *skb;
+
+	if (!rqe || !rqe->page ||
+	    len <= max_t(u32, READ_ONCE(rx_copybreak), ETH_HLEN)) {
+		skb = dev_alloc_skb(len);
+		if (!skb)
+			return NULL;
+
+		skb_put_data(skb, buff, len);
+		atomic_long_inc(&wilc->rx_page_stats.copies);
+		return skb;
+	}
+
+	skb = dev_alloc_skb(ETH_HLEN);
+	if (!skb)
+		return NULL;
+
+	/* the page memory the frame holds on to is its whole slot */
+	skb_put_data(skb, buff, ETH_HLEN);
+	skb_add_rx_frag(skb, 0, rqe->page,
+			buff + ETH_HLEN - (u8 *)page_address(rqe->page),
+			len - ETH_HLEN, max(rqe->frag_size, len - ETH_HLEN));
+	skb_mark_for_recycle(skb);
+	rqe->page_refs--;
+	atomic_long_inc(&wilc->rx_page_stats.frags);
+
+	return skb;
+}
+
+#ifdef WILC_RX_PAGE_POOL
+static int wilc_wlan_rx_page_pool_init(struct wilc *wilc)
+{
+	struct page_pool_params pp = {
+		.order = WILC_RX_PAGE_ORDER,
+		.pool_size = WILC_RX_PAGE_POOL_SIZE,
+		.nid = NUMA_NO_NODE,
+		.dev = wilc->dev,
+	};
+	struct page_pool *pool;
+
+	if (wilc->rx_page_pool)
+		return 0;
+
+	pool = page_pool_create(&pp);
+	if (IS_ERR(pool))
+		return PTR_ERR(pool);
+
+	wilc->rx_page_pool = pool;
+	return 0;
+}
+
+static void wilc_wlan_rx_page_pool_deinit(struct wilc *wilc)
+{
+	page_pool_destroy(wilc->rx_page_pool);
+	wilc->rx_page_pool = NULL;
+}
+#else
+static int wilc_wlan_rx_page_pool_init(struct wilc *wilc)
+{
+	return 0;
+}
+
+static void wilc_wlan_rx_page_pool_deinit(struct wilc *wilc)
+{
+}
+#endif
+
 static void wilc_wlan_handle_rx_buff(struct wilc *wilc, u8 *buffer, int size)
 {
 	int offset = 0;
@@ -1195,10 +2191,11 @@ static void wilc_wlan_handle_rx_buff(struct wilc *wilc, u8 *buffer, int size)
 		pkt_len = FIELD_GET(WILC_PKT_HDR_LEN_FIELD, header);
 
 		if (pkt_len == 0 || tp_len == 0) {
-			pr_err("%s: Data corrupted %d, %d\n", __func__,
-			       pkt_len, tp_len);
+			atomic_long_inc(&wilc->rx_drop_stats.corrupt);
 			break;
 		}
+		if (wilc->rx_cur)
+			wilc->rx_cur->frag_size = tp_len;
 
 		if (is_cfg_packet) {
 			struct wilc_cfg_rsp rsp;
@@ -1229,15 +2226,13 @@ static void wilc_wlan_handle_rx_buff(struct wilc *wilc, u8 *buffer, int size)
 
 			srcu_idx = srcu_read_lock(&wilc->srcu);
 			wilc_netdev = get_if_handler(wilc, buff_ptr);
-			if (!wilc_netdev) {
-				pr_err("%s: wilc_netdev in wilc is NULL\n",
-				       __func__);
-				srcu_read_unlock(&wilc->srcu, srcu_idx);
-				return;
+			if (wilc_netdev) {
+				vif = netdev_priv(wilc_netdev);
+				wilc_frmw_to_host(vif, buff_ptr, pkt_len,
+						  pkt_offset, PKT_STATUS_NEW);
+			} else {
+				atomic_long_inc(&wilc->rx_drop_stats.no_vif);
 			}
-			vif = netdev_priv(wilc_netdev);
-			wilc_frmw_to_host(vif, buff_ptr, pkt_len,
-					  pkt_offset, PKT_STATUS_NEW);
 			srcu_read_unlock(&wilc->srcu, srcu_idx);
 		}
 		offset += tp_len;
@@ -1251,16 +2246,19 @@ static void wilc_wlan_handle_rxq(struct wilc *wilc)
 	struct rxq_entry_t *rqe;
 
 	while (!wilc->quit) {
-		rqe = wilc_wlan_rxq_remove(wilc);
+		rqe = wilc_wlan_rx_ring_peek(wilc);
 		if (!rqe)
 			break;
 
 		buffer = rqe->buffer;
 		size = rqe->buffer_size;
+		wilc->rx_cur = rqe;
 		wilc_wlan_handle_rx_buff(wilc, buffer, size);
+		wilc->rx_cur = NULL;
 
-		kfree(rqe);
+		wilc_wlan_rx_ring_release(wilc, rqe);
 	}
+	wilc_netdev_rx_kick(wilc);
 	if (wilc->quit) {
 		pr_info("%s Quitting. Exit handle RX queue\n",
 			__func__);
@@ -1268,19 +2266,70 @@ static void wilc_wlan_handle_rxq(struct wilc *wilc)
 	}
 }
 
+/* processing stage, parses and delivers what the bus stage put in the ring */
+static void wilc_wlan_rx_work(struct work_struct *work)
+{
+	struct wilc *wilc = container_of(work, struct wilc, rx_work);
+
+	wilc_wlan_handle_rxq(wilc);
+}
+
+int wilc_wlan_rx_work_init(struct wilc *wilc)
+{
+	wilc->rx_workqueue = alloc_ordered_workqueue("wilc_rx_wq",
+						     WQ_HIGHPRI |
+						     WQ_MEM_RECLAIM);
+	if (!wilc->rx_workqueue)
+		return -ENOMEM;
+
+	INIT_WORK(&wilc->rx_work, wilc_wlan_rx_work);
+	return 0;
+}
+
+void wilc_wlan_rx_work_deinit(struct wilc *wilc)
+{
+	if (!wilc->rx_workqueue)
+		return;
+
+	destroy_workqueue(wilc->rx_workqueue);
+	wilc->rx_workqueue = NULL;
+}
+
 static void wilc_unknown_isr_ext(struct wilc *wilc)
 {
 	wilc->hif_func->hif_clear_int_ext(wilc, 0);
 }
 
-static void wilc_wlan_handle_isr_ext(struct wilc *wilc, u32 int_status)
+/*
+ * Read a block there is no room for and drop it. Left in the chip it
+ * would keep the interrupt pending with every later block behind it.
+ * Without even a bounce buffer the interrupt is only cleared.
+ */
+static void wilc_wlan_rx_discard(struct wilc *wilc, u32 size)
+{
+	u8 *buffer = kmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+
+	wilc->rx_ring.overruns++;
+	wilc->hif_func->hif_clear_int_ext(wilc, DATA_INT_CLR | ENABLE_RX_VMM);
+	if (buffer)
+		wilc->hif_func->hif_block_rx_ext(wilc, 0, buffer, size);
+	kfree(buffer);
+}
+
+/*
+ * Called with the bus held, which it drops while it waits for room.
+ * Returns 0 once the block is in the ring, -ENOBUFS when it had to be
+ * dropped and another error when it was not read.
+ */
+static int wilc_wlan_handle_isr_ext(struct wilc *wilc, u32 int_status)
 {
-	u32 offset = wilc->rx_buffer_offset;
 	u8 *buffer = NULL;
 	u32 size;
 	u32 retries = 0;
 	int ret = 0;
 	struct rxq_entry_t *rqe;
+	struct page *page = NULL;
+	bool waited = false;
 
 	size = FIELD_GET(WILC_INTERRUPT_DATA_SIZE, int_status) << 2;
 
@@ -1293,52 +2342,187 @@ static void wilc_wlan_handle_isr_ext(struct wilc *wilc, u32 int_status)
 	}
 
 	if (size <= 0)
-		return;
+		return -EIO;
 
-	if (WILC_RX_BUFF_SIZE - offset < size)
-		offset = 0;
+	/*
+	 * Without room the ring waits once for the processing stage. Still
+	 * without room the transfer is read out and dropped.
+	 */
+	for (;;) {
+		rqe = wilc_wlan_rx_ring_next(wilc);
+		if (rqe) {
+			page = wilc_wlan_rx_page_get(wilc, size);
+			if (page)
+				buffer = page_address(page);
+			else
+				buffer = wilc_wlan_rx_ring_buf_get(wilc, size);
+			if (buffer)
+				break;
+		}
+		if (waited)
+			goto overrun;
 
-	buffer = &wilc->rx_buffer[offset];
+		/*
+		 * RX processing may need the bus, so it is not waited for
+		 * under hif_cs. The block stays pending in the chip until it
+		 * is read below.
+		 */
+		release_bus(wilc, WILC_BUS_RELEASE_ONLY, DEV_WIFI);
+		flush_work(&wilc->rx_work);
+		acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
+		waited = true;
+		if (wilc->quit)
+			return -ESHUTDOWN;
+	}
 
 	wilc->hif_func->hif_clear_int_ext(wilc, DATA_INT_CLR | ENABLE_RX_VMM);
 	ret = wilc->hif_func->hif_block_rx_ext(wilc, 0, buffer, size);
 	if (ret) {
 		pr_err("%s: fail block rx\n", __func__);
-		return;
+		goto put_page;
 	}
 
-	offset += size;
-	wilc->rx_buffer_offset = offset;
-	rqe = kmalloc(sizeof(*rqe), GFP_KERNEL);
-	if (!rqe)
-		return;
+	if (wilc->quit) {
+		ret = -ESHUTDOWN;
+		goto put_page;
+	}
 
 	rqe->buffer = buffer;
 	rqe->buffer_size = size;
-	wilc_wlan_rxq_add(wilc, rqe);
-	wilc_wlan_handle_rxq(wilc);
+	rqe->page = page;
+	rqe->page_refs = WILC_RX_PAGE_BIAS;
+	wilc_wlan_rx_ring_publish(wilc, rqe);
+	queue_work(wilc->rx_workqueue, &wilc->rx_work);
+	return 0;
+
+overrun:
+	wilc_wlan_rx_discard(wilc, size);
+	return -ENOBUFS;
+
+put_page:
+	if (page)
+		wilc_wlan_rx_page_put(wilc, page, WILC_RX_PAGE_BIAS);
+	return ret;
+}
+
+static unsigned int rx_poll_irq_rate = 2000;
+module_param(rx_poll_irq_rate, uint, 0644);
+MODULE_PARM_DESC(rx_poll_irq_rate,
+		 "Interrupts per second above which the RX interrupt\n"
+		 "\t\t\thandler keeps polling for more RX blocks before it\n"
+		 "\t\t\treturns. 0 disables adaptive polling.");
+
+static unsigned int rx_poll_backlog = 8192;
+module_param(rx_poll_backlog, uint, 0644);
+MODULE_PARM_DESC(rx_poll_backlog,
+		 "RX block size in bytes that switches to polling\n"
+		 "\t\t\twhatever the interrupt rate.");
+
+static unsigned int rx_poll_budget = 16;
+module_param(rx_poll_budget, uint, 0644);
+MODULE_PARM_DESC(rx_poll_budget,
+		 "Most RX blocks polled per interrupt.");
+
+/* interrupt and poll rates are sampled over this window */
+#define WILC_RX_POLL_WINDOW		(HZ / 10)
+
+static void wilc_rx_poll_rate_update(struct wilc *wilc)
+{
+	struct wilc_rx_poll_stats *st = &wilc->rx_poll_stats;
+	unsigned long elapsed = jiffies - wilc->rx_poll_window;
+	u64 irqs, polled;
+
+	if (elapsed < WILC_RX_POLL_WINDOW)
+		return;
+
+	irqs = st->irqs - wilc->rx_poll_window_irqs;
+	polled = st->polled - wilc->rx_poll_window_polled;
+	WRITE_ONCE(st->irq_rate, div_u64(irqs * HZ, elapsed));
+	WRITE_ONCE(st->saved_rate, div_u64(polled * HZ, elapsed));
+
+	wilc->rx_poll_window = jiffies;
+	wilc->rx_poll_window_irqs = st->irqs;
+	wilc->rx_poll_window_polled = st->polled;
+}
+
+static bool wilc_rx_poll_wanted(struct wilc *wilc, u32 int_status)
+{
+	unsigned int rate = READ_ONCE(rx_poll_irq_rate);
+	u32 size = FIELD_GET(WILC_INTERRUPT_DATA_SIZE, int_status) << 2;
+
+	if (!rate || !(int_status & DATA_INT_EXT))
+		return false;
+
+	return wilc->rx_poll_stats.irq_rate >= rate ||
+	       size >= READ_ONCE(rx_poll_backlog);
+}
+
+/*
+ * Under load, drain every RX block the chip has pending before letting the
+ * interrupt back in, reading the interrupt status in place of waiting for
+ * one interrupt per block. A block that was dropped or not read ends the
+ * burst: the processing stage is behind, and polling on would only drop
+ * more.
+ */
+static void wilc_rx_poll(struct wilc *wilc)
+{
+	struct wilc_rx_poll_stats *st = &wilc->rx_poll_stats;
+	unsigned int budget = READ_ONCE(rx_poll_budget);
+	u32 int_status;
+
+	st->bursts++;
+	while (budget-- && !wilc->close) {
+		if (wilc->hif_func->hif_read_int(wilc, &int_status))
+			break;
+		if (!(int_status & DATA_INT_EXT))
+			break;
+
+		if (wilc_wlan_handle_isr_ext(wilc, int_status))
+			break;
+		st->polled++;
+		wilc->rx_poll_active = true;
+	}
 }
 
 void wilc_handle_isr(struct wilc *wilc)
 {
 	u32 int_status;
+	bool polled, rx_done = false;
 
 	if (wilc->close)
 		return;
 
+	wilc->rx_poll_stats.irqs++;
+	wilc_rx_poll_rate_update(wilc);
+	polled = wilc->rx_poll_active;
+	wilc->rx_poll_active = false;
+
 	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
 	wilc->hif_func->hif_read_int(wilc, &int_status);
 
 	if (int_status & DATA_INT_EXT)
-		wilc_wlan_handle_isr_ext(wilc, int_status);
+		rx_done = !wilc_wlan_handle_isr_ext(wilc, int_status);
 
 	if (!(int_status & (ALL_INT_EXT))) {
-		pr_warn("%s,>> UNKNOWN_INTERRUPT - 0x%08x\n", __func__,
-			int_status);
-		wilc_unknown_isr_ext(wilc);
+		/* the edge of a block a poll already drained */
+		if (polled && !int_status) {
+			wilc->rx_poll_stats.replays++;
+		} else {
+			pr_warn("%s,>> UNKNOWN_INTERRUPT - 0x%08x\n",
+				__func__, int_status);
+			wilc_unknown_isr_ext(wilc);
+		}
 	}
 
+	if (rx_done && wilc_rx_poll_wanted(wilc, int_status))
+		wilc_rx_poll(wilc);
+
 	release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
+
+	/* the firmware may have freed VMM entries, retry a stalled TX */
+	atomic_inc(&wilc->fw_event_seq);
+	if (wq_has_sleeper(&wilc->fw_event_wq))
+		wake_up_interruptible(&wilc->fw_event_wq);
 }
 
 int wilc_wlan_firmware_download(struct wilc *wilc, const u8 *buffer,
@@ -1408,6 +2592,7 @@ fail:
 
 int wilc_wlan_start(struct wilc *wilc)
 {
+	struct wilc_reg_op ops[3];
 	u32 reg = 0;
 	int ret;
 
@@ -1417,12 +2602,7 @@ int wilc_wlan_start(struct wilc *wilc)
 	else if (wilc->io_type == WILC_HIF_SPI)
 		reg = 1;
 
-	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
-	ret = wilc->hif_func->hif_write_reg(wilc, WILC_VMM_CORE_CFG, reg);
-	if (ret) {
-		pr_err("[wilc start]: fail write reg vmm_core_cfg...\n");
-		goto release;
-	}
+	ops[0] = WILC_REG_OP_WRITE(WILC_VMM_CORE_CFG, reg);
 
 	reg = 0;
 	if (wilc->io_type == WILC_HIF_SDIO_GPIO_IRQ)
@@ -1431,24 +2611,22 @@ int wilc_wlan_start(struct wilc *wilc)
 	if (wilc->chip == WILC_3000)
 		reg |= WILC_HAVE_SLEEP_CLK_SRC_RTC;
 
-	ret = wilc->hif_func->hif_write_reg(wilc, WILC_GP_REG_1, reg);
+	ops[1] = WILC_REG_OP_WRITE(WILC_GP_REG_1, reg);
+
+	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
+	ret = wilc_wlan_reg_batch(wilc, ops, 2);
 	if (ret) {
-		pr_err("[wilc start]: fail write WILC_GP_REG_1...\n");
+		pr_err("[wilc start]: fail write vmm_core_cfg/WILC_GP_REG_1...\n");
 		goto release;
 	}
 
 	wilc->hif_func->hif_sync_ext(wilc, NUM_INT_EXT);
 
-	wilc->hif_func->hif_read_reg(wilc, WILC_GLB_RESET_0, &reg);
-	if ((reg & BIT(10)) == BIT(10)) {
-		reg &= ~BIT(10);
-		wilc->hif_func->hif_write_reg(wilc, WILC_GLB_RESET_0, reg);
-		wilc->hif_func->hif_read_reg(wilc, WILC_GLB_RESET_0, &reg);
-	}
-
-	reg |= BIT(10);
-	ret = wilc->hif_func->hif_write_reg(wilc, WILC_GLB_RESET_0, reg);
-	wilc->hif_func->hif_read_reg(wilc, WILC_GLB_RESET_0, &reg);
+	/* make sure the CPU reset bit sees a rising edge */
+	ops[0] = WILC_REG_OP_CLEAR_DIFF(WILC_GLB_RESET_0, BIT(10));
+	ops[1] = WILC_REG_OP_SET(WILC_GLB_RESET_0, BIT(10));
+	ops[2] = WILC_REG_OP_READ(WILC_GLB_RESET_0, &reg);
+	ret = wilc_wlan_reg_batch(wilc, ops, 3);
 
 release:
 	release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
@@ -1515,6 +2693,17 @@ release:
 	return ret;
 }
 
+static void wilc_wlan_tx_batch_free(struct wilc *wilc)
+{
+	int i;
+
+	for (i = 0; i < WILC_TX_BATCH_NUM; i++) {
+		kfree(wilc->tx_batch[i].buffer);
+		wilc->tx_batch[i].buffer = NULL;
+	}
+	wilc->tx_xfer_batch = NULL;
+}
+
 void wilc_wlan_cleanup(struct net_device *dev)
 {
 	struct txq_entry_t *tqe;
@@ -1524,21 +2713,24 @@ void wilc_wlan_cleanup(struct net_device *dev)
 	struct wilc *wilc = vif->wilc;
 
 	wilc->quit = 1;
+	wilc_wlan_tx_flush(wilc);
 	for (ac = 0; ac < NQUEUES; ac++) {
 		while ((tqe = wilc_wlan_txq_remove_from_head(wilc, ac))) {
 			if (tqe->tx_complete_func)
 				tqe->tx_complete_func(tqe->priv, 0);
-			kfree(tqe);
+			wilc_wlan_txq_entry_put(wilc, tqe);
 		}
 	}
 
-	while ((rqe = wilc_wlan_rxq_remove(wilc)))
-		kfree(rqe);
+	/* the interrupt is gone by now, so this is the only consumer */
+	flush_work(&wilc->rx_work);
+	while ((rqe = wilc_wlan_rx_ring_peek(wilc)))
+		wilc_wlan_rx_ring_release(wilc, rqe);
 
 	kfree(wilc->rx_buffer);
 	wilc->rx_buffer = NULL;
-	kfree(wilc->tx_buffer);
-	wilc->tx_buffer = NULL;
+	wilc_wlan_rx_page_pool_deinit(wilc);
+	wilc_wlan_tx_batch_free(wilc);
 }
 
 static int wilc_wlan_cfg_commit(struct wilc_vif *vif, int type,
@@ -1700,41 +2892,32 @@ int wilc_send_config_pkt(struct wilc_vif *vif, u8 mode, struct wid *wids,
 static int init_chip(struct net_device *dev)
 {
 	u32 chipid;
-	u32 reg;
+	u32 reg = 0;
 	int ret = 0;
 	struct wilc_vif *vif = netdev_priv(dev);
 	struct wilc *wilc = vif->wilc;
+	struct wilc_reg_op ops[] = {
+		WILC_REG_OP_SET(WILC_CORTUS_RESET_MUX_SEL, BIT(0)),
+		WILC_REG_OP_WRITE(WILC_CORTUS_BOOT_REGISTER,
+				  WILC_CORTUS_BOOT_FROM_IRAM),
+	};
 
 	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
 
 	chipid = wilc_get_chipid(wilc, true);
 
-	ret = wilc->hif_func->hif_read_reg(wilc, WILC_CORTUS_RESET_MUX_SEL,
-					   &reg);
-	if (ret) {
-		PRINT_ER(vif->ndev, "fail read reg 0x1118\n");
-		goto end;
-	}
-
-	reg |= BIT(0);
-	ret = wilc->hif_func->hif_write_reg(wilc, WILC_CORTUS_RESET_MUX_SEL,
-					    reg);
-	if (ret) {
-		PRINT_ER(vif->ndev, "fail write reg 0x1118\n");
-		goto end;
-	}
-	ret = wilc->hif_func->hif_write_reg(wilc, WILC_CORTUS_BOOT_REGISTER,
-					    WILC_CORTUS_BOOT_FROM_IRAM);
+	ret = wilc_wlan_reg_batch(wilc, ops, ARRAY_SIZE(ops));
 	if (ret) {
-		PRINT_ER(vif->ndev, "fail write reg 0xc0000 ...\n");
+		PRINT_ER(vif->ndev, "fail to boot the chip from IRAM\n");
 		goto end;
 	}
 
 	if (wilc->chip == WILC_3000) {
-		ret = wilc->hif_func->hif_read_reg(wilc, 0x207ac, &reg);
-		PRINT_INFO(vif->ndev, INIT_DBG, "Bootrom sts = %x\n", reg);
-		ret = wilc->hif_func->hif_write_reg(wilc, 0x4f0000,
-						    0x71);
+		/* the bootrom status is only reported, a failed read is fine */
+		if (!wilc->hif_func->hif_read_reg(wilc, 0x207ac, &reg))
+			PRINT_INFO(vif->ndev, INIT_DBG, "Bootrom sts = %x\n",
+				   reg);
+		ret = wilc->hif_func->hif_write_reg(wilc, 0x4f0000, 0x71);
 		if (ret) {
 			PRINT_ER(vif->ndev, "fail write reg 0x4f0000 ...\n");
 			goto end;
@@ -1779,7 +2962,7 @@ u32 wilc_get_chipid(struct wilc *wilc, bool update)
 
 int wilc_wlan_init(struct net_device *dev)
 {
-	int ret = 0;
+	int ret = 0, i;
 	struct wilc_vif *vif = netdev_priv(dev);
 	struct wilc *wilc;
 
@@ -1797,13 +2980,16 @@ int wilc_wlan_init(struct net_device *dev)
 			goto fail;
 	}
 
-	if (!wilc->tx_buffer)
-		wilc->tx_buffer = kmalloc(WILC_TX_BUFF_SIZE, GFP_KERNEL);
+	for (i = 0; i < WILC_TX_BATCH_NUM; i++) {
+		if (!wilc->tx_batch[i].buffer)
+			wilc->tx_batch[i].buffer = kmalloc(WILC_TX_BUFF_SIZE,
+							   GFP_KERNEL);
 
-	if (!wilc->tx_buffer) {
-		ret = -ENOBUFS;
-		PRINT_ER(vif->ndev, "Can't allocate Tx Buffer");
-		goto fail;
+		if (!wilc->tx_batch[i].buffer) {
+			ret = -ENOBUFS;
+			PRINT_ER(vif->ndev, "Can't allocate Tx Buffer");
+			goto fail;
+		}
 	}
 
 	if (!wilc->rx_buffer)
@@ -1815,6 +3001,10 @@ int wilc_wlan_init(struct net_device *dev)
 		goto fail;
 	}
 
+	/* without the pool every transfer is read into rx_buffer and copied */
+	if (wilc_wlan_rx_page_pool_init(wilc))
+		PRINT_WRN(vif->ndev, INIT_DBG, "Can't create Rx page pool\n");
+
 	if (init_chip(dev)) {
 		ret = -EIO;
 		goto fail;
@@ -1826,8 +3016,12 @@ fail:
 
 	kfree(wilc->rx_buffer);
 	wilc->rx_buffer = NULL;
-	kfree(wilc->tx_buffer);
-	wilc->tx_buffer = NULL;
+	wilc_wlan_rx_page_pool_deinit(wilc);
+	wilc_wlan_tx_batch_free(wilc);
 
 	return ret;
 }
+
+#ifdef WILC_KUNIT_TEST
+#include "wlan_test.c"
+#endif
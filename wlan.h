@@ -9,6 +9,8 @@
 
 #include <linux/types.h>
 #include <linux/bitfield.h>
+#include <linux/uio.h>
+#include <linux/llist.h>
 
 /********************************************
  *
@@ -242,13 +244,36 @@ static inline bool is_wilc3000(u32 id)
 #define WILC_ABORT_REQ_BIT		BIT(31)
 
 #define WILC_RX_BUFF_SIZE	(96 * 1024)
+/* page-pool pages RX transfers are read into, larger ones use rx_buffer */
+#define WILC_RX_PAGE_ORDER	3
+#define WILC_RX_PAGE_SIZE	(PAGE_SIZE << WILC_RX_PAGE_ORDER)
+#define WILC_RX_PAGE_POOL_SIZE	16
+/* page references held per transfer, above any frame count it can carry */
+#define WILC_RX_PAGE_BIAS	WILC_RX_PAGE_SIZE
 #define WILC_TX_BUFF_SIZE	(64 * 1024)
 
+/* header, payload and padding segment per VMM entry */
+#define WILC_TX_VEC_MAX		(3 * WILC_VMM_TBL_SIZE)
+
+/* one batch is staged while the other is on the bus */
+#define WILC_TX_BATCH_NUM	2
+
 #define GPIO_NUM_CHIP_EN	94
 #define GPIO_NUM_RESET		60
 
 #define NQUEUES			4
-#define AC_BUFFER_SIZE		1000
+
+/*
+ * AC admission shares are fixed point with WILC_AC_SHARE_FRAC fraction
+ * bits and decay by 2^-WILC_AC_SHARE_SHIFT per offered frame, which
+ * remembers about the last thousand frames.
+ */
+#define WILC_AC_SHARE_FRAC	16
+#define WILC_AC_SHARE_SHIFT	10
+
+/* entries of the DSCP and 802.1D priority to AC tables */
+#define WILC_DSCP_NUM		64
+#define WILC_PRIO_NUM		8
 
 #define VO_AC_COUNT_FIELD		GENMASK(31, 25)
 #define VO_AC_ACM_STAT_FIELD		BIT(24)
@@ -357,6 +382,9 @@ enum ip_pkt_priority {
 
 struct txq_entry_t {
 	struct list_head list;
+	struct llist_node lnode;
+	bool queued;
+	u8 txq_num;
 	int type;
 	u8 q_num;
 	int ack_idx;
@@ -366,6 +394,8 @@ struct txq_entry_t {
 	int status;
 	struct wilc_vif *vif;
 	void (*tx_complete_func)(void *priv, int status);
+	/* enqueue time in ns, 0 unless TX latency tracking is on */
+	u64 ts_enq;
 };
 
 struct txq_fw_recv_queue_stat {
@@ -373,16 +403,65 @@ struct txq_fw_recv_queue_stat {
 	u8 count;
 };
 
+/*
+ * Producers push onto the lock-free head_add/tail_add lists; only the txq
+ * thread moves them onto txq_head and walks or unlinks entries there.
+ */
 struct txq_handle {
-	struct txq_entry_t txq_head;
-	u16 count;
+	struct llist_head head_add;
+	struct llist_head tail_add;
+	struct list_head txq_head;
+	atomic_t count;
 	struct txq_fw_recv_queue_stat fw;
 };
 
+/*
+ * VMM batch staged by the txq thread and written to the chip by the tx
+ * work. end[] and nvec_end[] give the batch length after each entry so
+ * it can be cut to the number of entries the firmware accepted.
+ */
+struct wilc_tx_batch {
+	u8 *buffer;
+	u32 size;
+	u32 hdr_offset;
+	struct kvec vec[WILC_TX_VEC_MAX];
+	int nvec;
+	struct txq_entry_t *tqe[WILC_VMM_TBL_SIZE];
+	u32 end[WILC_VMM_TBL_SIZE];
+	u16 nvec_end[WILC_VMM_TBL_SIZE];
+	int count;
+	/* selection and VMM accept times in ns for latency tracking */
+	u64 ts_sel;
+	u64 ts_vmm;
+};
+
 struct rxq_entry_t {
-	struct list_head list;
 	u8 *buffer;
 	int buffer_size;
+	/* page-pool page behind buffer and the references still unused */
+	struct page *page;
+	long page_refs;
+	/* header, payload and padding of the frame being parsed */
+	u32 frag_size;
+};
+
+#define WILC_RX_RING_SIZE	16
+
+/*
+ * RX transfers between the bus reader (producer) and frame processing
+ * (consumer). desc[head] belongs to the producer until head is published,
+ * desc[tail] to the consumer until tail is. Transfers not read into a page
+ * take rx_buffer space in FIFO order: [buf_tail, buf_head) is in use, the
+ * producer moves buf_head and the consumer buf_tail.
+ */
+struct wilc_rx_ring {
+	struct rxq_entry_t desc[WILC_RX_RING_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	u32 buf_head;
+	u32 buf_tail;
+	/* blocks read out and dropped for want of room */
+	unsigned long overruns;
 };
 
 enum wilc_chip_type {
@@ -396,6 +475,42 @@ enum wilc_chip_type {
  *
  ********************************************/
 struct wilc;
+
+/*
+ * Register access queued in a batch. READ stores the register in *out.
+ * RMW writes (reg & ~mask) | val back; RMW_DIFF does the same but skips
+ * the write when the bits already match. For both, *out (if set)
+ * receives the value left in the register.
+ */
+enum wilc_reg_op_type {
+	WILC_REG_READ,
+	WILC_REG_WRITE,
+	WILC_REG_RMW,
+	WILC_REG_RMW_DIFF,
+};
+
+struct wilc_reg_op {
+	u8 type;
+	u32 addr;
+	u32 val;
+	u32 mask;
+	u32 *out;
+};
+
+#define WILC_REG_OP(t, a, v, m, p)	((struct wilc_reg_op){ .type = (t), \
+					  .addr = (a), .val = (v), \
+					  .mask = (m), .out = (p) })
+#define WILC_REG_OP_READ(a, p)		WILC_REG_OP(WILC_REG_READ, a, 0, 0, p)
+#define WILC_REG_OP_WRITE(a, v)		WILC_REG_OP(WILC_REG_WRITE, a, v, 0, NULL)
+#define WILC_REG_OP_SET(a, b)		WILC_REG_OP(WILC_REG_RMW, a, b, b, NULL)
+#define WILC_REG_OP_CLEAR(a, b)		WILC_REG_OP(WILC_REG_RMW, a, 0, b, NULL)
+#define WILC_REG_OP_CLEAR_DIFF(a, b)	WILC_REG_OP(WILC_REG_RMW_DIFF, a, 0, b, \
+						    NULL)
+
+static inline u32 wilc_reg_op_apply(const struct wilc_reg_op *op, u32 reg)
+{
+	return (reg & ~op->mask) | op->val;
+}
 struct wilc_hif_func {
 	int (*hif_init)(struct wilc *wilc, bool resume);
 	int (*hif_deinit)(struct wilc *wilc);
@@ -407,8 +522,12 @@ struct wilc_hif_func {
 	int (*hif_clear_int_ext)(struct wilc *wilc, u32 val);
 	int (*hif_read_size)(struct wilc *wilc, u32 *size);
 	int (*hif_block_tx_ext)(struct wilc *wilc, u32 addr, u8 *buf, u32 size);
+	int (*hif_block_tx_ext_sg)(struct wilc *wilc, u32 addr,
+				   const struct kvec *vec, int nvec, u32 size);
 	int (*hif_block_rx_ext)(struct wilc *wilc, u32 addr, u8 *buf, u32 size);
 	int (*hif_sync_ext)(struct wilc *wilc, int nint);
+	int (*hif_xfer_batch)(struct wilc *wilc, struct wilc_reg_op *ops,
+			      int n);
 	int (*enable_interrupt)(struct wilc *nic);
 	void (*disable_interrupt)(struct wilc *nic);
 	int (*hif_reset)(struct wilc *wilc);
@@ -418,12 +537,17 @@ struct wilc_hif_func {
 
 #define WILC_MAX_CFG_FRAME_SIZE		1468
 
+/* Per-packet TX state of a data frame, kept in skb->cb */
 struct tx_complete_data {
 	int size;
 	void *buff;
 	struct sk_buff *skb;
+	/* BQL queue the frame was charged to, NULL for monitor injection */
+	struct netdev_queue *txq;
 };
 
+#define WILC_TX_CB(skb)		((struct tx_complete_data *)(skb)->cb)
+
 struct wilc_cfg_cmd_hdr {
 	u8 cmd_type;
 	u8 seq_no;
@@ -450,7 +574,7 @@ int wilc_wlan_stop(struct wilc *wilc, struct wilc_vif *vif);
 int wilc_wlan_txq_add_net_pkt(struct net_device *dev,
 			      struct tx_complete_data *tx_data, u8 *buffer,
 			      u32 buffer_size,
-			      void (*tx_complete_fn)(void *, int));
+			      void (*tx_complete_fn)(void *, int), u8 *ac);
 int wilc_wlan_handle_txq(struct wilc *wl, u32 *txq_count);
 void wilc_handle_isr(struct wilc *wilc);
 void wilc_wlan_cleanup(struct net_device *dev);
@@ -461,7 +585,10 @@ int wilc_wlan_cfg_get(struct wilc_vif *vif, int start, u16 wid, int commit,
 int wilc_wlan_txq_add_mgmt_pkt(struct net_device *dev, void *priv, u8 *buffer,
 			       u32 buffer_size, void (*func)(void *, int));
 void wilc_enable_tcp_ack_filter(struct wilc_vif *vif, bool value);
+void wilc_ack_filter_init(struct wilc_vif *vif);
+void wilc_ack_filter_flush(struct wilc_vif *vif);
 netdev_tx_t wilc_mac_xmit(struct sk_buff *skb, struct net_device *dev);
+u8 wilc_ac_classify(struct wilc *wilc, struct sk_buff *skb);
 
 bool wilc_wfi_p2p_rx(struct wilc_vif *vif, u8 *buff, u32 size);
 bool wilc_wfi_mgmt_frame_rx(struct wilc_vif *vif, u8 *buff, u32 size);
@@ -477,6 +604,23 @@ void eap_buff_timeout(struct timer_list *t);
 void acquire_bus(struct wilc *wilc, enum bus_acquire acquire, int source);
 void release_bus(struct wilc *wilc, enum bus_release release, int source);
 int wilc_wlan_init(struct net_device *dev);
+int wilc_wlan_txq_pool_init(struct wilc *wilc);
+void wilc_wlan_txq_pool_deinit(struct wilc *wilc);
+int wilc_wlan_tx_work_init(struct wilc *wilc);
+void wilc_wlan_tx_work_deinit(struct wilc *wilc);
+void wilc_wlan_tx_flush(struct wilc *wilc);
+int wilc_wlan_rx_work_init(struct wilc *wilc);
+void wilc_wlan_rx_work_deinit(struct wilc *wilc);
+void wilc_wlan_txq_kick(struct wilc *wilc);
+struct sk_buff *wilc_wlan_rx_skb(struct wilc *wilc, u8 *buff, u32 len,
+				 bool in_rx_buff);
+void wilc_wlan_ac_share_init(struct wilc *wilc);
+int wilc_wlan_ac_map_init(struct wilc *wilc);
+void wilc_wlan_ac_map_deinit(struct wilc *wilc);
+int wilc_wlan_ac_map_set(struct wilc *wilc, bool prio, unsigned int idx,
+			 u8 ac);
+int wilc_wlan_reg_op(struct wilc *wilc, struct wilc_reg_op *op);
+int wilc_wlan_reg_batch(struct wilc *wilc, struct wilc_reg_op *ops, int n);
 u32 wilc_get_chipid(struct wilc *wilc, bool update);
 void wilc_wfi_handle_monitor_rx(struct wilc *wilc, u8 *buff, u32 size);
 #endif
@@ -0,0 +1,1608 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit tests of the TX/RX queueing logic in wlan.c. This file is
+ * included at the end of wlan.c so the static helpers can be reached;
+ * build with CONFIG_WILC_KUNIT_TEST=y to get it.
+ */
+
+#include <kunit/test.h>
+
+static struct wilc *wilc_test_alloc(struct kunit *test)
+{
+	struct wilc *wl = kunit_kzalloc(test, sizeof(*wl), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, wl);
+	return wl;
+}
+
+/* the txq thread: take up to @n frames, one per non-empty AC in turn */
+static void wilc_test_drain(struct wilc *wl, int n)
+{
+	bool more = true;
+	int ac;
+
+	while (n && more) {
+		more = false;
+		for (ac = 0; ac < NQUEUES && n; ac++) {
+			if (!atomic_read(&wl->txq[ac].count))
+				continue;
+			atomic_dec(&wl->txq[ac].count);
+			more = true;
+			n--;
+		}
+	}
+}
+
+/* offer one frame to @ac, queueing it if admitted */
+static bool wilc_test_offer(struct wilc *wl, u8 ac)
+{
+	if (!is_ac_q_limit(wl, ac))
+		return false;
+
+	atomic_inc(&wl->txq[ac].count);
+	return true;
+}
+
+/*
+ * BE offers nine frames in ten and VO the tenth, faster than the txq
+ * thread drains. BE must be held to its slice of the limit while VO,
+ * which stays well within its own, is never refused.
+ */
+static void wilc_test_ac_share_flood(struct kunit *test)
+{
+	struct wilc *wl = wilc_test_alloc(test);
+	u32 refused[NQUEUES] = {}, max_be = 0;
+	int i;
+
+	wilc_wlan_ac_share_init(wl);
+	for (i = 0; i < 20000; i++) {
+		u8 ac = i % 10 ? AC_BE_Q : AC_VO_Q;
+
+		if (!wilc_test_offer(wl, ac))
+			refused[ac]++;
+		max_be = max_t(u32, max_be,
+			       atomic_read(&wl->txq[AC_BE_Q].count));
+
+		if (i % 16 == 15) {
+			wilc_wlan_ac_share_update(wl);
+			wilc_test_drain(wl, 8);
+		}
+	}
+
+	KUNIT_EXPECT_EQ(test, refused[AC_VO_Q], 0);
+	KUNIT_EXPECT_GT(test, refused[AC_BE_Q], 0);
+	KUNIT_EXPECT_LE(test, max_be, FLOW_CONTROL_UPPER_THRESHOLD + 1);
+}
+
+/* BE alone long enough for the other shares to decay to almost nothing */
+static void wilc_test_ac_share_be_only(struct wilc *wl)
+{
+	int i;
+
+	wilc_wlan_ac_share_init(wl);
+	for (i = 0; i < 8192; i++) {
+		wilc_test_offer(wl, AC_BE_Q);
+		if (i % 16 == 15) {
+			wilc_wlan_ac_share_update(wl);
+			wilc_test_drain(wl, 8);
+		}
+	}
+}
+
+/*
+ * After BE had the queue to itself, a VO burst still gets its first
+ * frame in, ac_min_share guarantees it a slice straight away, and once
+ * VO sends half the frames its share recovers within a few windows.
+ */
+static void wilc_test_ac_share_starvation(struct kunit *test)
+{
+	struct wilc *wl = wilc_test_alloc(test);
+	unsigned int min_share = ac_min_share;
+	int i, admitted;
+
+	wilc_test_ac_share_be_only(wl);
+	KUNIT_EXPECT_TRUE(test, wilc_test_offer(wl, AC_VO_Q));
+
+	atomic_set(&wl->txq[AC_VO_Q].count, 0);
+	ac_min_share = 10;
+	for (i = 0, admitted = 0; i < 64; i++)
+		admitted += wilc_test_offer(wl, AC_VO_Q);
+	ac_min_share = min_share;
+	/* count - 1 <= 10% of 256 admits counts 0 to 26 */
+	KUNIT_EXPECT_EQ(test, admitted, 27);
+
+	atomic_set(&wl->txq[AC_VO_Q].count, 0);
+	for (i = 0; i < 4096; i++) {
+		wilc_test_offer(wl, i % 2 ? AC_BE_Q : AC_VO_Q);
+		if (i % 16 == 15) {
+			wilc_wlan_ac_share_update(wl);
+			wilc_test_drain(wl, 8);
+		}
+	}
+	KUNIT_EXPECT_GE(test, (u64)wl->tx_ac_share.share[AC_VO_Q] * 10,
+			wl->tx_ac_share.total * 4);
+}
+
+/* a pass of more than 2^WILC_AC_SHARE_SHIFT frames replaces the history */
+static void wilc_test_ac_share_long_pass(struct kunit *test)
+{
+	struct wilc *wl = wilc_test_alloc(test);
+	struct wilc_ac_share *s = &wl->tx_ac_share;
+
+	wilc_wlan_ac_share_init(wl);
+	atomic_set(&s->offered[AC_VI_Q], 3 << WILC_AC_SHARE_SHIFT);
+	atomic_set(&s->offered[AC_BK_Q], 1 << WILC_AC_SHARE_SHIFT);
+	wilc_wlan_ac_share_update(wl);
+
+	KUNIT_EXPECT_EQ(test, s->share[AC_VO_Q], 0);
+	KUNIT_EXPECT_EQ(test, s->share[AC_BE_Q], 0);
+	KUNIT_EXPECT_EQ(test, s->share[AC_VI_Q],
+			3 << (WILC_AC_SHARE_FRAC - 2));
+	KUNIT_EXPECT_EQ(test, s->share[AC_BK_Q],
+			1 << (WILC_AC_SHARE_FRAC - 2));
+	KUNIT_EXPECT_EQ(test, s->total, 1ULL << WILC_AC_SHARE_FRAC);
+}
+
+/*
+ * Reference model of the admission is_ac_q_limit() did before the EWMA
+ * shares: a ring of the last 1000 offered ACs, where an AC may queue up
+ * to its count in the ring times FLOW_CONTROL_UPPER_THRESHOLD / 1000,
+ * plus one. The limit was a u8, so an AC holding the whole ring wrapped
+ * to 1; the mixes below stay clear of that.
+ */
+#define WILC_TEST_AC_RING	1000
+
+struct wilc_test_ac_ring {
+	u8 buffer[WILC_TEST_AC_RING];
+	u16 cnt[NQUEUES];
+	u16 end_index;
+};
+
+static void wilc_test_ac_ring_init(struct wilc_test_ac_ring *q)
+{
+	int i;
+
+	for (i = 0; i < WILC_TEST_AC_RING; i++)
+		q->buffer[i] = i % NQUEUES;
+	for (i = 0; i < NQUEUES; i++)
+		q->cnt[i] = WILC_TEST_AC_RING / NQUEUES;
+	q->end_index = WILC_TEST_AC_RING - 1;
+}
+
+static u8 wilc_test_ac_ring_limit(struct wilc_test_ac_ring *q, u8 ac)
+{
+	return q->cnt[ac] * FLOW_CONTROL_UPPER_THRESHOLD / WILC_TEST_AC_RING +
+	       1;
+}
+
+static bool wilc_test_ac_ring_offer(struct wilc_test_ac_ring *q, u8 ac,
+				    u32 count)
+{
+	q->cnt[q->buffer[q->end_index]]--;
+	q->cnt[ac]++;
+	q->buffer[q->end_index] = ac;
+	q->end_index = q->end_index ? q->end_index - 1 :
+				      WILC_TEST_AC_RING - 1;
+
+	return count <= wilc_test_ac_ring_limit(q, ac);
+}
+
+/* the queue depth the shares admit up to, as is_ac_q_limit() tests it */
+static u32 wilc_test_ac_share_limit(struct wilc *wl, u8 ac)
+{
+	struct wilc_ac_share *s = &wl->tx_ac_share;
+
+	return div64_u64(s->share[ac] * FLOW_CONTROL_UPPER_THRESHOLD,
+			 s->total) + 1;
+}
+
+#define WILC_TEST_AC_OFFERS	20000
+#define WILC_TEST_AC_WARMUP	2000
+
+/*
+ * Feed the same offered traffic to the shares and to the old ring, each
+ * with its own queue drained at half the offered rate and the shares
+ * updated every pass of 16 frames, so they are up to a pass stale.
+ *
+ * Per-frame decisions differ a lot, as both queues sit on their limit.
+ * But past the warmup the two limits stay within 1/8 of the threshold
+ * of each other, the window noise of two estimators of the same mix,
+ * and every AC gets within 1% of the frames in through either.
+ */
+static void wilc_test_ac_share_vs_ring(struct kunit *test)
+{
+	static const struct {
+		const char *name;
+		u8 pct[NQUEUES];
+	} mixes[] = {
+		{ "VO/BE 50/50", { 50, 0, 50, 0 } },
+		{ "VO/VI/BE 10/20/70", { 10, 20, 70, 0 } },
+		{ "even", { 25, 25, 25, 25 } },
+		{ "BE/BK 90/10", { 0, 0, 90, 10 } },
+	};
+	struct wilc_test_ac_ring *ring;
+	u32 admitted[2][NQUEUES];
+	struct wilc *wl, *ref;
+	u32 i, r, c, lcg, gap;
+	int m, ac;
+
+	ring = kunit_kzalloc(test, sizeof(*ring), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ring);
+
+	for (m = 0; m < ARRAY_SIZE(mixes); m++) {
+		wl = wilc_test_alloc(test);
+		ref = wilc_test_alloc(test);
+		wilc_wlan_ac_share_init(wl);
+		wilc_test_ac_ring_init(ring);
+		memset(admitted, 0, sizeof(admitted));
+		lcg = 1;
+		gap = 0;
+
+		for (i = 0; i < WILC_TEST_AC_OFFERS; i++) {
+			lcg = lcg * 1103515245 + 12345;
+			r = (lcg >> 16) % 100;
+			ac = 0;
+			c = mixes[m].pct[0];
+			while (r >= c)
+				c += mixes[m].pct[++ac];
+
+			admitted[0][ac] += wilc_test_offer(wl, ac);
+			if (wilc_test_ac_ring_offer(ring, ac,
+					atomic_read(&ref->txq[ac].count))) {
+				atomic_inc(&ref->txq[ac].count);
+				admitted[1][ac]++;
+			}
+
+			for (c = 0; i >= WILC_TEST_AC_WARMUP && c < NQUEUES;
+			     c++)
+				gap = max_t(u32, gap,
+					    abs((int)wilc_test_ac_share_limit(wl, c) -
+						(int)wilc_test_ac_ring_limit(ring, c)));
+
+			if (i % 16 == 15) {
+				wilc_wlan_ac_share_update(wl);
+				wilc_test_drain(wl, 8);
+				wilc_test_drain(ref, 8);
+			}
+		}
+
+		KUNIT_EXPECT_LE_MSG(test, gap, FLOW_CONTROL_UPPER_THRESHOLD / 8,
+				    "%s", mixes[m].name);
+		for (ac = 0; ac < NQUEUES; ac++)
+			KUNIT_EXPECT_LE_MSG(test,
+					    abs((int)admitted[0][ac] -
+						(int)admitted[1][ac]) * 100,
+					    admitted[1][ac], "%s AC %d",
+					    mixes[m].name, ac);
+		kunit_info(test, "%s: limits up to %u apart, admitted %u/%u/%u/%u, ring %u/%u/%u/%u\n",
+			   mixes[m].name, gap, admitted[0][0], admitted[0][1],
+			   admitted[0][2], admitted[0][3], admitted[1][0],
+			   admitted[1][1], admitted[1][2], admitted[1][3]);
+	}
+}
+
+static struct txq_entry_t wilc_test_tqe;
+
+/*
+ * One handle_txq() pass: pick up to @n frames of 1000 bytes from the
+ * ACs in @heads, then let the firmware take only the first @kept.
+ */
+static void wilc_test_sched_pass(struct wilc *wl,
+				 const struct wilc_tx_sched_ops *sched,
+				 u8 heads, int n, int kept, u32 *sent)
+{
+	struct wilc_tx_sched_ctx ctx = {};
+	u8 picked[WILC_VMM_TBL_SIZE];
+	int i, next;
+
+	for (i = 0; i < NQUEUES; i++) {
+		if (!(heads & BIT(i)))
+			continue;
+		ctx.head[i] = &wilc_test_tqe;
+		ctx.size[i] = 1000;
+	}
+
+	if (sched->begin)
+		sched->begin(wl, &ctx);
+	for (i = 0; i < n; i++) {
+		next = sched->pick(wl, &ctx);
+		if (next < 0)
+			break;
+		picked[i] = next;
+		ctx.staged[next] += ctx.size[next];
+	}
+
+	if (kept < i && sched->rewind)
+		sched->rewind(wl, &ctx, kept);
+	kept = min(kept, i);
+	for (i = 0; i < kept; i++) {
+		if (sched->charge)
+			sched->charge(wl, picked[i], ctx.size[picked[i]]);
+		sent[picked[i]]++;
+	}
+}
+
+/* BE is two frames up in the firmware, the other ACs get topped up first */
+static void wilc_test_sched_ratio(struct kunit *test)
+{
+	const struct wilc_tx_sched_ops *sched =
+		&wilc_tx_scheds[WILC_TX_SCHED_RATIO];
+	static const u8 order[] = {
+		AC_VO_Q, AC_VO_Q, AC_VO_Q, AC_BE_Q, AC_VO_Q, AC_BE_Q
+	};
+	struct wilc *wl = wilc_test_alloc(test);
+	struct wilc_tx_sched_ctx ctx = {};
+	int i;
+
+	wl->txq[AC_BE_Q].fw.count = 2;
+	ctx.head[AC_VO_Q] = &wilc_test_tqe;
+	ctx.head[AC_BE_Q] = &wilc_test_tqe;
+
+	KUNIT_ASSERT_EQ(test, sched->begin(wl, &ctx), 0);
+	for (i = 0; i < ARRAY_SIZE(order); i++)
+		KUNIT_EXPECT_EQ(test, sched->pick(wl, &ctx), order[i]);
+
+	ctx.head[AC_VO_Q] = NULL;
+	ctx.head[AC_BE_Q] = NULL;
+	KUNIT_EXPECT_EQ(test, sched->pick(wl, &ctx), -1);
+}
+
+/* with BE weighted 3 and VO 1, BE sends three frames for each of VO's */
+static void wilc_test_sched_drr_weights(struct kunit *test)
+{
+	const struct wilc_tx_sched_ops *sched =
+		&wilc_tx_scheds[WILC_TX_SCHED_DRR];
+	struct wilc *wl = wilc_test_alloc(test);
+	unsigned int weight = tx_sched_weight[AC_BE_Q];
+	u32 sent[NQUEUES] = {};
+	int i;
+
+	tx_sched_weight[AC_BE_Q] = 3;
+	for (i = 0; i < 50; i++)
+		wilc_test_sched_pass(wl, sched, BIT(AC_VO_Q) | BIT(AC_BE_Q),
+				     8, 8, sent);
+	tx_sched_weight[AC_BE_Q] = weight;
+
+	KUNIT_EXPECT_EQ(test, sent[AC_VO_Q], 100);
+	KUNIT_EXPECT_EQ(test, sent[AC_BE_Q], 300);
+	KUNIT_EXPECT_EQ(test, sent[AC_VI_Q] + sent[AC_BK_Q], 0);
+	KUNIT_EXPECT_EQ(test, wl->tx_sched.deficit[AC_VO_Q], 800);
+	KUNIT_EXPECT_EQ(test, wl->tx_sched.deficit[AC_BE_Q], 2400);
+}
+
+/*
+ * A pass the firmware cuts short must leave the scheduler where a pass
+ * that only picked the accepted frames would have, and one it refuses
+ * must leave it untouched. Cut every pass, the deficits stay bounded.
+ */
+static void wilc_test_sched_drr_cut(struct kunit *test)
+{
+	const struct wilc_tx_sched_ops *sched =
+		&wilc_tx_scheds[WILC_TX_SCHED_DRR];
+	struct wilc *cut = wilc_test_alloc(test);
+	struct wilc *full = wilc_test_alloc(test);
+	unsigned int weight = tx_sched_weight[AC_BE_Q];
+	u32 sent[NQUEUES] = {};
+	int i, ac;
+
+	wilc_test_sched_pass(cut, sched, 0xf, 8, 2, sent);
+	wilc_test_sched_pass(full, sched, 0xf, 2, 2, sent);
+	for (ac = 0; ac < NQUEUES; ac++)
+		KUNIT_EXPECT_EQ(test, cut->tx_sched.deficit[ac],
+				full->tx_sched.deficit[ac]);
+	KUNIT_EXPECT_EQ(test, cut->tx_sched.rr, full->tx_sched.rr);
+	KUNIT_EXPECT_EQ(test, cut->tx_sched.credited,
+			full->tx_sched.credited);
+	KUNIT_EXPECT_EQ(test, cut->tx_sched.deficit[AC_VO_Q], 600);
+	KUNIT_EXPECT_EQ(test, cut->tx_sched.rr, AC_VI_Q);
+
+	cut = wilc_test_alloc(test);
+	wilc_test_sched_pass(cut, sched, 0xf, 8, 0, sent);
+	KUNIT_EXPECT_EQ(test, cut->tx_sched.deficit[AC_VO_Q], 0);
+	KUNIT_EXPECT_EQ(test, cut->tx_sched.rr, 0);
+	KUNIT_EXPECT_FALSE(test, cut->tx_sched.credited);
+
+	cut = wilc_test_alloc(test);
+	memset(sent, 0, sizeof(sent));
+	tx_sched_weight[AC_BE_Q] = 3;
+	for (i = 0; i < 50; i++) {
+		wilc_test_sched_pass(cut, sched, BIT(AC_VO_Q) | BIT(AC_BE_Q),
+				     8, 3, sent);
+		for (ac = 0; ac < NQUEUES; ac++)
+			KUNIT_EXPECT_GE(test, cut->tx_sched.deficit[ac], 0);
+	}
+	tx_sched_weight[AC_BE_Q] = weight;
+
+	KUNIT_EXPECT_EQ(test, sent[AC_VO_Q], 38);
+	KUNIT_EXPECT_EQ(test, sent[AC_BE_Q], 112);
+}
+
+/* strict VO starves the round robin for as long as VO has frames */
+static void wilc_test_sched_drr_strict_vo(struct kunit *test)
+{
+	const struct wilc_tx_sched_ops *sched =
+		&wilc_tx_scheds[WILC_TX_SCHED_DRR];
+	struct wilc *wl = wilc_test_alloc(test);
+	bool strict_vo = tx_sched_strict_vo;
+	u32 sent[NQUEUES] = {};
+	int i;
+
+	tx_sched_strict_vo = true;
+	for (i = 0; i < 20; i++)
+		wilc_test_sched_pass(wl, sched, BIT(AC_VO_Q) | BIT(AC_BE_Q),
+				     8, 8, sent);
+	tx_sched_strict_vo = strict_vo;
+
+	KUNIT_EXPECT_EQ(test, sent[AC_VO_Q], 160);
+	KUNIT_EXPECT_EQ(test, sent[AC_BE_Q], 0);
+	KUNIT_EXPECT_EQ(test, wl->tx_sched.deficit[AC_VO_Q], 0);
+}
+
+/* the chip side of the RX tests: one block after another, tagged */
+static struct {
+	u32 size;
+	u32 seq;
+	u32 reads;
+	u32 clears;
+	u32 consumed;
+	u32 next;
+	u32 bad;
+} wilc_test_chip;
+
+static int wilc_test_read_reg(struct wilc *wl, u32 addr, u32 *data)
+{
+	/* clocks always on, a wakeup succeeds at once */
+	*data = U32_MAX;
+	return 0;
+}
+
+static int wilc_test_write_reg(struct wilc *wl, u32 addr, u32 data)
+{
+	return 0;
+}
+
+/* a block of wilc_test_chip.size is always pending */
+static int wilc_test_read_int(struct wilc *wl, u32 *int_status)
+{
+	*int_status = DATA_INT_EXT |
+		      FIELD_PREP(WILC_INTERRUPT_DATA_SIZE,
+				 wilc_test_chip.size >> 2);
+	return 0;
+}
+
+static int wilc_test_clear_int_ext(struct wilc *wl, u32 val)
+{
+	wilc_test_chip.clears++;
+	return 0;
+}
+
+static int wilc_test_block_rx_ext(struct wilc *wl, u32 addr, u8 *buf,
+				  u32 size)
+{
+	/* both ends, so a transfer overwritten in the ring shows */
+	put_unaligned_le32(wilc_test_chip.seq, buf);
+	put_unaligned_le32(wilc_test_chip.seq, buf + size - 4);
+	wilc_test_chip.seq++;
+	wilc_test_chip.reads++;
+	return 0;
+}
+
+/* processing stage that is slower than the bus */
+static void wilc_test_rx_consume(struct work_struct *work)
+{
+	struct wilc *wl = container_of(work, struct wilc, rx_work);
+	struct rxq_entry_t *rqe;
+	u32 seq;
+
+	while ((rqe = wilc_wlan_rx_ring_peek(wl))) {
+		seq = get_unaligned_le32(rqe->buffer);
+		if (seq < wilc_test_chip.next ||
+		    seq != get_unaligned_le32(rqe->buffer +
+					      rqe->buffer_size - 4))
+			wilc_test_chip.bad++;
+		wilc_test_chip.next = seq + 1;
+		wilc_test_chip.consumed++;
+
+		/* as frame delivery may end up on the bus */
+		if (wilc_test_chip.consumed % 8 == 0) {
+			mutex_lock(&wl->hif_cs);
+			mutex_unlock(&wl->hif_cs);
+		}
+		usleep_range(20, 40);
+		wilc_wlan_rx_ring_release(wl, rqe);
+	}
+}
+
+static const struct wilc_hif_func wilc_test_hif = {
+	.hif_read_reg = wilc_test_read_reg,
+	.hif_write_reg = wilc_test_write_reg,
+	.hif_read_int = wilc_test_read_int,
+	.hif_clear_int_ext = wilc_test_clear_int_ext,
+	.hif_block_rx_ext = wilc_test_block_rx_ext,
+};
+
+static struct wilc *wilc_test_rx_alloc(struct kunit *test)
+{
+	struct wilc *wl = wilc_test_alloc(test);
+
+	memset(&wilc_test_chip, 0, sizeof(wilc_test_chip));
+	wl->hif_func = &wilc_test_hif;
+	mutex_init(&wl->hif_cs);
+	wl->rx_buffer = kunit_kzalloc(test, WILC_RX_BUFF_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, wl->rx_buffer);
+	wl->rx_workqueue = alloc_ordered_workqueue("wilc_test_rx", 0);
+	KUNIT_ASSERT_NOT_NULL(test, wl->rx_workqueue);
+	INIT_WORK(&wl->rx_work, wilc_test_rx_consume);
+
+	return wl;
+}
+
+#define WILC_TEST_RX_BLOCKS	2000
+
+/*
+ * Blocks of up to 16K arrive faster than they are processed, so the
+ * ring and rx_buffer keep filling up; every 500th block is larger than
+ * rx_buffer. Every block must still be read exactly once, oversized
+ * ones dropped, and the rest delivered in order and intact. The
+ * processing stage takes hif_cs now and then, which deadlocks if the
+ * bus stage waits for it with the bus held.
+ */
+static void wilc_test_rx_overload(struct kunit *test)
+{
+	struct wilc *wl = wilc_test_rx_alloc(test);
+	u32 i, size, oversized = 0, lcg = 1;
+
+	for (i = 0; i < WILC_TEST_RX_BLOCKS; i++) {
+		lcg = lcg * 1103515245 + 12345;
+		size = ALIGN(64 + (lcg >> 16) % (16 * 1024), 4);
+		if (i % 500 == 499) {
+			size = WILC_RX_BUFF_SIZE + 4096;
+			oversized++;
+		}
+
+		acquire_bus(wl, WILC_BUS_ACQUIRE_ONLY, DEV_WIFI);
+		wilc_wlan_handle_isr_ext(wl, DATA_INT_EXT |
+					 FIELD_PREP(WILC_INTERRUPT_DATA_SIZE,
+						    size >> 2));
+		release_bus(wl, WILC_BUS_RELEASE_ONLY, DEV_WIFI);
+	}
+	flush_work(&wl->rx_work);
+	destroy_workqueue(wl->rx_workqueue);
+
+	KUNIT_EXPECT_EQ(test, wilc_test_chip.reads, WILC_TEST_RX_BLOCKS);
+	KUNIT_EXPECT_EQ(test, wilc_test_chip.clears, WILC_TEST_RX_BLOCKS);
+	KUNIT_EXPECT_EQ(test, wl->rx_ring.overruns, oversized);
+	KUNIT_EXPECT_EQ(test, wilc_test_chip.consumed,
+			WILC_TEST_RX_BLOCKS - oversized);
+	KUNIT_EXPECT_EQ(test, wilc_test_chip.bad, 0);
+}
+
+/*
+ * A poll burst counts the blocks it put in the ring and ends at the
+ * first one it had to drop, rather than reading on into more drops.
+ */
+static void wilc_test_rx_poll_overrun(struct kunit *test)
+{
+	struct wilc *wl = wilc_test_rx_alloc(test);
+	unsigned int budget = rx_poll_budget;
+
+	rx_poll_budget = 16;
+	wilc_test_chip.size = 1024;
+	acquire_bus(wl, WILC_BUS_ACQUIRE_ONLY, DEV_WIFI);
+	wilc_rx_poll(wl);
+	release_bus(wl, WILC_BUS_RELEASE_ONLY, DEV_WIFI);
+	KUNIT_EXPECT_EQ(test, wl->rx_poll_stats.polled, 16);
+
+	wilc_test_chip.size = WILC_RX_BUFF_SIZE + 4096;
+	acquire_bus(wl, WILC_BUS_ACQUIRE_ONLY, DEV_WIFI);
+	wilc_rx_poll(wl);
+	release_bus(wl, WILC_BUS_RELEASE_ONLY, DEV_WIFI);
+	rx_poll_budget = budget;
+	flush_work(&wl->rx_work);
+	destroy_workqueue(wl->rx_workqueue);
+
+	KUNIT_EXPECT_EQ(test, wl->rx_poll_stats.polled, 16);
+	KUNIT_EXPECT_EQ(test, wl->rx_poll_stats.bursts, 2);
+	KUNIT_EXPECT_EQ(test, wilc_test_chip.reads, 17);
+	KUNIT_EXPECT_EQ(test, wl->rx_ring.overruns, 1);
+	KUNIT_EXPECT_EQ(test, wilc_test_chip.consumed, 16);
+}
+
+/* the chip side of the NAPI test: blocks of tagged Ethernet frames */
+#define WILC_TEST_RX_FRAMES	8
+#define WILC_TEST_RX_FRAME_LEN	1500
+#define WILC_TEST_RX_FRAME_TP	ALIGN(HOST_HDR_OFFSET + WILC_TEST_RX_FRAME_LEN, 4)
+
+static struct {
+	u32 seq;
+	u32 next;
+	u32 bad;
+	u32 delivered;
+	u64 bytes;
+	u32 polls;
+	/* time spent in the processing stage, softirq delivery included */
+	u64 work_ns;
+} wilc_test_napi;
+
+static int wilc_test_napi_block_rx_ext(struct wilc *wl, u32 addr, u8 *buf,
+				       u32 size)
+{
+	u32 header;
+	u8 *frame;
+	int i;
+
+	for (i = 0; i < WILC_TEST_RX_FRAMES; i++) {
+		header = FIELD_PREP(WILC_PKT_HDR_OFFSET_FIELD,
+				    HOST_HDR_OFFSET) |
+			 FIELD_PREP(WILC_PKT_HDR_TOTAL_LEN_FIELD,
+				    WILC_TEST_RX_FRAME_TP) |
+			 FIELD_PREP(WILC_PKT_HDR_LEN_FIELD,
+				    WILC_TEST_RX_FRAME_LEN);
+		put_unaligned_le32(header, buf);
+		frame = buf + HOST_HDR_OFFSET;
+		eth_broadcast_addr(frame);
+		eth_zero_addr(frame + ETH_ALEN);
+		put_unaligned_be16(ETH_P_IP, frame + 2 * ETH_ALEN);
+		put_unaligned_le32(wilc_test_napi.seq++, frame + ETH_HLEN);
+		buf += WILC_TEST_RX_FRAME_TP;
+	}
+	return 0;
+}
+
+static const struct wilc_hif_func wilc_test_napi_hif = {
+	.hif_read_reg = wilc_test_read_reg,
+	.hif_write_reg = wilc_test_write_reg,
+	.hif_read_int = wilc_test_read_int,
+	.hif_clear_int_ext = wilc_test_clear_int_ext,
+	.hif_block_rx_ext = wilc_test_napi_block_rx_ext,
+};
+
+/* the stack above napi_gro_receive(), which a bare netdev cannot reach */
+static int wilc_test_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct wilc_vif *vif = container_of(napi, struct wilc_vif, napi);
+	struct sk_buff *skb;
+	int done = 0;
+
+	wilc_test_napi.polls++;
+	while (done < budget) {
+		skb = skb_dequeue(&vif->rx_napi_q);
+		if (!skb)
+			break;
+
+		if (get_unaligned_le32(skb->data) != wilc_test_napi.next)
+			wilc_test_napi.bad++;
+		wilc_test_napi.next++;
+		wilc_test_napi.delivered++;
+		wilc_test_napi.bytes += skb->len + ETH_HLEN;
+		consume_skb(skb);
+		done++;
+	}
+
+	if (done < budget)
+		napi_complete_done(napi, done);
+
+	return done;
+}
+
+static void wilc_test_napi_work(struct work_struct *work)
+{
+	struct wilc *wl = container_of(work, struct wilc, rx_work);
+	u64 ns = ktime_get_ns();
+
+	wilc_wlan_handle_rxq(wl);
+	wilc_test_napi.work_ns += ktime_get_ns() - ns;
+}
+
+#define WILC_TEST_RX_NAPI_BLOCKS	4000
+
+/*
+ * Blocks of eight full-size data frames go through the real processing
+ * stage to a vif whose poll stands in for the stack. Every frame must
+ * arrive once and in order, and each softirq pass must carry at least a
+ * block's worth, where netif_rx() took one per frame.
+ */
+static void wilc_test_rx_napi(struct kunit *test)
+{
+	struct wilc *wl = wilc_test_rx_alloc(test);
+	struct net_device *ndev = alloc_etherdev(sizeof(struct wilc_vif));
+	struct wilc_vif *vif;
+	u32 frames = WILC_TEST_RX_NAPI_BLOCKS * WILC_TEST_RX_FRAMES;
+	u64 ns;
+	int i;
+
+	KUNIT_ASSERT_NOT_NULL(test, ndev);
+	memset(&wilc_test_napi, 0, sizeof(wilc_test_napi));
+	wl->hif_func = &wilc_test_napi_hif;
+	wilc_test_chip.size = WILC_TEST_RX_FRAMES * WILC_TEST_RX_FRAME_TP;
+	INIT_WORK(&wl->rx_work, wilc_test_napi_work);
+	KUNIT_ASSERT_EQ(test, init_srcu_struct(&wl->srcu), 0);
+	INIT_LIST_HEAD(&wl->vif_list);
+
+	vif = netdev_priv(ndev);
+	vif->ndev = ndev;
+	vif->wilc = wl;
+	vif->iftype = WILC_MONITOR_MODE;
+	skb_queue_head_init(&vif->rx_napi_q);
+	netif_napi_add(ndev, &vif->napi, wilc_test_napi_poll);
+	/* what dev_open() would set, wilc_frmw_to_host() drops otherwise */
+	set_bit(__LINK_STATE_START, &ndev->state);
+	napi_enable(&vif->napi);
+	list_add_rcu(&vif->list, &wl->vif_list);
+
+	ns = ktime_get_ns();
+	for (i = 0; i < WILC_TEST_RX_NAPI_BLOCKS; i++) {
+		acquire_bus(wl, WILC_BUS_ACQUIRE_ONLY, DEV_WIFI);
+		wilc_wlan_handle_isr_ext(wl, DATA_INT_EXT |
+					 FIELD_PREP(WILC_INTERRUPT_DATA_SIZE,
+						    wilc_test_chip.size >> 2));
+		release_bus(wl, WILC_BUS_RELEASE_ONLY, DEV_WIFI);
+	}
+	flush_work(&wl->rx_work);
+	ns = ktime_get_ns() - ns;
+	destroy_workqueue(wl->rx_workqueue);
+
+	napi_disable(&vif->napi);
+	list_del_rcu(&vif->list);
+	synchronize_srcu(&wl->srcu);
+	cleanup_srcu_struct(&wl->srcu);
+
+	KUNIT_EXPECT_EQ(test, wilc_test_napi.delivered, frames);
+	KUNIT_EXPECT_EQ(test, wilc_test_napi.bad, 0);
+	KUNIT_EXPECT_EQ(test, vif->netstats.rx_dropped, 0);
+	KUNIT_EXPECT_LE(test, wilc_test_napi.polls * WILC_TEST_RX_FRAMES,
+			wilc_test_napi.delivered);
+	kunit_info(test, "%u frames in %llu us, %llu KB/s, %llu ns CPU per frame, %u frames per softirq pass\n",
+		   wilc_test_napi.delivered, div_u64(ns, NSEC_PER_USEC),
+		   div64_u64(wilc_test_napi.bytes * NSEC_PER_SEC,
+			     max_t(u64, ns, 1) * 1024),
+		   div_u64(wilc_test_napi.work_ns, frames),
+		   wilc_test_napi.delivered /
+		   max(wilc_test_napi.polls, 1U));
+
+	skb_queue_purge(&vif->rx_napi_q);
+	netif_napi_del(&vif->napi);
+	free_netdev(ndev);
+}
+
+/* the chip side of the TX tests: takes every VMM entry it is offered */
+static struct {
+	/* time each block transfer spends on the bus */
+	u32 lat_us;
+	u32 entries;
+	u32 batches;
+	u64 bytes;
+	u32 completed;
+	/* transfers during which the next batch was staged */
+	u32 overlapped;
+} wilc_test_tx_chip;
+
+static int wilc_test_tx_read_reg(struct wilc *wl, u32 addr, u32 *data)
+{
+	switch (addr) {
+	case WILC_HOST_TX_CTRL:
+	case WILC_INTERRUPT_CORTUS_0:
+		*data = 0;
+		break;
+	case WILC_HOST_VMM_CTL:
+		*data = FIELD_PREP(WILC_VMM_ENTRY_COUNT,
+				   wilc_test_tx_chip.entries);
+		break;
+	default:
+		/* clocks always on, a wakeup succeeds at once */
+		*data = U32_MAX;
+	}
+
+	return 0;
+}
+
+static void wilc_test_tx_bus_delay(void)
+{
+	if (wilc_test_tx_chip.lat_us)
+		usleep_range(wilc_test_tx_chip.lat_us,
+			     wilc_test_tx_chip.lat_us + 10);
+}
+
+/* the VMM table, terminated by a zero word */
+static int wilc_test_tx_block_tx(struct wilc *wl, u32 addr, u8 *buf,
+				 u32 size)
+{
+	wilc_test_tx_bus_delay();
+	wilc_test_tx_chip.entries = size / 4 - 1;
+	return 0;
+}
+
+static int wilc_test_tx_block_tx_ext(struct wilc *wl, u32 addr, u8 *buf,
+				     u32 size)
+{
+	struct wilc_tx_batch *next;
+
+	wilc_test_tx_bus_delay();
+	next = &wl->tx_batch[wl->tx_xfer_batch == &wl->tx_batch[0]];
+	if (READ_ONCE(next->count))
+		wilc_test_tx_chip.overlapped++;
+	wilc_test_tx_chip.batches++;
+	wilc_test_tx_chip.bytes += size;
+	return 0;
+}
+
+static const struct wilc_hif_func wilc_test_tx_hif = {
+	.hif_read_reg = wilc_test_tx_read_reg,
+	.hif_write_reg = wilc_test_write_reg,
+	.hif_block_tx = wilc_test_tx_block_tx,
+	.hif_clear_int_ext = wilc_test_clear_int_ext,
+	.hif_block_tx_ext = wilc_test_tx_block_tx_ext,
+};
+
+static struct wilc *wilc_test_tx_alloc(struct kunit *test)
+{
+	struct wilc *wl = wilc_test_alloc(test);
+	int i;
+
+	memset(&wilc_test_tx_chip, 0, sizeof(wilc_test_tx_chip));
+	wl->hif_func = &wilc_test_tx_hif;
+	wl->chip = WILC_3000;
+	wl->initialized = true;
+	mutex_init(&wl->hif_cs);
+	mutex_init(&wl->txq_add_to_head_cs);
+	init_completion(&wl->txq_event);
+	KUNIT_ASSERT_EQ(test, init_srcu_struct(&wl->srcu), 0);
+	INIT_LIST_HEAD(&wl->vif_list);
+	for (i = 0; i < NQUEUES; i++) {
+		init_llist_head(&wl->txq[i].head_add);
+		init_llist_head(&wl->txq[i].tail_add);
+		INIT_LIST_HEAD(&wl->txq[i].txq_head);
+	}
+	wilc_wlan_ac_share_init(wl);
+	for (i = 0; i < WILC_TX_BATCH_NUM; i++) {
+		wl->tx_batch[i].buffer = kunit_kzalloc(test, WILC_TX_BUFF_SIZE,
+						       GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, wl->tx_batch[i].buffer);
+	}
+	wl->txq_entry_pool =
+		mempool_create_kmalloc_pool(WILC_TXQ_POOL_RESERVE,
+					    sizeof(struct txq_entry_t));
+	KUNIT_ASSERT_NOT_NULL(test, wl->txq_entry_pool);
+	KUNIT_ASSERT_EQ(test, wilc_wlan_tx_work_init(wl), 0);
+
+	return wl;
+}
+
+static void wilc_test_tx_free(struct wilc *wl)
+{
+	struct txq_entry_t *tqe;
+	u8 ac;
+
+	wilc_wlan_tx_flush(wl);
+	for (ac = 0; ac < NQUEUES; ac++) {
+		while ((tqe = wilc_wlan_txq_remove_from_head(wl, ac))) {
+			if (tqe->tx_complete_func)
+				tqe->tx_complete_func(tqe->priv, 0);
+			wilc_wlan_txq_entry_put(wl, tqe);
+		}
+	}
+	wilc_wlan_tx_work_deinit(wl);
+	mempool_destroy(wl->txq_entry_pool);
+	cleanup_srcu_struct(&wl->srcu);
+}
+
+static void wilc_test_tx_done(void *priv, int status)
+{
+	wilc_test_tx_chip.completed++;
+}
+
+static u8 wilc_test_tx_frame[1500];
+
+/* queue @n management-sized frames of @size at the tail of @ac */
+static void wilc_test_tx_queue(struct kunit *test, struct wilc *wl, u8 ac,
+			       int n, u32 size)
+{
+	struct txq_entry_t *tqe;
+
+	while (n--) {
+		tqe = wilc_wlan_txq_entry_get(wl, GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, tqe);
+		tqe->type = WILC_MGMT_PKT;
+		tqe->buffer = wilc_test_tx_frame;
+		tqe->buffer_size = size;
+		tqe->tx_complete_func = wilc_test_tx_done;
+		tqe->priv = NULL;
+		tqe->q_num = ac;
+		tqe->ack_idx = NOT_TCP_ACK;
+		tqe->vif = NULL;
+		atomic_inc(&wl->txq[ac].count);
+		atomic_inc(&wl->txq_entries);
+		llist_add(&tqe->lnode, &wl->txq[ac].tail_add);
+	}
+}
+
+#define WILC_TEST_TX_PASSES	200
+#define WILC_TEST_TX_BURST	16
+
+/*
+ * Throughput of the TX pipeline over a bus where every block transfer
+ * takes lat_us. Each pass must stage its batch while the previous one
+ * is still being written, only waiting for it before the VMM request;
+ * the rates are reported to compare bus latencies and changes.
+ */
+static void wilc_test_tx_pipeline(struct kunit *test)
+{
+	static const u32 lat_us[] = { 100, 500, 2000 };
+	struct wilc *wl;
+	u32 count;
+	u64 ns;
+	int i, pass;
+
+	for (i = 0; i < ARRAY_SIZE(lat_us); i++) {
+		wl = wilc_test_tx_alloc(test);
+		wilc_test_tx_chip.lat_us = lat_us[i];
+
+		ns = ktime_get_ns();
+		for (pass = 0; pass < WILC_TEST_TX_PASSES; pass++) {
+			wilc_test_tx_queue(test, wl, AC_BE_Q,
+					   WILC_TEST_TX_BURST,
+					   sizeof(wilc_test_tx_frame));
+			KUNIT_ASSERT_EQ(test,
+					wilc_wlan_handle_txq(wl, &count), 0);
+			KUNIT_EXPECT_EQ(test, count, 0);
+		}
+		wilc_wlan_tx_flush(wl);
+		ns = ktime_get_ns() - ns;
+
+		KUNIT_EXPECT_EQ(test, wilc_test_tx_chip.batches,
+				WILC_TEST_TX_PASSES);
+		KUNIT_EXPECT_EQ(test, wilc_test_tx_chip.completed,
+				WILC_TEST_TX_PASSES * WILC_TEST_TX_BURST);
+		/* scheduling noise aside, every transfer but the last */
+		KUNIT_EXPECT_GE(test, wilc_test_tx_chip.overlapped * 4,
+				(WILC_TEST_TX_PASSES - 1) * 3);
+		kunit_info(test, "%u us per transfer: %llu KB/s, %u of %u batches staged ahead\n",
+			   lat_us[i],
+			   div64_u64(wilc_test_tx_chip.bytes * NSEC_PER_SEC,
+				     ns * 1024),
+			   wilc_test_tx_chip.overlapped,
+			   WILC_TEST_TX_PASSES - 1);
+		wilc_test_tx_free(wl);
+	}
+}
+
+/* a TCP segment to build, IPv4 unless v6 */
+struct wilc_test_tcp {
+	bool v6;
+	/* IPv6 extension header in front of TCP: 0, hop-by-hop or fragment */
+	u8 exthdr;
+	/* of the IPv4 header, or of the IPv6 fragment header */
+	u16 frag_off;
+	__be32 flags;
+	u16 sport;
+	u32 ack;
+	u32 payload;
+};
+
+static struct sk_buff *wilc_test_tcp_skb(struct kunit *test,
+					 const struct wilc_test_tcp *p)
+{
+	struct sk_buff *skb = alloc_skb(256, GFP_KERNEL);
+	struct ethhdr *eth;
+	struct tcphdr *th;
+
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	eth = skb_put_zero(skb, ETH_HLEN);
+	eth->h_proto = htons(p->v6 ? ETH_P_IPV6 : ETH_P_IP);
+
+	if (!p->v6) {
+		struct iphdr *iph = skb_put_zero(skb, sizeof(*iph));
+
+		iph->version = 4;
+		iph->ihl = 5;
+		iph->protocol = IPPROTO_TCP;
+		iph->frag_off = htons(p->frag_off);
+		iph->tot_len = htons(sizeof(*iph) + sizeof(*th) + p->payload);
+		iph->saddr = htonl(0xc0a80001);
+		iph->daddr = htonl(0xc0a80002);
+	} else {
+		struct ipv6hdr *ip6h = skb_put_zero(skb, sizeof(*ip6h));
+		u16 len = sizeof(*th) + p->payload;
+
+		ip6h->version = 6;
+		ip6h->nexthdr = IPPROTO_TCP;
+		ip6h->saddr.s6_addr[0] = 0x20;
+		ip6h->saddr.s6_addr[15] = 1;
+		ip6h->daddr.s6_addr[0] = 0x20;
+		ip6h->daddr.s6_addr[15] = 2;
+		if (p->exthdr == NEXTHDR_HOP) {
+			/* eight bytes, the options all Pad1 */
+			struct ipv6_opt_hdr *hop = skb_put_zero(skb, 8);
+
+			hop->nexthdr = IPPROTO_TCP;
+			ip6h->nexthdr = NEXTHDR_HOP;
+			len += 8;
+		} else if (p->exthdr == NEXTHDR_FRAGMENT) {
+			struct frag_hdr *fh = skb_put_zero(skb, sizeof(*fh));
+
+			fh->nexthdr = IPPROTO_TCP;
+			fh->frag_off = htons(p->frag_off);
+			ip6h->nexthdr = NEXTHDR_FRAGMENT;
+			len += sizeof(*fh);
+		}
+		ip6h->payload_len = htons(len);
+	}
+
+	th = skb_put_zero(skb, sizeof(*th));
+	th->source = htons(p->sport);
+	th->dest = htons(80);
+	th->ack_seq = htonl(p->ack);
+	th->doff = sizeof(*th) / 4;
+	tcp_flag_word(th) |= p->flags;
+	skb_put_zero(skb, p->payload);
+
+	return skb;
+}
+
+/* parse @p the way the enqueue path does, false if it is no pure ACK */
+static bool wilc_test_ack_parse(struct kunit *test,
+				const struct wilc_test_tcp *p,
+				struct wilc_ack_flow_key *key, u32 *ack)
+{
+	struct sk_buff *skb = wilc_test_tcp_skb(test, p);
+	struct txq_entry_t tqe = {
+		.buffer = skb->data,
+		.buffer_size = skb->len,
+		.priv = WILC_TX_CB(skb),
+	};
+	bool ret;
+
+	WILC_TX_CB(skb)->skb = skb;
+	ret = tcp_ack_parse(&tqe, key, ack);
+	kfree_skb(skb);
+
+	return ret;
+}
+
+static void wilc_test_ack_parse_v4(struct kunit *test)
+{
+	struct wilc_test_tcp p = {
+		.flags = TCP_FLAG_ACK, .sport = 5001, .ack = 0x12345678,
+	};
+	struct wilc_ack_flow_key key = {};
+	u32 ack;
+
+	KUNIT_ASSERT_TRUE(test, wilc_test_ack_parse(test, &p, &key, &ack));
+	KUNIT_EXPECT_EQ(test, ack, 0x12345678);
+	KUNIT_EXPECT_TRUE(test, ipv6_addr_v4mapped(&key.saddr));
+	KUNIT_EXPECT_EQ(test, key.saddr.s6_addr32[3], htonl(0xc0a80001));
+	KUNIT_EXPECT_EQ(test, key.daddr.s6_addr32[3], htonl(0xc0a80002));
+	KUNIT_EXPECT_EQ(test, key.sport, htons(5001));
+	KUNIT_EXPECT_EQ(test, key.dport, htons(80));
+
+	/* DF alone is no fragment */
+	p.frag_off = IP_DF;
+	KUNIT_EXPECT_TRUE(test, wilc_test_ack_parse(test, &p, &key, &ack));
+
+	/*
+	 * Neither the first nor a later fragment of a split segment; in the
+	 * later one the bytes after the IP header only look like an ACK.
+	 */
+	p.frag_off = IP_MF;
+	KUNIT_EXPECT_FALSE(test, wilc_test_ack_parse(test, &p, &key, &ack));
+	p.frag_off = 1;
+	KUNIT_EXPECT_FALSE(test, wilc_test_ack_parse(test, &p, &key, &ack));
+}
+
+/* the TCP header is found behind hop-by-hop options and atomic fragments */
+static void wilc_test_ack_parse_v6(struct kunit *test)
+{
+	static const u8 exthdr[] = { 0, NEXTHDR_HOP, NEXTHDR_FRAGMENT };
+	struct wilc_test_tcp p = {
+		.v6 = true, .flags = TCP_FLAG_ACK, .sport = 5001, .ack = 7,
+	};
+	struct wilc_ack_flow_key key;
+	u32 ack;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(exthdr); i++) {
+		memset(&key, 0, sizeof(key));
+		p.exthdr = exthdr[i];
+		KUNIT_ASSERT_TRUE(test,
+				  wilc_test_ack_parse(test, &p, &key, &ack));
+		KUNIT_EXPECT_EQ(test, ack, 7);
+		KUNIT_EXPECT_FALSE(test, ipv6_addr_v4mapped(&key.saddr));
+		KUNIT_EXPECT_EQ(test, key.saddr.s6_addr[15], 1);
+		KUNIT_EXPECT_EQ(test, key.daddr.s6_addr[15], 2);
+		KUNIT_EXPECT_EQ(test, key.sport, htons(5001));
+	}
+
+	/* neither the first nor a later fragment of a split segment */
+	p.exthdr = NEXTHDR_FRAGMENT;
+	p.frag_off = IP6_MF;
+	KUNIT_EXPECT_FALSE(test, wilc_test_ack_parse(test, &p, &key, &ack));
+	p.frag_off = 8 << 3;
+	KUNIT_EXPECT_FALSE(test, wilc_test_ack_parse(test, &p, &key, &ack));
+}
+
+/* segments with data or control flags are never taken for pure ACKs */
+static void wilc_test_ack_parse_not_ack(struct kunit *test)
+{
+	static const __be32 flags[] = {
+		0, TCP_FLAG_ACK | TCP_FLAG_SYN, TCP_FLAG_ACK | TCP_FLAG_FIN,
+		TCP_FLAG_ACK | TCP_FLAG_RST, TCP_FLAG_SYN,
+	};
+	struct wilc_test_tcp p = { .sport = 5001, .ack = 7 };
+	struct wilc_ack_flow_key key;
+	u32 ack;
+	int i, v6;
+
+	for (v6 = 0; v6 < 2; v6++) {
+		p.v6 = v6;
+		for (i = 0; i < ARRAY_SIZE(flags); i++) {
+			p.flags = flags[i];
+			KUNIT_EXPECT_FALSE(test, wilc_test_ack_parse(test, &p,
+								     &key,
+								     &ack));
+		}
+
+		p.flags = TCP_FLAG_ACK | TCP_FLAG_PSH;
+		p.payload = 100;
+		KUNIT_EXPECT_FALSE(test, wilc_test_ack_parse(test, &p, &key,
+							     &ack));
+		p.payload = 0;
+	}
+}
+
+static struct wilc_vif *wilc_test_vif_alloc(struct kunit *test,
+					    struct wilc *wl)
+{
+	struct net_device *ndev = alloc_etherdev(sizeof(struct wilc_vif));
+	struct wilc_vif *vif;
+
+	KUNIT_ASSERT_NOT_NULL(test, ndev);
+	vif = netdev_priv(ndev);
+	vif->ndev = ndev;
+	vif->wilc = wl;
+	wilc_ack_filter_init(vif);
+	wilc_enable_tcp_ack_filter(vif, true);
+
+	return vif;
+}
+
+static void wilc_test_vif_free(struct wilc_vif *vif)
+{
+	wilc_ack_filter_flush(vif);
+	free_netdev(vif->ndev);
+}
+
+static void wilc_test_ack_done(void *priv, int status)
+{
+	struct tx_complete_data *tx_data = priv;
+
+	wilc_test_tx_chip.completed++;
+	kfree_skb(tx_data->skb);
+}
+
+/* queue @p on @vif at the BE tail through the ACK filter, as xmit does */
+static void wilc_test_ack_queue(struct kunit *test, struct wilc_vif *vif,
+				const struct wilc_test_tcp *p)
+{
+	struct sk_buff *skb = wilc_test_tcp_skb(test, p);
+	struct wilc *wl = vif->wilc;
+	struct txq_entry_t *tqe;
+
+	WILC_TX_CB(skb)->skb = skb;
+	tqe = wilc_wlan_txq_entry_get(wl, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, tqe);
+	tqe->type = WILC_NET_PKT;
+	tqe->buffer = skb->data;
+	tqe->buffer_size = skb->len;
+	tqe->tx_complete_func = wilc_test_ack_done;
+	tqe->priv = WILC_TX_CB(skb);
+	tqe->q_num = AC_BE_Q;
+	tqe->ack_idx = NOT_TCP_ACK;
+	tqe->vif = vif;
+	tcp_process(vif->ndev, tqe);
+	atomic_inc(&wl->txq[AC_BE_Q].count);
+	atomic_inc(&wl->txq_entries);
+	llist_add(&tqe->lnode, &wl->txq[AC_BE_Q].tail_add);
+}
+
+/*
+ * One pass of the filter over interleaved v4 and v6 flows: per flow only
+ * the biggest ACK stays queued, in sequence space across a wrap, while
+ * data and FIN segments of the same flows are left alone.
+ */
+static void wilc_test_ack_filter_bigger_ack(struct kunit *test)
+{
+	static const struct wilc_test_tcp seg[] = {
+		{ .flags = TCP_FLAG_ACK, .sport = 1, .ack = 100 },
+		{ .v6 = true, .flags = TCP_FLAG_ACK, .sport = 1,
+		  .ack = 0xfffffff0 },
+		{ .flags = TCP_FLAG_ACK, .sport = 1, .ack = 300 },
+		{ .flags = TCP_FLAG_ACK | TCP_FLAG_PSH, .sport = 1,
+		  .ack = 50, .payload = 100 },
+		{ .v6 = true, .exthdr = NEXTHDR_HOP, .flags = TCP_FLAG_ACK,
+		  .sport = 1, .ack = 0x10 },
+		{ .flags = TCP_FLAG_ACK, .sport = 1, .ack = 200 },
+		{ .flags = TCP_FLAG_ACK | TCP_FLAG_FIN, .sport = 1,
+		  .ack = 150 },
+		{ .flags = TCP_FLAG_ACK, .sport = 2, .ack = 10 },
+	};
+	static const u32 kept[] = { 300, 0x10, 10 };
+	struct wilc *wl = wilc_test_tx_alloc(test);
+	struct wilc_vif *vif = wilc_test_vif_alloc(test, wl);
+	struct wilc_ack_flow_key key;
+	struct txq_entry_t *tqe;
+	int i, acks = 0;
+	u32 ack;
+
+	for (i = 0; i < ARRAY_SIZE(seg); i++)
+		wilc_test_ack_queue(test, vif, &seg[i]);
+	wilc_wlan_txq_drain(wl, AC_BE_Q);
+	wilc_wlan_txq_filter_dup_tcp_ack(vif->ndev);
+
+	KUNIT_EXPECT_EQ(test, wilc_test_tx_chip.completed, 3);
+	KUNIT_EXPECT_EQ(test, atomic_read(&wl->txq[AC_BE_Q].count), 5);
+	KUNIT_EXPECT_EQ(test, atomic_read(&wl->txq_entries), 5);
+
+	list_for_each_entry(tqe, &wl->txq[AC_BE_Q].txq_head, list) {
+		if (!tcp_ack_parse(tqe, &key, &ack))
+			continue;
+		KUNIT_ASSERT_LT(test, acks, ARRAY_SIZE(kept));
+		KUNIT_EXPECT_EQ(test, ack, kept[acks]);
+		acks++;
+	}
+	KUNIT_EXPECT_EQ(test, acks, ARRAY_SIZE(kept));
+
+	wilc_test_tx_free(wl);
+	wilc_test_vif_free(vif);
+}
+
+#define WILC_TEST_DUP_ACKS	200
+
+/*
+ * A TX pass that drops a long run of duplicate ACKs must not sleep for
+ * them: the filter used to wait up to 1 ms on txq_event per dropped ACK,
+ * which also swallowed the wakeups producers had posted.
+ */
+static void wilc_test_ack_filter_no_wait(struct kunit *test)
+{
+	struct wilc *wl = wilc_test_tx_alloc(test);
+	struct wilc_vif *vif = wilc_test_vif_alloc(test, wl);
+	struct wilc_test_tcp p = { .flags = TCP_FLAG_ACK, .sport = 1 };
+	u32 count;
+	u64 ns;
+	int i;
+
+	for (i = 0; i < WILC_TEST_DUP_ACKS; i++) {
+		p.ack = 1000 + i;
+		wilc_test_ack_queue(test, vif, &p);
+	}
+	/* the wakeup of the producer that queued them */
+	complete(&wl->txq_event);
+
+	ns = ktime_get_ns();
+	KUNIT_EXPECT_EQ(test, wilc_wlan_handle_txq(wl, &count), 0);
+	ns = ktime_get_ns() - ns;
+	wilc_wlan_tx_flush(wl);
+
+	KUNIT_EXPECT_EQ(test, count, 0);
+	KUNIT_EXPECT_EQ(test, wilc_test_tx_chip.batches, 1);
+	KUNIT_EXPECT_EQ(test, wilc_test_tx_chip.completed, WILC_TEST_DUP_ACKS);
+	KUNIT_EXPECT_EQ(test, wl->tx_batch[0].count + wl->tx_batch[1].count,
+			0);
+	/* far below the 1 ms per dropped ACK the wait used to cost */
+	KUNIT_EXPECT_LT(test, ns, 20 * NSEC_PER_MSEC);
+	KUNIT_EXPECT_TRUE(test, try_wait_for_completion(&wl->txq_event));
+	KUNIT_EXPECT_FALSE(test, completion_done(&wl->txq_event));
+	kunit_info(test, "%d duplicate ACKs dropped in %llu us\n",
+		   WILC_TEST_DUP_ACKS - 1, div_u64(ns, NSEC_PER_USEC));
+
+	wilc_test_tx_free(wl);
+	wilc_test_vif_free(vif);
+}
+
+#define WILC_TEST_BUS_REGS	16
+#define WILC_TEST_BUS_LOG	64
+
+struct wilc_test_bus_access {
+	bool write;
+	u32 addr;
+	u32 val;
+};
+
+/*
+ * Register file behind the bus-op counting tests. Each sequence runs
+ * once with single accesses (run 0) and once batched (run 1); both runs
+ * must make the same accesses, the batched one in fewer transactions.
+ */
+static struct {
+	u32 addr[WILC_TEST_BUS_REGS];
+	u32 val[WILC_TEST_BUS_REGS];
+	int nregs;
+	int run;
+	bool in_batch;
+	/* a read of this address fails, 0 for none */
+	u32 fail_addr;
+	struct wilc_test_bus_access log[2][WILC_TEST_BUS_LOG];
+	int nlog[2];
+	/* bus transactions, a batch counts once */
+	u32 xfers[2];
+} wilc_test_bus;
+
+static u32 *wilc_test_bus_reg(u32 addr)
+{
+	int i;
+
+	for (i = 0; i < wilc_test_bus.nregs; i++)
+		if (wilc_test_bus.addr[i] == addr)
+			return &wilc_test_bus.val[i];
+
+	if (WARN_ON(i == WILC_TEST_BUS_REGS))
+		i--;
+	else
+		wilc_test_bus.nregs++;
+	wilc_test_bus.addr[i] = addr;
+	wilc_test_bus.val[i] = 0;
+
+	return &wilc_test_bus.val[i];
+}
+
+static void wilc_test_bus_xfer(void)
+{
+	if (!wilc_test_bus.in_batch)
+		wilc_test_bus.xfers[wilc_test_bus.run]++;
+}
+
+static void wilc_test_bus_log(bool write, u32 addr, u32 val)
+{
+	int run = wilc_test_bus.run;
+
+	wilc_test_bus_xfer();
+	if (wilc_test_bus.nlog[run] < WILC_TEST_BUS_LOG)
+		wilc_test_bus.log[run][wilc_test_bus.nlog[run]++] =
+			(struct wilc_test_bus_access){ write, addr, val };
+}
+
+static int wilc_test_bus_read_reg(struct wilc *wl, u32 addr, u32 *data)
+{
+	if (addr == wilc_test_bus.fail_addr) {
+		wilc_test_bus_log(false, addr, 0);
+		return -EIO;
+	}
+
+	switch (addr) {
+	case WILC1000_SPI_CLK_STATUS_REG:
+	case WILC3000_SPI_CLK_STATUS_REG:
+		*data = U32_MAX;
+		break;
+	case WILC_HOST_VMM_CTL:
+		*data = WILC_VMM_ENTRY_AVAILABLE |
+			FIELD_PREP(WILC_VMM_ENTRY_COUNT,
+				   wilc_test_tx_chip.entries);
+		break;
+	default:
+		*data = *wilc_test_bus_reg(addr);
+	}
+	wilc_test_bus_log(false, addr, *data);
+
+	return 0;
+}
+
+static int wilc_test_bus_write_reg(struct wilc *wl, u32 addr, u32 data)
+{
+	/* the firmware takes its interrupt at once */
+	if (addr != WILC_INTERRUPT_CORTUS_0)
+		*wilc_test_bus_reg(addr) = data;
+	wilc_test_bus_log(true, addr, data);
+
+	return 0;
+}
+
+static int wilc_test_bus_xfer_batch(struct wilc *wl, struct wilc_reg_op *ops,
+				    int n)
+{
+	int i, ret = 0;
+
+	wilc_test_bus_xfer();
+	wilc_test_bus.in_batch = true;
+	for (i = 0; i < n && !ret; i++)
+		ret = wilc_wlan_reg_op(wl, &ops[i]);
+	wilc_test_bus.in_batch = false;
+
+	return ret;
+}
+
+static int wilc_test_bus_block_tx(struct wilc *wl, u32 addr, u8 *buf,
+				  u32 size)
+{
+	wilc_test_bus_xfer();
+	return wilc_test_tx_block_tx(wl, addr, buf, size);
+}
+
+static int wilc_test_bus_block_tx_ext(struct wilc *wl, u32 addr, u8 *buf,
+				      u32 size)
+{
+	wilc_test_bus_xfer();
+	return wilc_test_tx_block_tx_ext(wl, addr, buf, size);
+}
+
+static int wilc_test_bus_clear_int_ext(struct wilc *wl, u32 val)
+{
+	wilc_test_bus_xfer();
+	return 0;
+}
+
+static int wilc_test_bus_reset(struct wilc *wl)
+{
+	wilc_test_bus_xfer();
+	return 0;
+}
+
+static int wilc_test_bus_sync_ext(struct wilc *wl, int nint)
+{
+	wilc_test_bus_xfer();
+	return 0;
+}
+
+#define WILC_TEST_BUS_FUNCS \
+	.hif_read_reg = wilc_test_bus_read_reg, \
+	.hif_write_reg = wilc_test_bus_write_reg, \
+	.hif_block_tx = wilc_test_bus_block_tx, \
+	.hif_clear_int_ext = wilc_test_bus_clear_int_ext, \
+	.hif_block_tx_ext = wilc_test_bus_block_tx_ext, \
+	.hif_sync_ext = wilc_test_bus_sync_ext, \
+	.hif_reset = wilc_test_bus_reset
+
+static const struct wilc_hif_func wilc_test_bus_hif[2] = {
+	{ WILC_TEST_BUS_FUNCS },
+	{ WILC_TEST_BUS_FUNCS, .hif_xfer_batch = wilc_test_bus_xfer_batch },
+};
+
+static void wilc_test_bus_wake_sleep(struct kunit *test, struct wilc *wl)
+{
+	acquire_bus(wl, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
+	release_bus(wl, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
+}
+
+static void wilc_test_bus_start(struct kunit *test, struct wilc *wl)
+{
+	KUNIT_EXPECT_EQ(test, wilc_wlan_start(wl), 0);
+}
+
+static void wilc_test_bus_init_chip(struct kunit *test, struct wilc *wl)
+{
+	struct wilc_vif *vif = wilc_test_vif_alloc(test, wl);
+
+	KUNIT_EXPECT_EQ(test, init_chip(vif->ndev), 0);
+	wilc_test_vif_free(vif);
+}
+
+/* one frame through the WILC3000 VMM handshake and the data transfer */
+static void wilc_test_bus_vmm(struct kunit *test, struct wilc *wl)
+{
+	u32 count;
+
+	wilc_test_tx_queue(test, wl, AC_BE_Q, 1, 100);
+	KUNIT_EXPECT_EQ(test, wilc_wlan_handle_txq(wl, &count), 0);
+	wilc_wlan_tx_flush(wl);
+	KUNIT_EXPECT_EQ(test, wilc_test_tx_chip.completed, 1);
+}
+
+struct wilc_test_bus_seq {
+	const char *name;
+	enum wilc_chip_type chip;
+	void (*run)(struct kunit *test, struct wilc *wl);
+	/* bus transactions one access at a time and batched */
+	u32 xfers[2];
+};
+
+static void wilc_test_bus_seq_run(struct kunit *test,
+				  const struct wilc_test_bus_seq *seq)
+{
+	struct wilc *wl;
+	int run;
+
+	for (run = 0; run < 2; run++) {
+		wl = wilc_test_tx_alloc(test);
+		wl->chip = seq->chip;
+		wl->io_type = WILC_HIF_SPI;
+		wl->hif_func = &wilc_test_bus_hif[run];
+		wilc_test_bus.run = run;
+		wilc_test_bus.nregs = 0;
+		seq->run(test, wl);
+		wilc_test_tx_free(wl);
+	}
+}
+
+/*
+ * Every converted sequence makes the same register accesses in the same
+ * order batched or not, and the batches save the bus transactions below.
+ */
+static void wilc_test_bus_ops(struct kunit *test)
+{
+	static const struct wilc_test_bus_seq seqs[] = {
+		{ "wilc1000 wake/sleep", WILC_1000, wilc_test_bus_wake_sleep,
+		  { 9, 5 } },
+		{ "wilc3000 wake/sleep", WILC_3000, wilc_test_bus_wake_sleep,
+		  { 5, 3 } },
+		{ "wilc_wlan_start", WILC_3000, wilc_test_bus_start,
+		  { 12, 6 } },
+		{ "init_chip", WILC_3000, wilc_test_bus_init_chip, { 12, 8 } },
+		{ "wilc3000 vmm", WILC_3000, wilc_test_bus_vmm, { 18, 13 } },
+	};
+	const struct wilc_test_bus_seq *seq;
+	struct wilc_test_bus_access *a, *b;
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(seqs); i++) {
+		seq = &seqs[i];
+		memset(&wilc_test_bus, 0, sizeof(wilc_test_bus));
+		wilc_test_bus_seq_run(test, seq);
+
+		KUNIT_EXPECT_EQ_MSG(test, wilc_test_bus.xfers[0],
+				    seq->xfers[0], "%s", seq->name);
+		KUNIT_EXPECT_EQ_MSG(test, wilc_test_bus.xfers[1],
+				    seq->xfers[1], "%s", seq->name);
+		KUNIT_ASSERT_EQ_MSG(test, wilc_test_bus.nlog[0],
+				    wilc_test_bus.nlog[1], "%s", seq->name);
+		for (j = 0; j < wilc_test_bus.nlog[0]; j++) {
+			a = &wilc_test_bus.log[0][j];
+			b = &wilc_test_bus.log[1][j];
+			KUNIT_EXPECT_TRUE_MSG(test, a->write == b->write &&
+					      a->addr == b->addr &&
+					      a->val == b->val,
+					      "%s: access %d", seq->name, j);
+		}
+	}
+}
+
+/* the WILC3000 bootrom status read is best effort, as it always was */
+static void wilc_test_bus_init_chip_bootrom(struct kunit *test)
+{
+	static const struct wilc_test_bus_seq seq = {
+		"init_chip", WILC_3000, wilc_test_bus_init_chip,
+	};
+	struct wilc_test_bus_access *last;
+	int run;
+
+	memset(&wilc_test_bus, 0, sizeof(wilc_test_bus));
+	wilc_test_bus.fail_addr = 0x207ac;
+	wilc_test_bus_seq_run(test, &seq);
+
+	for (run = 0; run < 2; run++) {
+		KUNIT_ASSERT_GE(test, wilc_test_bus.nlog[run], 3);
+		/* before the allow-sleep read and write, the chip setup */
+		last = &wilc_test_bus.log[run][wilc_test_bus.nlog[run] - 3];
+		KUNIT_EXPECT_TRUE(test, last->write);
+		KUNIT_EXPECT_EQ(test, last->addr, 0x4f0000);
+		KUNIT_EXPECT_EQ(test, last->val, 0x71);
+	}
+}
+
+static struct kunit_case wilc_wlan_test_cases[] = {
+	KUNIT_CASE(wilc_test_ac_share_flood),
+	KUNIT_CASE(wilc_test_ac_share_starvation),
+	KUNIT_CASE(wilc_test_ac_share_long_pass),
+	KUNIT_CASE(wilc_test_ac_share_vs_ring),
+	KUNIT_CASE(wilc_test_sched_ratio),
+	KUNIT_CASE(wilc_test_sched_drr_weights),
+	KUNIT_CASE(wilc_test_sched_drr_cut),
+	KUNIT_CASE(wilc_test_sched_drr_strict_vo),
+	KUNIT_CASE(wilc_test_rx_overload),
+	KUNIT_CASE(wilc_test_rx_poll_overrun),
+	KUNIT_CASE(wilc_test_rx_napi),
+	KUNIT_CASE(wilc_test_tx_pipeline),
+	KUNIT_CASE(wilc_test_ack_parse_v4),
+	KUNIT_CASE(wilc_test_ack_parse_v6),
+	KUNIT_CASE(wilc_test_ack_parse_not_ack),
+	KUNIT_CASE(wilc_test_ack_filter_bigger_ack),
+	KUNIT_CASE(wilc_test_ack_filter_no_wait),
+	KUNIT_CASE(wilc_test_bus_ops),
+	KUNIT_CASE(wilc_test_bus_init_chip_bootrom),
+	{}
+};
+
+static struct kunit_suite wilc_wlan_test_suite = {
+	.name = "wilc-wlan",
+	.test_cases = wilc_wlan_test_cases,
+};
+
+kunit_test_suite(wilc_wlan_test_suite);